@@ -0,0 +1,399 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "mysqlfs.h"
+#include "bcache.h"
+#include "log.h"
+
+/*
+ * The block cache keeps copies of data_blocks rows, keyed by (inode, seq),
+ * within a memory budget.  It is filled by query_read() and by read-ahead,
+ * and kept current by the write path, which patches the cached copy of
+ * every block it writes once the write is committed.
+ *
+ * Replacement follows the 2Q policy, so that reading a large tree once
+ * (a backup, a tar, a grep -r) can't flush the working set:
+ *  - a block seen for the first time goes to the A1in FIFO, which holds a
+ *    quarter of the budget; hits there don't move it;
+ *  - blocks falling out of A1in leave their key behind in the A1out ghost
+ *    list, which has no data;
+ *  - a block read again while its key is in A1out goes to Am, an LRU list
+ *    holding the rest of the budget.
+ * A scan only ever churns A1in.
+ *
+ * Two generations are kept per slot of inodes.  The write generation is
+ * bumped by every write: bcache_put() drops rows read from the database
+ * before a write committed.  The epoch is bumped by bcache_invalidate():
+ * every entry records the epoch it was cached under, and an entry of an
+ * older epoch is dropped when found, which invalidates a whole inode in
+ * constant time.
+ *
+ * Same layout as the other caches: BCACHE_SHARDS independently locked hash
+ * tables with their own lists and an equal share of the budget.
+ */
+
+#define BCACHE_SHARDS	16
+#define BCACHE_BUCKETS	4096	/**< hash buckets per shard */
+#define BCACHE_GEN_SLOTS	4096
+
+/** Lists of the 2Q policy */
+enum bcache_list {
+    BC_A1IN,	/**< seen once, FIFO */
+    BC_AM,	/**< seen again, LRU */
+    BC_A1OUT,	/**< recently evicted from A1in, key only */
+    BC_LISTS
+};
+
+/** One cached data block */
+struct bcache_entry {
+    struct bcache_entry	*hnext;		/**< next entry in the hash chain */
+    struct bcache_entry	*prev,		/**< more recently queued entry of the same list */
+			*next;		/**< less recently queued entry of the same list */
+    enum bcache_list	list;		/**< list the entry is on */
+    long		inode;		/**< inode the block belongs to */
+    unsigned long	seq;		/**< sequence number of the block */
+    unsigned long	epoch;		/**< epoch of the inode the block was cached under */
+    size_t		len;		/**< bytes of data */
+    char		*data;		/**< data_block_size bytes, NULL on A1out */
+};
+
+/** A shard of the cache: hash table plus 2Q lists, under one mutex */
+struct bcache_shard {
+    pthread_mutex_t	lock;
+    struct bcache_entry	*buckets[BCACHE_BUCKETS];
+    struct bcache_entry	lists[BC_LISTS];	/**< list heads: lists[n].next is the newest */
+    unsigned int	count[BC_LISTS];	/**< entries on each list */
+};
+
+static struct bcache_shard *shards = NULL;
+static unsigned int shard_max_blocks = 0;	/**< A1in + Am */
+static unsigned int shard_a1in_blocks = 0;	/**< target size of A1in */
+static unsigned int shard_a1out_keys = 0;	/**< size of A1out */
+
+static unsigned long write_gen[BCACHE_GEN_SLOTS];
+static unsigned long epoch[BCACHE_GEN_SLOTS];
+
+static inline unsigned long bcache_hash(long inode, unsigned long seq)
+{
+    return (unsigned long)inode * 2654435761UL + seq;
+}
+
+static inline unsigned long bcache_slot(long inode)
+{
+    return (unsigned long)inode % BCACHE_GEN_SLOTS;
+}
+
+static inline unsigned long bcache_epoch(long inode)
+{
+    return __sync_add_and_fetch(&epoch[bcache_slot(inode)], 0);
+}
+
+static inline struct bcache_shard *bcache_shard(unsigned long hash)
+{
+    return &shards[hash % BCACHE_SHARDS];
+}
+
+static inline struct bcache_entry **bcache_bucket(struct bcache_shard *shard,
+						  unsigned long hash)
+{
+    return &shard->buckets[(hash / BCACHE_SHARDS) % BCACHE_BUCKETS];
+}
+
+static inline void list_unlink(struct bcache_shard *shard, struct bcache_entry *ent)
+{
+    ent->prev->next = ent->next;
+    ent->next->prev = ent->prev;
+    shard->count[ent->list]--;
+}
+
+static inline void list_push(struct bcache_shard *shard, struct bcache_entry *ent,
+			     enum bcache_list list)
+{
+    struct bcache_entry *head = &shard->lists[list];
+
+    ent->list = list;
+    ent->prev = head;
+    ent->next = head->next;
+    head->next->prev = ent;
+    head->next = ent;
+    shard->count[list]++;
+}
+
+/** Find the entry of (inode, seq).  Shard must be locked. */
+static struct bcache_entry *bcache_find(struct bcache_shard *shard, unsigned long hash,
+					long inode, unsigned long seq)
+{
+    struct bcache_entry *ent;
+
+    for (ent = *bcache_bucket(shard, hash); ent; ent = ent->hnext)
+	if (ent->inode == inode && ent->seq == seq)
+	    return ent;
+
+    return NULL;
+}
+
+/** Unhash and free an entry.  Shard must be locked. */
+static void bcache_remove(struct bcache_shard *shard, struct bcache_entry *ent)
+{
+    struct bcache_entry **pp = bcache_bucket(shard, bcache_hash(ent->inode, ent->seq));
+
+    while (*pp != ent)
+	pp = &(*pp)->hnext;
+    *pp = ent->hnext;
+
+    list_unlink(shard, ent);
+    free(ent->data);
+    free(ent);
+}
+
+/** Make room for one more block.  Shard must be locked. */
+static void bcache_reclaim(struct bcache_shard *shard)
+{
+    struct bcache_entry *ent;
+
+    while (shard->count[BC_A1IN] + shard->count[BC_AM] >= shard_max_blocks) {
+	if (shard->count[BC_A1IN] > shard_a1in_blocks || !shard->count[BC_AM]) {
+	    /* Demote the oldest A1in block to a ghost. */
+	    ent = shard->lists[BC_A1IN].prev;
+	    list_unlink(shard, ent);
+	    free(ent->data);
+	    ent->data = NULL;
+	    ent->len = 0;
+	    list_push(shard, ent, BC_A1OUT);
+	} else {
+	    bcache_remove(shard, shard->lists[BC_AM].prev);
+	}
+    }
+
+    while (shard->count[BC_A1OUT] > shard_a1out_keys)
+	bcache_remove(shard, shard->lists[BC_A1OUT].prev);
+}
+
+/**
+ * Find a valid cached block, dropping it if it belongs to an older epoch.
+ * Shard must be locked.
+ */
+static struct bcache_entry *bcache_find_valid(struct bcache_shard *shard, unsigned long hash,
+					      long inode, unsigned long seq)
+{
+    struct bcache_entry *ent = bcache_find(shard, hash, inode, seq);
+
+    if (ent && ent->list != BC_A1OUT && ent->epoch != bcache_epoch(inode)) {
+	bcache_remove(shard, ent);
+	ent = NULL;
+    }
+
+    return ent;
+}
+
+int bcache_init(size_t max_bytes)
+{
+    int i, l;
+
+    if (max_bytes / data_block_size < BCACHE_SHARDS) {
+	log_printf(LOG_INFO, "block cache disabled\n");
+	return 0;
+    }
+
+    shards = calloc(BCACHE_SHARDS, sizeof(struct bcache_shard));
+    if (!shards) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	return -ENOMEM;
+    }
+
+    for (i = 0; i < BCACHE_SHARDS; i++) {
+	pthread_mutex_init(&shards[i].lock, NULL);
+	for (l = 0; l < BC_LISTS; l++)
+	    shards[i].lists[l].next = shards[i].lists[l].prev = &shards[i].lists[l];
+    }
+    shard_max_blocks = max_bytes / data_block_size / BCACHE_SHARDS;
+    shard_a1in_blocks = MAX(shard_max_blocks / 4, 1);
+    shard_a1out_keys = MAX(shard_max_blocks / 2, 1);
+
+    log_printf(LOG_INFO, "block cache: %u blocks in %d shards\n",
+	       shard_max_blocks * BCACHE_SHARDS, BCACHE_SHARDS);
+
+    return 0;
+}
+
+void bcache_cleanup()
+{
+    int i, l;
+
+    if (!shards)
+	return;
+
+    for (i = 0; i < BCACHE_SHARDS; i++) {
+	pthread_mutex_lock(&shards[i].lock);
+	for (l = 0; l < BC_LISTS; l++)
+	    while (shards[i].lists[l].next != &shards[i].lists[l])
+		bcache_remove(&shards[i], shards[i].lists[l].next);
+	pthread_mutex_unlock(&shards[i].lock);
+	pthread_mutex_destroy(&shards[i].lock);
+    }
+
+    free(shards);
+    shards = NULL;
+}
+
+int bcache_enabled()
+{
+    return shards != NULL;
+}
+
+unsigned long bcache_generation(long inode)
+{
+    return __sync_add_and_fetch(&write_gen[bcache_slot(inode)], 0);
+}
+
+int bcache_get(long inode, unsigned long seq, char *buf, size_t *len)
+{
+    unsigned long hash;
+    struct bcache_shard *shard;
+    struct bcache_entry *ent;
+    int ret = 0;
+
+    if (!shards)
+	return 0;
+
+    hash = bcache_hash(inode, seq);
+    shard = bcache_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    ent = bcache_find_valid(shard, hash, inode, seq);
+    if (ent && ent->list != BC_A1OUT) {
+	if (ent->list == BC_AM) {
+	    list_unlink(shard, ent);
+	    list_push(shard, ent, BC_AM);
+	}
+	memcpy(buf, ent->data, ent->len);
+	*len = ent->len;
+	ret = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    log_printf(LOG_D_CACHE, "%s(%ld, %lu) => %s\n", __func__, inode, seq, ret ? "hit" : "miss");
+
+    return ret;
+}
+
+void bcache_put(long inode, unsigned long seq, const char *data, size_t len, unsigned long gen)
+{
+    unsigned long hash;
+    struct bcache_shard *shard;
+    struct bcache_entry *ent;
+    char *copy;
+
+    if (!shards || len > data_block_size)
+	return;
+
+    hash = bcache_hash(inode, seq);
+    shard = bcache_shard(hash);
+
+    copy = malloc(data_block_size);
+    if (!copy)
+	return;
+    memcpy(copy, data, len);
+
+    pthread_mutex_lock(&shard->lock);
+    if (gen != bcache_generation(inode)) {
+	/* Raced with a write, the data may be stale. */
+	pthread_mutex_unlock(&shard->lock);
+	free(copy);
+	return;
+    }
+
+    ent = bcache_find_valid(shard, hash, inode, seq);
+    if (ent && ent->list != BC_A1OUT) {
+	/* Already cached: refresh the data, leave the position alone. */
+	free(ent->data);
+    } else {
+	if (ent)
+	    list_unlink(shard, ent);
+	bcache_reclaim(shard);
+	if (!ent) {
+	    ent = malloc(sizeof(struct bcache_entry));
+	    if (!ent) {
+		pthread_mutex_unlock(&shard->lock);
+		free(copy);
+		return;
+	    }
+	    ent->inode = inode;
+	    ent->seq = seq;
+	    ent->hnext = *bcache_bucket(shard, hash);
+	    *bcache_bucket(shard, hash) = ent;
+	    list_push(shard, ent, BC_A1IN);
+	} else {
+	    /* Seen again shortly after it was evicted: part of the working set. */
+	    list_push(shard, ent, BC_AM);
+	}
+    }
+    ent->data = copy;
+    ent->len = len;
+    ent->epoch = bcache_epoch(inode);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void bcache_write(long inode, const char *data, size_t size, off_t offset)
+{
+    unsigned long seq, hash;
+    size_t lo, len;
+    struct bcache_shard *shard;
+    struct bcache_entry *ent;
+
+    if (!shards)
+	return;
+
+    while (size) {
+	seq = offset / data_block_size;
+	lo = offset % data_block_size;
+	len = MIN(data_block_size - lo, size);
+
+	hash = bcache_hash(inode, seq);
+	shard = bcache_shard(hash);
+
+	pthread_mutex_lock(&shard->lock);
+	/* Rows read before the write committed must not be cached after it. */
+	__sync_add_and_fetch(&write_gen[bcache_slot(inode)], 1);
+	ent = bcache_find_valid(shard, hash, inode, seq);
+	if (ent && ent->list != BC_A1OUT) {
+	    /* Same as write_one_block(): a gap before the data reads as zeroes. */
+	    if (lo > ent->len)
+		memset(ent->data + ent->len, 0, lo - ent->len);
+	    memcpy(ent->data + lo, data, len);
+	    if (lo + len > ent->len)
+		ent->len = lo + len;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	data += len;
+	offset += len;
+	size -= len;
+    }
+}
+
+void bcache_invalidate(long inode)
+{
+    if (!shards)
+	return;
+
+    /* Entries of the old epoch are dropped as they are found. */
+    __sync_add_and_fetch(&write_gen[bcache_slot(inode)], 1);
+    __sync_add_and_fetch(&epoch[bcache_slot(inode)], 1);
+
+    log_printf(LOG_D_CACHE, "%s(%ld)\n", __func__, inode);
+}
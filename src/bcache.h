@@ -0,0 +1,33 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Initialize the data block cache; a max_bytes of less than a block per shard disables the cache */
+int bcache_init(size_t max_bytes);
+
+/** Drop every cached block and release the cache memory */
+void bcache_cleanup();
+
+/** Whether the cache is enabled */
+int bcache_enabled();
+
+/** Invalidation generation of inode, to be sampled before querying the database and passed back to bcache_put() */
+unsigned long bcache_generation(long inode);
+
+/** Copy block seq of inode into buf (data_block_size bytes) and its length into len: 1 on hit, 0 on miss */
+int bcache_get(long inode, unsigned long seq, char *buf, size_t *len);
+
+/** Remember block seq of inode, as read from the database under generation gen */
+void bcache_put(long inode, unsigned long seq, const char *data, size_t len, unsigned long gen);
+
+/** Apply a committed write to the cached blocks of inode */
+void bcache_write(long inode, const char *data, size_t size, off_t offset);
+
+/** Forget every cached block of inode */
+void bcache_invalidate(long inode);
@@ -0,0 +1,135 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "log.h"
+
+/*
+ * Blocks are compressed by the client, so that they take less room on the
+ * wire and in the server's buffer pool.  The codec is recorded with every
+ * block, which lets the codec change between mounts: old blocks stay
+ * readable as long as their codec is compiled in.  A block is stored
+ * compressed only if that makes it smaller, so a stored block never
+ * exceeds the block size.
+ */
+
+/** Zstandard level: fast enough to keep up with writes, still well ahead of LZ4 on ratio */
+#define ZSTD_LEVEL	3
+
+static int codec = CODEC_NONE;
+
+int compress_init(const char *name)
+{
+    if (!name || !strcmp(name, "none")) {
+	codec = CODEC_NONE;
+	return 0;
+    }
+#ifdef HAVE_LZ4
+    if (!strcmp(name, "lz4")) {
+	codec = CODEC_LZ4;
+	log_printf(LOG_INFO, "compression: lz4\n");
+	return 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (!strcmp(name, "zstd")) {
+	codec = CODEC_ZSTD;
+	log_printf(LOG_INFO, "compression: zstd, level %d\n", ZSTD_LEVEL);
+	return 0;
+    }
+#endif
+
+    log_printf(LOG_ERROR, "Unsupported compression: %s\n", name);
+    return -EINVAL;
+}
+
+int compress_codec()
+{
+    return codec;
+}
+
+int compress_block(const char *src, size_t len, char *dst, size_t *dst_len)
+{
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+	/* Returns 0 when the result doesn't fit, i.e. doesn't save anything. */
+	int ret = LZ4_compress_default(src, dst, len, len - 1);
+
+	if (ret > 0) {
+	    *dst_len = ret;
+	    return CODEC_LZ4;
+	}
+	break;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+	size_t ret = ZSTD_compress(dst, len - 1, src, len, ZSTD_LEVEL);
+
+	if (!ZSTD_isError(ret)) {
+	    *dst_len = ret;
+	    return CODEC_ZSTD;
+	}
+	break;
+    }
+#endif
+    default:
+	break;
+    }
+
+    *dst_len = len;
+    return CODEC_NONE;
+}
+
+long uncompress_block(int block_codec, const char *src, size_t len, char *dst, size_t max)
+{
+    switch (block_codec) {
+    case CODEC_NONE:
+	len = len < max ? len : max;
+	memcpy(dst, src, len);
+	return len;
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+	int ret = LZ4_decompress_safe(src, dst, len, max);
+
+	if (ret >= 0)
+	    return ret;
+	log_printf(LOG_ERROR, "%s(): corrupt lz4 block\n", __func__);
+	return -EIO;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+	size_t ret = ZSTD_decompress(dst, max, src, len);
+
+	if (!ZSTD_isError(ret))
+	    return ret;
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, ZSTD_getErrorName(ret));
+	return -EIO;
+    }
+#endif
+    default:
+	log_printf(LOG_ERROR, "%s(): codec %d is not compiled in\n", __func__, block_codec);
+	return -EIO;
+    }
+}
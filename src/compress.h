@@ -0,0 +1,26 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Codecs of data_blocks.codec */
+#define CODEC_NONE	0	/**< stored as is */
+#define CODEC_LZ4	1	/**< LZ4 block format */
+#define CODEC_ZSTD	2	/**< Zstandard frame */
+
+/** Select the codec of the blocks written from now on: "none", "lz4" or "zstd" (NULL for none) */
+int compress_init(const char *name);
+
+/** Codec of the blocks written from now on, CODEC_NONE if compression is off */
+int compress_codec();
+
+/** Compress len bytes of src into dst (len bytes available), its length in *dst_len: the codec used, CODEC_NONE if that saves nothing */
+int compress_block(const char *src, size_t len, char *dst, size_t *dst_len);
+
+/** Decompress a block stored with codec into dst (max bytes): its length, or -EIO */
+long uncompress_block(int codec, const char *src, size_t len, char *dst, size_t max);
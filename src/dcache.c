@@ -0,0 +1,336 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dcache.h"
+#include "log.h"
+
+/*
+ * The dentry cache maps (parent inode, name) to the inode of a tree row,
+ * which is exactly what every step of a path walk needs.  Keying on the
+ * parent rather than on the full path means that renaming a directory only
+ * invalidates the directory's own entry: its children are keyed by the
+ * directory inode, which doesn't change.
+ *
+ * Names known not to exist are cached too, as negative entries with an
+ * expiry time, so that build tools and shells probing for missing files
+ * don't run a path lookup in the database every time.  Negative entries
+ * have their own LRU list and their own cap, so a burst of misses can't
+ * push the positive entries out.
+ *
+ * The cache is split in DCACHE_SHARDS independently locked shards, each with
+ * its own hash table and LRU lists and an equal share of the memory budget.
+ */
+
+#define DCACHE_SHARDS	16
+#define DCACHE_BUCKETS	4096	/**< hash buckets per shard */
+
+/** One cached directory entry */
+struct dcache_entry {
+    struct dcache_entry	*hnext;		/**< next entry in the hash chain */
+    struct dcache_entry	*lru_prev,	/**< more recently used entry */
+			*lru_next;	/**< less recently used entry */
+    unsigned long	hash;		/**< full hash of (parent, name) */
+    size_t		size;		/**< bytes charged to the shard */
+    long		parent;		/**< inode of the directory holding the entry */
+    long		inode;		/**< inode the entry resolves to, 0 for a negative entry */
+    time_t		expires;	/**< expiry time of a negative entry */
+    char		name[];		/**< name of the entry, as stored in the tree table */
+};
+
+/** A shard of the cache: hash table plus LRU list, under one mutex */
+struct dcache_shard {
+    pthread_mutex_t	lock;
+    struct dcache_entry	*buckets[DCACHE_BUCKETS];
+    struct dcache_entry	lru;		/**< list head: lru.lru_next is the most recently used */
+    struct dcache_entry	nlru;		/**< same as lru, for negative entries */
+    size_t		bytes;		/**< memory currently charged */
+    unsigned int	negatives;	/**< number of negative entries */
+};
+
+static struct dcache_shard *shards = NULL;
+static size_t shard_max_bytes = 0;
+static unsigned int shard_max_negatives = 0;
+static unsigned int negative_ttl = 0;
+
+/*
+ * Invalidation generations, one per slot of names.  A lookup that misses
+ * samples the generation of each name before querying the database and
+ * hands it back to dcache_insert(), which drops the result if that name was
+ * invalidated in the meantime: the row may have been read before a
+ * concurrent unlink or rename committed.
+ */
+#define DCACHE_GEN_SLOTS	64
+static unsigned long generation[DCACHE_GEN_SLOTS];
+
+/*
+ * The tree table uses a case-insensitive collation, so "Foo" and "foo"
+ * name the same row.  Hash on the folded name so every spelling lands in
+ * the same chain and dcache_invalidate() can catch all of them.
+ */
+static unsigned long dcache_hash(long parent, const char *name)
+{
+    unsigned long hash = 2166136261UL ^ (unsigned long)parent;
+
+    for (; *name; name++)
+	hash = (hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619UL;
+
+    return hash;
+}
+
+static inline unsigned long *dcache_gen_slot(const char *name)
+{
+    return &generation[dcache_hash(0, name) % DCACHE_GEN_SLOTS];
+}
+
+static inline struct dcache_shard *dcache_shard(unsigned long hash)
+{
+    return &shards[hash % DCACHE_SHARDS];
+}
+
+static inline struct dcache_entry **dcache_bucket(struct dcache_shard *shard,
+						  unsigned long hash)
+{
+    return &shard->buckets[(hash / DCACHE_SHARDS) % DCACHE_BUCKETS];
+}
+
+static inline void lru_unlink(struct dcache_entry *ent)
+{
+    ent->lru_prev->lru_next = ent->lru_next;
+    ent->lru_next->lru_prev = ent->lru_prev;
+}
+
+static inline void lru_push(struct dcache_shard *shard, struct dcache_entry *ent)
+{
+    struct dcache_entry *head = ent->inode ? &shard->lru : &shard->nlru;
+
+    ent->lru_prev = head;
+    ent->lru_next = head->lru_next;
+    head->lru_next->lru_prev = ent;
+    head->lru_next = ent;
+}
+
+/** Unhash and free an entry.  Shard must be locked. */
+static void dcache_remove(struct dcache_shard *shard, struct dcache_entry *ent)
+{
+    struct dcache_entry **pp = dcache_bucket(shard, ent->hash);
+
+    while (*pp != ent)
+	pp = &(*pp)->hnext;
+    *pp = ent->hnext;
+
+    lru_unlink(ent);
+    shard->bytes -= ent->size;
+    if (!ent->inode)
+	shard->negatives--;
+    free(ent);
+}
+
+/** Drop the least recently used entry, negative ones first.  Shard must be locked. */
+static void dcache_evict(struct dcache_shard *shard)
+{
+    if (shard->nlru.lru_prev != &shard->nlru)
+	dcache_remove(shard, shard->nlru.lru_prev);
+    else
+	dcache_remove(shard, shard->lru.lru_prev);
+}
+
+/** Common part of dcache_insert() and dcache_insert_negative() */
+static void dcache_add(long parent, const char *name, long inode, unsigned long gen)
+{
+    unsigned long hash;
+    size_t size;
+    struct dcache_shard *shard;
+    struct dcache_entry *ent, *old, **bucket;
+
+    if (!shards)
+	return;
+
+    size = sizeof(struct dcache_entry) + strlen(name) + 1;
+    if (size > shard_max_bytes)
+	return;
+
+    hash = dcache_hash(parent, name);
+    shard = dcache_shard(hash);
+    bucket = dcache_bucket(shard, hash);
+
+    ent = malloc(size);
+    if (!ent)
+	return;
+    ent->hash = hash;
+    ent->size = size;
+    ent->parent = parent;
+    ent->inode = inode;
+    ent->expires = inode ? 0 : time(NULL) + negative_ttl;
+    strcpy(ent->name, name);
+
+    pthread_mutex_lock(&shard->lock);
+    if (gen != dcache_generation(name)) {
+	/* Raced with an invalidation, the result may be stale. */
+	pthread_mutex_unlock(&shard->lock);
+	free(ent);
+	return;
+    }
+
+    /* Replace any existing entry for the same name. */
+    for (old = *bucket; old; old = old->hnext) {
+	if (old->hash == hash && old->parent == parent && !strcmp(old->name, name)) {
+	    dcache_remove(shard, old);
+	    break;
+	}
+    }
+
+    if (!inode && shard->negatives >= shard_max_negatives)
+	dcache_evict(shard);
+    while (shard->bytes + size > shard_max_bytes)
+	dcache_evict(shard);
+
+    ent->hnext = *bucket;
+    *bucket = ent;
+    lru_push(shard, ent);
+    shard->bytes += size;
+    if (!inode)
+	shard->negatives++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int dcache_init(size_t max_bytes, unsigned int neg_ttl, unsigned int neg_max)
+{
+    int i;
+
+    if (max_bytes == 0) {
+	log_printf(LOG_INFO, "dentry cache disabled\n");
+	return 0;
+    }
+
+    shards = calloc(DCACHE_SHARDS, sizeof(struct dcache_shard));
+    if (!shards) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	return -ENOMEM;
+    }
+
+    for (i = 0; i < DCACHE_SHARDS; i++) {
+	pthread_mutex_init(&shards[i].lock, NULL);
+	shards[i].lru.lru_next = shards[i].lru.lru_prev = &shards[i].lru;
+	shards[i].nlru.lru_next = shards[i].nlru.lru_prev = &shards[i].nlru;
+    }
+    shard_max_bytes = max_bytes / DCACHE_SHARDS;
+    negative_ttl = neg_max ? neg_ttl : 0;
+    shard_max_negatives = neg_ttl ? (neg_max + DCACHE_SHARDS - 1) / DCACHE_SHARDS : 0;
+
+    log_printf(LOG_INFO, "dentry cache: %zu bytes in %d shards, "
+	       "%u negative entries for %us\n",
+	       max_bytes, DCACHE_SHARDS, shard_max_negatives * DCACHE_SHARDS, negative_ttl);
+
+    return 0;
+}
+
+void dcache_cleanup()
+{
+    int i;
+
+    if (!shards)
+	return;
+
+    for (i = 0; i < DCACHE_SHARDS; i++) {
+	pthread_mutex_lock(&shards[i].lock);
+	while (shards[i].lru.lru_next != &shards[i].lru)
+	    dcache_remove(&shards[i], shards[i].lru.lru_next);
+	while (shards[i].nlru.lru_next != &shards[i].nlru)
+	    dcache_remove(&shards[i], shards[i].nlru.lru_next);
+	pthread_mutex_unlock(&shards[i].lock);
+	pthread_mutex_destroy(&shards[i].lock);
+    }
+
+    free(shards);
+    shards = NULL;
+}
+
+unsigned long dcache_generation(const char *name)
+{
+    return __sync_add_and_fetch(dcache_gen_slot(name), 0);
+}
+
+int dcache_lookup(long parent, const char *name, long *inode)
+{
+    unsigned long hash;
+    struct dcache_shard *shard;
+    struct dcache_entry *ent;
+    int ret = 0;
+
+    if (!shards)
+	return 0;
+
+    hash = dcache_hash(parent, name);
+    shard = dcache_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    for (ent = *dcache_bucket(shard, hash); ent; ent = ent->hnext) {
+	if (ent->hash == hash && ent->parent == parent && !strcmp(ent->name, name)) {
+	    if (!ent->inode && ent->expires <= time(NULL)) {
+		dcache_remove(shard, ent);
+		break;
+	    }
+	    lru_unlink(ent);
+	    lru_push(shard, ent);
+	    *inode = ent->inode;
+	    ret = ent->inode ? 1 : -ENOENT;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    log_printf(LOG_D_CACHE, "%s(%ld, \"%s\") => %s\n", __func__, parent, name,
+	       ret > 0 ? "hit" : ret < 0 ? "negative hit" : "miss");
+
+    return ret;
+}
+
+void dcache_insert(long parent, const char *name, long inode, unsigned long gen)
+{
+    dcache_add(parent, name, inode, gen);
+}
+
+void dcache_insert_negative(long parent, const char *name, unsigned long gen)
+{
+    if (negative_ttl)
+	dcache_add(parent, name, 0, gen);
+}
+
+void dcache_invalidate(long parent, const char *name)
+{
+    unsigned long hash;
+    struct dcache_shard *shard;
+    struct dcache_entry *ent, *next;
+
+    if (!shards)
+	return;
+
+    hash = dcache_hash(parent, name);
+    shard = dcache_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    __sync_add_and_fetch(dcache_gen_slot(name), 1);
+    for (ent = *dcache_bucket(shard, hash); ent; ent = next) {
+	next = ent->hnext;
+	if (ent->hash == hash && ent->parent == parent && !strcasecmp(ent->name, name))
+	    dcache_remove(shard, ent);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    log_printf(LOG_D_CACHE, "%s(%ld, \"%s\")\n", __func__, parent, name);
+}
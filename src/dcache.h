@@ -0,0 +1,39 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/**
+ * Parent key of the root directory entry.  The root is the only row of the
+ * tree table with a NULL parent, so it is cached as (0, "/").
+ */
+#define DCACHE_ROOT_PARENT	0
+
+/**
+ * Initialize the dentry cache; a max_bytes of 0 disables the cache, a
+ * neg_ttl of 0 disables negative entries only.
+ */
+int dcache_init(size_t max_bytes, unsigned int neg_ttl, unsigned int neg_max);
+
+/** Drop every cached entry and release the cache memory */
+void dcache_cleanup();
+
+/** Invalidation generation of name, to be sampled before querying the database and passed back to dcache_insert() */
+unsigned long dcache_generation(const char *name);
+
+/** Look up the inode of name in directory parent: 1 on hit, -ENOENT if known missing, 0 on miss */
+int dcache_lookup(long parent, const char *name, long *inode);
+
+/** Remember that name in directory parent is inode */
+void dcache_insert(long parent, const char *name, long inode, unsigned long gen);
+
+/** Remember for a while that name doesn't exist in directory parent */
+void dcache_insert_negative(long parent, const char *name, unsigned long gen);
+
+/** Forget whatever is cached for name in directory parent */
+void dcache_invalidate(long parent, const char *name);
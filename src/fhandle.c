@@ -0,0 +1,513 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fuse/fuse.h>
+
+#include <mysql/mysql.h>
+
+#include "mysqlfs.h"
+#include "fhandle.h"
+#include "query.h"
+#include "pool.h"
+#include "log.h"
+
+/*
+ * Write-back buffering.  Applications (and FUSE without big_writes) write
+ * in small pieces, and each query_write() costs several round trips and a
+ * transaction.  So writes are copied into per-handle dirty blocks instead,
+ * one data_block_size buffer per block touched, and sent to the database
+ * when the file is flushed, closed or fsync()ed, when the total amount of
+ * dirty memory exceeds the budget, or when the oldest dirty block has waited
+ * for the configured delay.
+ *
+ * Each dirty block holds a single contiguous range.  A write that would
+ * leave a hole in a dirty block first writes the buffered range out, so
+ * flushing never has to fill gaps with data it doesn't know.  A write to
+ * blocks buffered by another handle of the same file first flushes that
+ * handle, so that handles can be flushed in any order without an older
+ * write landing over a newer one.
+ *
+ * A failed flush keeps the dirty blocks, to be tried again by the next
+ * flush: the database may only have been out of connections for a while.
+ * They are dropped when the file is released, if that last try fails too.
+ *
+ * Readers of the database see buffered data only once it is flushed, so
+ * mysqlfs_read() and mysqlfs_truncate() flush every handle open on the
+ * inode first, and mysqlfs_getattr() adds the buffered end of file to the
+ * size found in the database.
+ */
+
+/** Full blocks handed to query_write_blocks() at once by a flush */
+#define FH_FLUSH_BATCH	64
+
+static pthread_mutex_t fh_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fhandle *fh_list = NULL;
+
+static size_t fh_max_bytes = 0;
+static unsigned int fh_delay = 0;
+static size_t fh_dirty_total = 0;	/**< dirty bytes over all handles, updated atomically */
+
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static int flusher_running = 0;
+
+/** Drop a reference to fh and free it after the last one.  List must be locked. */
+static void fh_unref(struct fhandle *fh)
+{
+    if (--fh->refs)
+	return;
+
+    if (fh->prev)
+	fh->prev->next = fh->next;
+    else
+	fh_list = fh->next;
+    if (fh->next)
+	fh->next->prev = fh->prev;
+
+    pthread_mutex_destroy(&fh->lock);
+    free(fh);
+}
+
+/** Free every dirty block of fh.  Handle must be locked. */
+static void fh_discard(struct fhandle *fh)
+{
+    struct fh_block *blk;
+
+    while ((blk = fh->dirty)) {
+	fh->dirty = blk->next;
+	free(blk);
+    }
+    __sync_sub_and_fetch(&fh_dirty_total, fh->dirty_bytes);
+    fh->tail = NULL;
+    fh->dirty_bytes = 0;
+    fh->dirty_since = 0;
+    fh->end = 0;
+}
+
+/** Send the buffered range of one block to the database; the size is set by fh_flush_locked() */
+static int fh_write_block(struct fhandle *fh, MYSQL *mysql, struct fh_block *blk)
+{
+    int ret;
+
+    ret = query_write_data(mysql, fh->inode, blk->data + blk->lo, blk->hi - blk->lo,
+			   (off_t)blk->seq * data_block_size + blk->lo);
+
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Write out every dirty block of fh, full blocks FH_FLUSH_BATCH at a time
+ * through query_write_blocks(), then grow the inode size once for all of
+ * them.  On error every block is kept for the next flush, writing blocks
+ * again being harmless.  Handle must be locked.
+ */
+static int fh_flush_locked(struct fhandle *fh, MYSQL *mysql)
+{
+    struct fh_block *blk;
+    unsigned long seq[FH_FLUSH_BATCH];
+    const char *data[FH_FLUSH_BATCH];
+    unsigned int n = 0;
+    int ret = 0;
+
+    if (!fh->dirty)
+	return 0;
+
+    log_printf(LOG_D_OTHER, "%s(%ld): %zu bytes\n", __func__, fh->inode, fh->dirty_bytes);
+
+    for (blk = fh->dirty; blk && ret >= 0; blk = blk->next) {
+	if (blk->lo == 0 && blk->hi == data_block_size) {
+	    seq[n] = blk->seq;
+	    data[n++] = blk->data;
+	    if (n == FH_FLUSH_BATCH) {
+		ret = query_write_blocks(mysql, fh->inode, seq, data, n);
+		n = 0;
+	    }
+	} else {
+	    ret = fh_write_block(fh, mysql, blk);
+	}
+    }
+    if (ret >= 0 && n)
+	ret = query_write_blocks(mysql, fh->inode, seq, data, n);
+    if (ret >= 0)
+	ret = query_extend_size(mysql, fh->inode, fh->end);
+
+    if (ret < 0) {
+	log_printf(LOG_ERROR, "Error: write-back of inode %ld failed, "
+		   "keeping %zu buffered bytes\n", fh->inode, fh->dirty_bytes);
+	return ret;
+    }
+    fh_discard(fh);
+
+    return 0;
+}
+
+/**
+ * Write out the other handles of the inode of fh holding dirty data for
+ * blocks first to last, before fh buffers a write to them.  fh must not be
+ * locked, another writer may be flushing it meanwhile.
+ */
+static int fh_flush_overlaps(struct fhandle *fh, MYSQL *mysql,
+			     unsigned long first, unsigned long last)
+{
+    struct fhandle *other, *next;
+    struct fh_block *blk;
+    int ret = 0, r;
+
+    if (!__sync_add_and_fetch(&fh_dirty_total, 0))
+	return 0;
+
+    pthread_mutex_lock(&fh_list_lock);
+    for (other = fh_list; other; other = next) {
+	if (other == fh || other->inode != fh->inode || !other->dirty_since) {
+	    next = other->next;
+	    continue;
+	}
+	other->refs++;
+	pthread_mutex_unlock(&fh_list_lock);
+
+	pthread_mutex_lock(&other->lock);
+	for (blk = other->dirty; blk && blk->seq < first; blk = blk->next)
+	    ;
+	if (blk && blk->seq <= last && (r = fh_flush_locked(other, mysql)) < 0)
+	    ret = r;
+	pthread_mutex_unlock(&other->lock);
+
+	pthread_mutex_lock(&fh_list_lock);
+	next = other->next;
+	fh_unref(other);
+    }
+    pthread_mutex_unlock(&fh_list_lock);
+
+    return ret;
+}
+
+/** Background flush: pick up handles whose dirty data is old enough, or all of them when over budget */
+static void *fh_flusher(void *arg)
+{
+    struct fhandle *fh, *next;
+    struct timespec ts;
+    MYSQL *mysql = NULL;
+    int force;
+
+    (void) arg;
+    mysql_thread_init();
+    pool_thread_unbound();
+
+    pthread_mutex_lock(&flusher_lock);
+    while (flusher_running) {
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 1;
+	pthread_cond_timedwait(&flusher_cond, &flusher_lock, &ts);
+	pthread_mutex_unlock(&flusher_lock);
+
+	force = __sync_add_and_fetch(&fh_dirty_total, 0) > fh_max_bytes;
+
+	pthread_mutex_lock(&fh_list_lock);
+	for (fh = fh_list; fh; fh = next) {
+	    if (!fh->dirty_since ||
+		(!force && fh->dirty_since + fh_delay > time(NULL))) {
+		next = fh->next;
+		continue;
+	    }
+	    fh->refs++;
+	    pthread_mutex_unlock(&fh_list_lock);
+
+	    if (mysql || (mysql = pool_get())) {
+		pthread_mutex_lock(&fh->lock);
+		fh_flush_locked(fh, mysql);
+		pthread_mutex_unlock(&fh->lock);
+	    }
+
+	    pthread_mutex_lock(&fh_list_lock);
+	    next = fh->next;
+	    fh_unref(fh);
+	}
+	pthread_mutex_unlock(&fh_list_lock);
+
+	if (mysql) {
+	    pool_put(mysql);
+	    mysql = NULL;
+	}
+
+	pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+int fh_init(unsigned int max_kb, unsigned int delay)
+{
+    fh_max_bytes = (size_t)max_kb * 1024;
+    fh_delay = delay;
+
+    if (!fh_max_bytes)
+	log_printf(LOG_INFO, "write-back buffering disabled\n");
+    else
+	log_printf(LOG_INFO, "write-back buffering: %zu bytes, flushed after %us\n",
+		   fh_max_bytes, fh_delay);
+
+    return 0;
+}
+
+int fh_start()
+{
+    int ret;
+
+    if (!fh_max_bytes)
+	return 0;
+
+    flusher_running = 1;
+    ret = pthread_create(&flusher, NULL, fh_flusher, NULL);
+    if (ret) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ret));
+	flusher_running = 0;
+	return -ret;
+    }
+
+    return 0;
+}
+
+void fh_stop()
+{
+    struct fhandle *fh;
+    MYSQL *mysql;
+
+    if (flusher_running) {
+	pthread_mutex_lock(&flusher_lock);
+	flusher_running = 0;
+	pthread_cond_signal(&flusher_cond);
+	pthread_mutex_unlock(&flusher_lock);
+	pthread_join(flusher, NULL);
+    }
+
+    /* Files still open at unmount lose nothing either. */
+    if (!__sync_add_and_fetch(&fh_dirty_total, 0) || !(mysql = pool_get()))
+	return;
+
+    pthread_mutex_lock(&fh_list_lock);
+    for (fh = fh_list; fh; fh = fh->next) {
+	pthread_mutex_lock(&fh->lock);
+	fh_flush_locked(fh, mysql);
+	pthread_mutex_unlock(&fh->lock);
+    }
+    pthread_mutex_unlock(&fh_list_lock);
+
+    pool_put(mysql);
+}
+
+struct fhandle *fh_open(long inode)
+{
+    struct fhandle *fh;
+
+    fh = calloc(1, sizeof(struct fhandle));
+    if (!fh)
+	return NULL;
+
+    fh->inode = inode;
+    fh->refs = 1;
+    pthread_mutex_init(&fh->lock, NULL);
+
+    pthread_mutex_lock(&fh_list_lock);
+    fh->next = fh_list;
+    if (fh_list)
+	fh_list->prev = fh;
+    fh_list = fh;
+    pthread_mutex_unlock(&fh_list_lock);
+
+    return fh;
+}
+
+int fh_release(struct fhandle *fh, MYSQL *mysql)
+{
+    int ret;
+
+    /* The last try: nothing flushes a released handle. */
+    pthread_mutex_lock(&fh->lock);
+    ret = fh_flush_locked(fh, mysql);
+    if (ret < 0) {
+	log_printf(LOG_ERROR, "Error: inode %ld released, dropping %zu buffered bytes\n",
+		   fh->inode, fh->dirty_bytes);
+	fh_discard(fh);
+    }
+    pthread_mutex_unlock(&fh->lock);
+
+    pthread_mutex_lock(&fh_list_lock);
+    fh_unref(fh);
+    pthread_mutex_unlock(&fh_list_lock);
+
+    return ret;
+}
+
+int fh_write(struct fhandle *fh, MYSQL *mysql, const char *buf, size_t size, off_t offset)
+{
+    struct fh_block *blk, **pp;
+    unsigned long seq;
+    size_t lo, len, done = 0;
+    int ret = 0;
+
+    if (!fh_max_bytes)
+	return query_write(mysql, fh->inode, buf, size, offset);
+
+    if (size) {
+	ret = fh_flush_overlaps(fh, mysql, offset / data_block_size,
+				(offset + size - 1) / data_block_size);
+	if (ret < 0)
+	    return ret;
+    }
+
+    pthread_mutex_lock(&fh->lock);
+
+    while (done < size) {
+	seq = offset / data_block_size;
+	lo = offset % data_block_size;
+	len = data_block_size - lo;
+	if (len > size - done)
+	    len = size - done;
+
+	/* Sequential writes append, so try the last dirty block first. */
+	if (fh->tail && fh->tail->seq < seq) {
+	    pp = &fh->tail->next;
+	} else {
+	    for (pp = &fh->dirty; *pp && (*pp)->seq < seq; pp = &(*pp)->next)
+		;
+	}
+	blk = *pp;
+
+	if (blk && blk->seq == seq && (lo > blk->hi || lo + len < blk->lo)) {
+	    /* Not contiguous with the buffered range: write that out and start over. */
+	    ret = fh_write_block(fh, mysql, blk);
+	    if (ret < 0)
+		break;
+	    blk->lo = lo;
+	    blk->hi = lo + len;
+	} else if (!blk || blk->seq != seq) {
+	    blk = malloc(sizeof(struct fh_block) + data_block_size);
+	    if (!blk) {
+		ret = -ENOMEM;
+		break;
+	    }
+	    blk->seq = seq;
+	    blk->lo = lo;
+	    blk->hi = lo + len;
+	    blk->next = *pp;
+	    *pp = blk;
+	    if (!blk->next)
+		fh->tail = blk;
+	    fh->dirty_bytes += sizeof(struct fh_block) + data_block_size;
+	    __sync_add_and_fetch(&fh_dirty_total, sizeof(struct fh_block) + data_block_size);
+	    if (!fh->dirty_since)
+		fh->dirty_since = time(NULL);
+	}
+
+	memcpy(blk->data + lo, buf + done, len);
+	if (lo < blk->lo)
+	    blk->lo = lo;
+	if (lo + len > blk->hi)
+	    blk->hi = lo + len;
+
+	done += len;
+	offset += len;
+	if (offset > fh->end)
+	    __sync_lock_test_and_set(&fh->end, offset);
+    }
+
+    /* Over budget: this writer pays for its own dirty data. */
+    if (ret == 0 && __sync_add_and_fetch(&fh_dirty_total, 0) > fh_max_bytes)
+	ret = fh_flush_locked(fh, mysql);
+
+    pthread_mutex_unlock(&fh->lock);
+
+    return ret < 0 ? ret : (int)done;
+}
+
+int fh_flush(struct fhandle *fh, MYSQL *mysql)
+{
+    int ret;
+
+    pthread_mutex_lock(&fh->lock);
+    ret = fh_flush_locked(fh, mysql);
+    pthread_mutex_unlock(&fh->lock);
+
+    return ret;
+}
+
+int fh_flush_inode(long inode, MYSQL *mysql)
+{
+    struct fhandle *fh, *next;
+    MYSQL *own = NULL;
+    int ret = 0, r;
+
+    if (!__sync_add_and_fetch(&fh_dirty_total, 0))
+	return 0;
+
+    pthread_mutex_lock(&fh_list_lock);
+    for (fh = fh_list; fh; fh = next) {
+	if (fh->inode != inode || !fh->dirty_since) {
+	    next = fh->next;
+	    continue;
+	}
+	fh->refs++;
+	pthread_mutex_unlock(&fh_list_lock);
+
+	if (!mysql && !(mysql = own = pool_get()))
+	    r = -EMFILE;
+	else {
+	    pthread_mutex_lock(&fh->lock);
+	    r = fh_flush_locked(fh, mysql);
+	    pthread_mutex_unlock(&fh->lock);
+	}
+	if (r < 0)
+	    ret = r;	/* the blocks stay buffered for the next flush */
+
+	pthread_mutex_lock(&fh_list_lock);
+	next = fh->next;
+	fh_unref(fh);
+    }
+    pthread_mutex_unlock(&fh_list_lock);
+
+    if (own)
+	pool_put(own);
+
+    return ret;
+}
+
+off_t fh_pending_size(long inode)
+{
+    struct fhandle *fh;
+    off_t end, size = 0;
+
+    if (!__sync_add_and_fetch(&fh_dirty_total, 0))
+	return 0;
+
+    pthread_mutex_lock(&fh_list_lock);
+    for (fh = fh_list; fh; fh = fh->next) {
+	if (fh->inode != inode)
+	    continue;
+	end = __sync_add_and_fetch(&fh->end, 0);
+	if (end > size)
+	    size = end;
+    }
+    pthread_mutex_unlock(&fh_list_lock);
+
+    return size;
+}
@@ -0,0 +1,69 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/**
+ * A dirty data block waiting in the write-back buffer of an open file.
+ * Only the [lo, hi) range of data is valid.
+ */
+struct fh_block {
+    struct fh_block	*next;		/**< next dirty block, by increasing seq */
+    unsigned long	seq;		/**< sequence number of the block */
+    size_t		lo,		/**< start of the dirty range */
+			hi;		/**< end of the dirty range */
+    char		data[];		/**< data_block_size bytes */
+};
+
+/**
+ * State of an open file, stored in fuse_file_info::fh by mysqlfs_open().
+ * Small writes are collected in a list of dirty blocks and sent to the
+ * database in one go, see fh_write().
+ */
+struct fhandle {
+    long		inode;		/**< inode of the open file */
+    pthread_mutex_t	lock;		/**< protects everything below */
+    struct fh_block	*dirty,		/**< dirty blocks, by increasing seq */
+			*tail;		/**< last dirty block */
+    size_t		dirty_bytes;	/**< memory held by the dirty blocks */
+    off_t		end;		/**< end of the buffered data, read without the lock by fh_pending_size() */
+    time_t		dirty_since;	/**< when the oldest dirty block was created */
+    off_t		ra_next;	/**< offset following the previous read, see ra_read() */
+    unsigned int	ra_window;	/**< read-ahead window, in blocks (0 while not sequential) */
+    unsigned long	ra_end;		/**< first block not prefetched yet */
+    unsigned int	refs;		/**< the open file, plus fh_flush_inode() and the flusher while they use it */
+    struct fhandle	*prev,		/**< list of open files */
+			*next;
+};
+
+/** Initialize the write-back buffers; max_kb of 0 makes every write synchronous */
+int fh_init(unsigned int max_kb, unsigned int delay);
+
+/** Start the background flusher thread (to be called once FUSE is running) */
+int fh_start();
+
+/** Flush everything and stop the background flusher thread */
+void fh_stop();
+
+/** Allocate the handle of a newly opened file */
+struct fhandle *fh_open(long inode);
+
+/** Flush and free a handle, dropping what can't be flushed */
+int fh_release(struct fhandle *fh, MYSQL *mysql);
+
+/** Buffer a write, or perform it right away when buffering is disabled */
+int fh_write(struct fhandle *fh, MYSQL *mysql, const char *buf, size_t size, off_t offset);
+
+/** Write out the dirty blocks of a handle */
+int fh_flush(struct fhandle *fh, MYSQL *mysql);
+
+/** Write out the dirty blocks of every handle open on inode; with a NULL mysql, a pool connection is taken if needed */
+int fh_flush_inode(long inode, MYSQL *mysql);
+
+/** End of the data buffered for inode, or 0 if there is none */
+off_t fh_pending_size(long inode);
@@ -0,0 +1,287 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fuse/fuse.h>
+
+#include <mysql/mysql.h>
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "pool.h"
+#include "fsck.h"
+#include "log.h"
+
+/*
+ * fsck in passes, each made of units of work that don't depend on each
+ * other: ranges of inode numbers first (query_fsck_range()), then ranges of
+ * deduplicated payloads (query_fsck_blobs()).  Units are handed out in
+ * order to a few threads with their own connections.  Every unit is a
+ * handful of short statements, so a large filesystem is never locked for
+ * long.
+ *
+ * Everything before the oldest unit still running is done; that point is
+ * recorded in SW_DETAILS every FSCK_SAVE_SECS, so that an interrupted fsck
+ * resumes there.  Units are idempotent: a racing save recording an older
+ * point only costs some work done twice.
+ */
+
+#define FSCK_MAX_THREADS	32
+#define FSCK_SAVE_SECS		5	/**< how often the resume point is recorded */
+
+/** Passes, in order, as recorded with query_fsck_set_resume() */
+enum fsck_pass_id {
+    FSCK_INODES,	/**< position is an inode number */
+    FSCK_BLOBS,		/**< position is a server * 256 + a first hash byte */
+    FSCK_TOTALS,	/**< statistics and table optimization */
+};
+
+struct fsck_pass {
+    enum fsck_pass_id	id;
+    const char		*name;
+    int			(*run)(MYSQL *mysql, long first, long last);
+    pthread_mutex_t	lock;		/**< protects everything below */
+    long		begin,		/**< first position of this run */
+			next,		/**< next unit to hand out */
+			end,		/**< end of the pass */
+			step;		/**< positions per unit */
+    long		running[FSCK_MAX_THREADS];	/**< unit of each thread, -1 if none */
+    time_t		saved;		/**< when the resume point was last recorded */
+    int			percent;	/**< progress last reported */
+    unsigned int	workers;	/**< threads holding a connection */
+    int			error;
+};
+
+struct fsck_thread {
+    struct fsck_pass	*pass;
+    unsigned int	slot;
+    MYSQL		*mysql;		/**< connection to use, NULL to take one from the pool */
+    pthread_t		thread;
+};
+
+static int fsck_inodes(MYSQL *mysql, long first, long last)
+{
+    return query_fsck_range(mysql, first, last);
+}
+
+static int fsck_blobs(MYSQL *mysql, long first, long last)
+{
+    MYSQL *shard;
+    long unit;
+    int ret = 0;
+
+    for (unit = first; ret == 0 && unit <= last; unit++) {
+	if (!pool_shards()) {
+	    ret = query_fsck_blobs(mysql, unit % 256);
+	    continue;
+	}
+	if (!(shard = pool_get_shard(unit / 256)))
+	    return -EMFILE;
+	ret = query_fsck_blobs(shard, unit % 256);
+	pool_put(shard);
+    }
+
+    return ret;
+}
+
+/** Report progress, and record the resume point if it is time; called with the lock held */
+static void fsck_progress(struct fsck_pass *pass, MYSQL *mysql)
+{
+    long done = pass->next;
+    time_t now = time(NULL);
+    int i, percent;
+
+    for (i = 0; i < FSCK_MAX_THREADS; i++)
+	if (pass->running[i] >= 0)
+	    done = MIN(done, pass->running[i]);
+
+    percent = pass->end > pass->begin ? 100 * (done - pass->begin) / (pass->end - pass->begin) : 100;
+    if (percent != pass->percent) {
+	pass->percent = percent;
+	printf("%s... %d%%\n", pass->name, percent);
+	fflush(stdout);
+    }
+
+    if (now - pass->saved >= FSCK_SAVE_SECS) {
+	pass->saved = now;
+	pthread_mutex_unlock(&pass->lock);
+	query_fsck_set_resume(mysql, pass->id, done);
+	pthread_mutex_lock(&pass->lock);
+    }
+}
+
+static void *fsck_worker(void *arg)
+{
+    struct fsck_thread *t = arg;
+    struct fsck_pass *pass = t->pass;
+    MYSQL *mysql;
+    long first, last;
+    int ret;
+
+    if (t->mysql) {
+	mysql = t->mysql;
+    } else {
+	mysql_thread_init();
+	mysql = pool_get();
+    }
+
+    pthread_mutex_lock(&pass->lock);
+    if (!mysql) {
+	/* Others are at work: leave it to them. */
+	if (!pass->workers && pass->next < pass->end)
+	    pass->error = -EMFILE;
+	pthread_mutex_unlock(&pass->lock);
+	mysql_thread_end();
+	return NULL;
+    }
+    pass->workers++;
+    while (!pass->error && pass->next < pass->end) {
+	first = pass->next;
+	last = MIN(first + pass->step, pass->end) - 1;
+	pass->next = last + 1;
+	pass->running[t->slot] = first;
+	pthread_mutex_unlock(&pass->lock);
+
+	ret = pass->run(mysql, first, last);
+	log_printf(LOG_D_OTHER, "%s(%s, %ld-%ld) = %d\n", __func__, pass->name, first, last, ret);
+
+	pthread_mutex_lock(&pass->lock);
+	pass->running[t->slot] = -1;
+	if (ret < 0)
+	    pass->error = ret;
+	else
+	    fsck_progress(pass, mysql);
+    }
+    pass->workers--;
+    pthread_mutex_unlock(&pass->lock);
+
+    if (!t->mysql) {
+	pool_put(mysql);
+	mysql_thread_end();
+    }
+
+    return NULL;
+}
+
+/**
+ * Run a pass from position begin, on threads threads, or on mysql alone
+ * if threads is 0.
+ *
+ * @return 0 on success, < 0 on error
+ */
+static int fsck_pass(struct fsck_pass *pass, MYSQL *mysql, unsigned int threads, long begin)
+{
+    struct fsck_thread t[FSCK_MAX_THREADS];
+    unsigned int i, started = 0;
+    int ret;
+
+    pthread_mutex_init(&pass->lock, NULL);
+    pass->begin = pass->next = MIN(begin, pass->end);
+    pass->saved = time(NULL);
+    pass->percent = -1;
+    pass->workers = 0;
+    pass->error = 0;
+    for (i = 0; i < FSCK_MAX_THREADS; i++)
+	pass->running[i] = -1;
+
+    query_fsck_set_resume(mysql, pass->id, pass->begin);
+
+    for (i = 0; i < threads; i++) {
+	t[i].pass = pass;
+	t[i].slot = i;
+	t[i].mysql = NULL;
+	ret = pthread_create(&t[i].thread, NULL, fsck_worker, &t[i]);
+	if (ret) {
+	    log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ret));
+	    break;
+	}
+	started++;
+    }
+    if (!started) {
+	t[0].pass = pass;
+	t[0].slot = 0;
+	t[0].mysql = mysql;
+	fsck_worker(&t[0]);
+    }
+    for (i = 0; i < started; i++)
+	pthread_join(t[i].thread, NULL);
+
+    pthread_mutex_destroy(&pass->lock);
+
+    if (pass->error) {
+	log_printf(LOG_ERROR, "%s: %s\n", pass->name, strerror(-pass->error));
+	return pass->error;
+    }
+
+    return 0;
+}
+
+/**
+ * Clean filesystem.  Only run in pool_check_mysql_setup() if
+ * mysqlfs_opt::fsck == 1.  See query_fsck_range() for what is checked.
+ *
+ * @return 0 on success, < 0 on error
+ * @param mysql handle to database connection
+ * @param threads number of connections working in parallel, 0 to work on mysql alone
+ * @param chunk number of inodes checked at a time by a connection
+ */
+int fsck_run(MYSQL *mysql, unsigned int threads, unsigned long chunk)
+{
+    struct fsck_pass inodes = { FSCK_INODES, "Checking inodes", fsck_inodes };
+    struct fsck_pass blobs = { FSCK_BLOBS, "Recounting references to deduplicated blocks", fsck_blobs };
+    int pass = FSCK_INODES, ret;
+    long position = 1, max;
+
+    threads = MIN(threads, FSCK_MAX_THREADS);
+    chunk = MAX(chunk, 1);
+
+    printf("Starting fsck\n");
+    if (query_fsck_get_resume(mysql, &pass, &position) == 0)
+	printf("Resuming an interrupted fsck (pass %d, at %ld)\n", pass, position);
+
+    if (pass <= FSCK_INODES) {
+	if ((max = query_fsck_span(mysql)) < 0)
+	    return max;
+	inodes.end = max + 1;
+	inodes.step = chunk;
+	if ((ret = fsck_pass(&inodes, mysql, threads, MAX(position, 1))) < 0)
+	    return ret;
+	position = 0;
+    }
+
+    if (pass <= FSCK_BLOBS) {
+	blobs.end = 256 * MAX(pool_shards(), 1);
+	blobs.step = 1;
+	if ((ret = fsck_pass(&blobs, mysql, threads, position)) < 0)
+	    return ret;
+    }
+
+    query_fsck_set_resume(mysql, FSCK_TOTALS, 0);
+
+    printf("Recomputing statistics\n");
+    if ((ret = query_fsck_totals(mysql)) < 0)
+	return ret;
+
+    printf("Optimizing tables\n");
+    query_fsck_optimize(mysql);
+
+    query_fsck_set_resume(mysql, -1, 0);
+    printf("fsck done!\n");
+
+    return 0;
+}
@@ -0,0 +1,12 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Check and repair the filesystem with threads connections, chunk inodes at a time, resuming an interrupted run */
+int fsck_run(MYSQL *mysql, unsigned int threads, unsigned long chunk);
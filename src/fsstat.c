@@ -0,0 +1,219 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <fuse/fuse.h>
+
+#include <mysql/mysql.h>
+
+#include "mysqlfs.h"
+#include "fsstat.h"
+#include "query.h"
+#include "pool.h"
+#include "log.h"
+
+/*
+ * statfs() results, cached for a few seconds: df and monitoring agents
+ * call it often, and it takes three queries.  Once the cached values are
+ * older than the ttl, they are still returned, and a background thread
+ * refreshes them; only the first call waits for the database.
+ *
+ * The free room is what the tablespaces of the data tables hold, and may
+ * still grow by up to their maximum size, as InnoDB reports it, see
+ * query_free_bytes().  A tablespace without a maximum size grows as long
+ * as the disks of the server allow, which the server doesn't tell: the
+ * configured headroom is counted for those.  A file takes at least a
+ * block, which bounds the free inodes.
+ */
+
+/** What statfs() reports, before it is scaled into a struct statvfs */
+struct fsstat {
+    fsfilcnt_t		files;		/**< inodes in use */
+    fsblkcnt_t		blocks;		/**< blocks in use */
+    long long		free_bytes;	/**< free room of the data tables */
+    int			unbounded;	/**< whether a tablespace may grow without a limit */
+};
+
+static unsigned int fsstat_ttl = 0;
+static unsigned long long fsstat_headroom = 0;
+
+static pthread_mutex_t fsstat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fsstat_cond = PTHREAD_COND_INITIALIZER;
+static struct fsstat fsstat_cached;
+static time_t fsstat_time = 0;		/**< when fsstat_cached was read, 0 if never */
+static pthread_t fsstat_thread;
+static int fsstat_running = 0;
+static int fsstat_wanted = 0;		/**< a refresh was asked for */
+
+/** Read the statistics from the database */
+static int fsstat_query(struct fsstat *st)
+{
+    MYSQL *mysql;
+    long long ret;
+
+    if ((mysql = pool_get_read(-1)) == NULL)
+	return -EMFILE;
+
+    st->files = query_total_inodes(mysql);
+    st->blocks = query_total_blocks(mysql);
+    ret = query_free_bytes(mysql, &st->unbounded);
+    pool_put(mysql);
+
+    /* The totals return their errors as negative numbers, too */
+    if ((long long)st->files < 0 || (long long)st->blocks < 0)
+	return -EIO;
+    st->free_bytes = ret < 0 ? 0 : ret;
+
+    return 0;
+}
+
+/** Read the statistics and cache them */
+static int fsstat_refresh(struct fsstat *st)
+{
+    int ret;
+
+    ret = fsstat_query(st);
+    if (ret < 0)
+	return ret;
+
+    pthread_mutex_lock(&fsstat_lock);
+    fsstat_cached = *st;
+    fsstat_time = time(NULL);
+    pthread_mutex_unlock(&fsstat_lock);
+
+    return 0;
+}
+
+static void *fsstat_worker(void *arg)
+{
+    struct fsstat st;
+
+    (void) arg;
+    mysql_thread_init();
+    pool_thread_unbound();
+
+    pthread_mutex_lock(&fsstat_lock);
+    while (fsstat_running) {
+	if (!fsstat_wanted) {
+	    pthread_cond_wait(&fsstat_cond, &fsstat_lock);
+	    continue;
+	}
+	pthread_mutex_unlock(&fsstat_lock);
+
+	if (fsstat_refresh(&st) < 0)
+	    log_printf(LOG_ERROR, "%s(): refreshing the statistics failed\n", __func__);
+
+	pthread_mutex_lock(&fsstat_lock);
+	fsstat_wanted = 0;
+    }
+    pthread_mutex_unlock(&fsstat_lock);
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+int fsstat_init(unsigned int ttl, unsigned long long headroom)
+{
+    fsstat_ttl = ttl;
+    fsstat_headroom = headroom;
+    if (fsstat_ttl)
+	log_printf(LOG_INFO, "statfs cache: %us\n", fsstat_ttl);
+    else
+	log_printf(LOG_INFO, "statfs cache disabled\n");
+
+    return 0;
+}
+
+int fsstat_start()
+{
+    int ret;
+
+    if (!fsstat_ttl)
+	return 0;
+
+    fsstat_running = 1;
+    ret = pthread_create(&fsstat_thread, NULL, fsstat_worker, NULL);
+    if (ret) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ret));
+	fsstat_running = 0;
+	return -ret;
+    }
+
+    return 0;
+}
+
+void fsstat_stop()
+{
+    if (!fsstat_running)
+	return;
+
+    pthread_mutex_lock(&fsstat_lock);
+    fsstat_running = 0;
+    pthread_cond_broadcast(&fsstat_cond);
+    pthread_mutex_unlock(&fsstat_lock);
+
+    pthread_join(fsstat_thread, NULL);
+}
+
+int fsstat_get(struct statvfs *buf)
+{
+    struct fsstat st;
+    fsblkcnt_t free_blocks;
+    int ret, cached = 0;
+
+    pthread_mutex_lock(&fsstat_lock);
+    if (fsstat_ttl && fsstat_time) {
+	st = fsstat_cached;
+	cached = 1;
+	if (fsstat_time + fsstat_ttl <= time(NULL)) {
+	    /* Stale: have it refreshed, or refresh it here without the thread */
+	    if (!fsstat_running) {
+		cached = 0;
+	    } else if (!fsstat_wanted) {
+		fsstat_wanted = 1;
+		pthread_cond_signal(&fsstat_cond);
+	    }
+	}
+    }
+    pthread_mutex_unlock(&fsstat_lock);
+
+    if (!cached) {
+	ret = fsstat_ttl ? fsstat_refresh(&st) : fsstat_query(&st);
+	if (ret < 0)
+	    return ret;
+    }
+
+    memset(buf, 0, sizeof(*buf));
+    buf->f_namemax = 255;
+    /* df seems to use f_bsize instead of f_frsize, so make them the same */
+    buf->f_bsize = data_block_size;
+    buf->f_frsize = buf->f_bsize;
+
+    free_blocks = (st.free_bytes + (st.unbounded ? fsstat_headroom : 0)) / data_block_size;
+    buf->f_blocks = st.blocks + free_blocks;
+    buf->f_bfree = free_blocks;
+    buf->f_bavail = buf->f_bfree;
+
+    buf->f_files = st.files + free_blocks;
+    buf->f_ffree = free_blocks;
+    buf->f_favail = buf->f_ffree;
+
+    return 0;
+}
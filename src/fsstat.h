@@ -0,0 +1,21 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Initialize the statfs cache (a ttl of 0 disables it), and the bytes counted free for tablespaces growing without limit */
+int fsstat_init(unsigned int ttl, unsigned long long headroom);
+
+/** Start the refresh thread (to be called once FUSE is running) */
+int fsstat_start();
+
+/** Stop the refresh thread */
+void fsstat_stop();
+
+/** Fill buf with the filesystem statistics, from the cache when fresh enough */
+int fsstat_get(struct statvfs *buf);
@@ -0,0 +1,186 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fuse/fuse.h>
+
+#include <mysql/mysql.h>
+
+#include "mysqlfs.h"
+#include "gc.h"
+#include "query.h"
+#include "pool.h"
+#include "log.h"
+
+/*
+ * Garbage collection of deleted inodes.  unlink() only marks an inode
+ * deleted once its last directory entry is gone; the inode and its data
+ * blocks are removed here, in the background, once it is no longer open.
+ * The data blocks go GC_BATCH at a time, each batch in a transaction of
+ * its own, at the configured rate, so removing large files neither stalls
+ * the caller nor the server.  The inode row goes last, so an interrupted
+ * collection resumes from the deleted flag after the next mount.
+ */
+
+#define GC_BATCH	256	/**< data blocks deleted in one transaction */
+#define GC_INODES	64	/**< inodes listed at a time */
+#define GC_IDLE_SECS	30	/**< how often to look for work without being woken */
+
+static unsigned int gc_rate = 0;
+
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t gc_thread;
+static int gc_running = 0;
+static int gc_pending = 0;	/**< woken by gc_purge() since the last listing */
+
+/** Wait for ms milliseconds, or until gc_stop(); false once stopped */
+static int gc_sleep(long ms)
+{
+    struct timespec ts;
+    int running;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+	ts.tv_sec++;
+	ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&gc_lock);
+    if (gc_running)
+	pthread_cond_timedwait(&gc_cond, &gc_lock, &ts);
+    running = gc_running;
+    pthread_mutex_unlock(&gc_lock);
+
+    return running;
+}
+
+/** Remove one inode, its data blocks first; false if stopped meanwhile */
+static int gc_collect(MYSQL *mysql, long inode)
+{
+    long ret;
+
+    while ((ret = query_gc_blocks(mysql, inode, GC_BATCH)) > 0) {
+	if (gc_rate && !gc_sleep(ret * 1000 / gc_rate))
+	    return 0;
+	if (!gc_rate && !gc_running)
+	    return 0;
+    }
+    if (ret == 0)
+	query_purge_deleted(mysql, inode);
+
+    log_printf(LOG_D_OTHER, "%s(%ld) = %ld\n", __func__, inode, ret);
+
+    return 1;
+}
+
+static void *gc_worker(void *arg)
+{
+    long inodes[GC_INODES];
+    MYSQL *mysql;
+    int count, i;
+
+    (void) arg;
+    mysql_thread_init();
+    pool_thread_unbound();
+
+    pthread_mutex_lock(&gc_lock);
+    while (gc_running) {
+	gc_pending = 0;
+	pthread_mutex_unlock(&gc_lock);
+
+	count = 0;
+	if ((mysql = pool_get()) != NULL) {
+	    count = query_gc_list(mysql, inodes, GC_INODES);
+	    for (i = 0; i < count; i++)
+		if (!gc_collect(mysql, inodes[i]))
+		    break;
+	    pool_put(mysql);
+	}
+
+	pthread_mutex_lock(&gc_lock);
+	/* A full listing may have more behind it. */
+	if (gc_running && !gc_pending && count < GC_INODES) {
+	    struct timespec ts;
+
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    ts.tv_sec += GC_IDLE_SECS;
+	    pthread_cond_timedwait(&gc_cond, &gc_lock, &ts);
+	}
+    }
+    pthread_mutex_unlock(&gc_lock);
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+int gc_init(unsigned int rate)
+{
+    gc_rate = rate;
+    if (gc_rate)
+	log_printf(LOG_INFO, "garbage collector: %u data blocks a second\n", gc_rate);
+    else
+	log_printf(LOG_INFO, "garbage collector: no rate limit\n");
+
+    return 0;
+}
+
+int gc_start()
+{
+    int ret;
+
+    gc_running = 1;
+    ret = pthread_create(&gc_thread, NULL, gc_worker, NULL);
+    if (ret) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ret));
+	gc_running = 0;
+	return -ret;
+    }
+
+    return 0;
+}
+
+void gc_stop()
+{
+    if (!gc_running)
+	return;
+
+    pthread_mutex_lock(&gc_lock);
+    gc_running = 0;
+    pthread_cond_broadcast(&gc_cond);
+    pthread_mutex_unlock(&gc_lock);
+
+    pthread_join(gc_thread, NULL);
+}
+
+int gc_purge(MYSQL *mysql, long inode)
+{
+    pthread_mutex_lock(&gc_lock);
+    if (gc_running) {
+	gc_pending = 1;
+	pthread_cond_signal(&gc_cond);
+	pthread_mutex_unlock(&gc_lock);
+	return 0;
+    }
+    pthread_mutex_unlock(&gc_lock);
+
+    return query_purge_deleted(mysql, inode);
+}
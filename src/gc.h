@@ -0,0 +1,21 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Set how many data blocks a second the garbage collector deletes (0 for no limit) */
+int gc_init(unsigned int rate);
+
+/** Start the garbage collector thread (to be called once FUSE is running) */
+int gc_start();
+
+/** Stop the garbage collector thread; what is left is collected after the next mount */
+void gc_stop();
+
+/** Have inode removed if it is deleted and no longer open: by the collector, or right away without it */
+int gc_purge(MYSQL *mysql, long inode);
@@ -0,0 +1,269 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "icache.h"
+#include "log.h"
+
+/*
+ * The inode cache keeps the struct stat of recently used inodes for a
+ * short time, so that the stat() storm following every path lookup doesn't
+ * go to the database.  Local changes invalidate the entry, the ttl only
+ * bounds how long changes made by other clients may go unnoticed.
+ *
+ * Same layout as the dentry cache: ICACHE_SHARDS independently locked
+ * hash tables, each with an LRU list and a share of ICACHE_MAX entries.
+ */
+
+#define ICACHE_SHARDS	16
+#define ICACHE_BUCKETS	1024	/**< hash buckets per shard */
+#define ICACHE_MAX	65536	/**< maximum number of cached inodes */
+#define ICACHE_GEN_SLOTS	64
+
+/** One cached inode */
+struct icache_entry {
+    struct icache_entry	*hnext;		/**< next entry in the hash chain */
+    struct icache_entry	*lru_prev,	/**< more recently used entry */
+			*lru_next;	/**< less recently used entry */
+    long		inode;		/**< inode number */
+    time_t		expires;	/**< the entry is stale from this time on */
+    struct stat		st;		/**< cached attributes */
+};
+
+/** A shard of the cache: hash table plus LRU list, under one mutex */
+struct icache_shard {
+    pthread_mutex_t	lock;
+    struct icache_entry	*buckets[ICACHE_BUCKETS];
+    struct icache_entry	lru;		/**< list head: lru.lru_next is the most recently used */
+    unsigned int	count;		/**< number of cached inodes */
+};
+
+static struct icache_shard *shards = NULL;
+static unsigned int icache_ttl = 0;
+
+/* See the generations of the dentry cache. */
+static unsigned long generation[ICACHE_GEN_SLOTS];
+
+static inline struct icache_shard *icache_shard(long inode)
+{
+    return &shards[(unsigned long)inode % ICACHE_SHARDS];
+}
+
+static inline struct icache_entry **icache_bucket(struct icache_shard *shard, long inode)
+{
+    return &shard->buckets[((unsigned long)inode / ICACHE_SHARDS) % ICACHE_BUCKETS];
+}
+
+static inline void lru_unlink(struct icache_entry *ent)
+{
+    ent->lru_prev->lru_next = ent->lru_next;
+    ent->lru_next->lru_prev = ent->lru_prev;
+}
+
+static inline void lru_push(struct icache_shard *shard, struct icache_entry *ent)
+{
+    ent->lru_prev = &shard->lru;
+    ent->lru_next = shard->lru.lru_next;
+    shard->lru.lru_next->lru_prev = ent;
+    shard->lru.lru_next = ent;
+}
+
+/** Find the entry of inode.  Shard must be locked. */
+static struct icache_entry *icache_find(struct icache_shard *shard, long inode)
+{
+    struct icache_entry *ent;
+
+    for (ent = *icache_bucket(shard, inode); ent; ent = ent->hnext)
+	if (ent->inode == inode)
+	    return ent;
+
+    return NULL;
+}
+
+/** Unhash and free an entry.  Shard must be locked. */
+static void icache_remove(struct icache_shard *shard, struct icache_entry *ent)
+{
+    struct icache_entry **pp = icache_bucket(shard, ent->inode);
+
+    while (*pp != ent)
+	pp = &(*pp)->hnext;
+    *pp = ent->hnext;
+
+    lru_unlink(ent);
+    shard->count--;
+    free(ent);
+}
+
+int icache_init(unsigned int ttl)
+{
+    int i;
+
+    if (ttl == 0) {
+	log_printf(LOG_INFO, "inode cache disabled\n");
+	return 0;
+    }
+
+    shards = calloc(ICACHE_SHARDS, sizeof(struct icache_shard));
+    if (!shards) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	return -ENOMEM;
+    }
+
+    for (i = 0; i < ICACHE_SHARDS; i++) {
+	pthread_mutex_init(&shards[i].lock, NULL);
+	shards[i].lru.lru_next = shards[i].lru.lru_prev = &shards[i].lru;
+    }
+    icache_ttl = ttl;
+
+    log_printf(LOG_INFO, "inode cache: %d inodes for %us\n", ICACHE_MAX, icache_ttl);
+
+    return 0;
+}
+
+void icache_cleanup()
+{
+    int i;
+
+    if (!shards)
+	return;
+
+    for (i = 0; i < ICACHE_SHARDS; i++) {
+	pthread_mutex_lock(&shards[i].lock);
+	while (shards[i].lru.lru_next != &shards[i].lru)
+	    icache_remove(&shards[i], shards[i].lru.lru_next);
+	pthread_mutex_unlock(&shards[i].lock);
+	pthread_mutex_destroy(&shards[i].lock);
+    }
+
+    free(shards);
+    shards = NULL;
+}
+
+unsigned long icache_generation(long inode)
+{
+    return __sync_add_and_fetch(&generation[(unsigned long)inode % ICACHE_GEN_SLOTS], 0);
+}
+
+int icache_get(long inode, struct stat *stbuf)
+{
+    struct icache_shard *shard;
+    struct icache_entry *ent;
+    int ret = 0;
+
+    if (!shards)
+	return 0;
+
+    shard = icache_shard(inode);
+
+    pthread_mutex_lock(&shard->lock);
+    ent = icache_find(shard, inode);
+    if (ent) {
+	if (ent->expires <= time(NULL)) {
+	    icache_remove(shard, ent);
+	} else {
+	    lru_unlink(ent);
+	    lru_push(shard, ent);
+	    memcpy(stbuf, &ent->st, sizeof(struct stat));
+	    ret = 1;
+	}
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    log_printf(LOG_D_CACHE, "%s(%ld) => %s\n", __func__, inode, ret ? "hit" : "miss");
+
+    return ret;
+}
+
+void icache_put(long inode, const struct stat *stbuf, unsigned long gen)
+{
+    struct icache_shard *shard;
+    struct icache_entry *ent;
+
+    if (!shards)
+	return;
+
+    shard = icache_shard(inode);
+
+    pthread_mutex_lock(&shard->lock);
+    if (gen != icache_generation(inode)) {
+	/* Raced with an invalidation, the attributes may be stale. */
+	pthread_mutex_unlock(&shard->lock);
+	return;
+    }
+
+    ent = icache_find(shard, inode);
+    if (ent) {
+	lru_unlink(ent);
+    } else {
+	if (shard->count >= ICACHE_MAX / ICACHE_SHARDS)
+	    icache_remove(shard, shard->lru.lru_prev);
+	ent = malloc(sizeof(struct icache_entry));
+	if (!ent) {
+	    pthread_mutex_unlock(&shard->lock);
+	    return;
+	}
+	ent->inode = inode;
+	ent->hnext = *icache_bucket(shard, inode);
+	*icache_bucket(shard, inode) = ent;
+	shard->count++;
+    }
+    memcpy(&ent->st, stbuf, sizeof(struct stat));
+    ent->expires = time(NULL) + icache_ttl;
+    lru_push(shard, ent);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void icache_extend(long inode, off_t size)
+{
+    struct icache_shard *shard;
+    struct icache_entry *ent;
+
+    if (!shards)
+	return;
+
+    shard = icache_shard(inode);
+
+    pthread_mutex_lock(&shard->lock);
+    /* Attributes read before the write must not be cached after it. */
+    __sync_add_and_fetch(&generation[(unsigned long)inode % ICACHE_GEN_SLOTS], 1);
+    ent = icache_find(shard, inode);
+    if (ent && ent->st.st_size < size) {
+	ent->st.st_size = size;
+	ent->st.st_blocks = (size + 511) / 512;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void icache_invalidate(long inode)
+{
+    struct icache_shard *shard;
+    struct icache_entry *ent;
+
+    if (!shards)
+	return;
+
+    shard = icache_shard(inode);
+
+    pthread_mutex_lock(&shard->lock);
+    __sync_add_and_fetch(&generation[(unsigned long)inode % ICACHE_GEN_SLOTS], 1);
+    ent = icache_find(shard, inode);
+    if (ent)
+	icache_remove(shard, ent);
+    pthread_mutex_unlock(&shard->lock);
+
+    log_printf(LOG_D_CACHE, "%s(%ld)\n", __func__, inode);
+}
@@ -0,0 +1,30 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Initialize the inode attribute cache; a ttl of 0 disables the cache */
+int icache_init(unsigned int ttl);
+
+/** Drop every cached entry and release the cache memory */
+void icache_cleanup();
+
+/** Invalidation generation of inode, to be sampled before querying the database and passed back to icache_put() */
+unsigned long icache_generation(long inode);
+
+/** Copy the cached attributes of inode into stbuf: 1 on hit, 0 on miss */
+int icache_get(long inode, struct stat *stbuf);
+
+/** Remember the attributes of inode for the configured ttl */
+void icache_put(long inode, const struct stat *stbuf, unsigned long gen);
+
+/** Grow the cached size of inode after a write that ended at size */
+void icache_extend(long inode, off_t size);
+
+/** Forget the cached attributes of inode */
+void icache_invalidate(long inode);
@@ -27,6 +27,7 @@ enum log_types {
   LOG_D_SQL	= 0x0200 | LOG_DEBUG,
   LOG_D_CALL	= 0x0400 | LOG_DEBUG,
   LOG_D_POOL	= 0x0800 | LOG_DEBUG,
+  LOG_D_CACHE	= 0x1000 | LOG_DEBUG,
   
   LOG_MASK_MAJOR	= 0x000F,
   LOG_MASK_MINOR	= 0xFF00,
@@ -30,10 +30,20 @@
 #include <mcheck.h>
 #endif
 #include <stddef.h>
+#include <stdint.h>
 
 #include "mysqlfs.h"
 #include "query.h"
 #include "pool.h"
+#include "dcache.h"
+#include "icache.h"
+#include "fhandle.h"
+#include "bcache.h"
+#include "readahead.h"
+#include "scrub.h"
+#include "gc.h"
+#include "fsstat.h"
+#include "compress.h"
 #include "log.h"
 
 static int mysqlfs_getattr(const char *path, struct stat *stbuf)
@@ -46,26 +56,20 @@ static int mysqlfs_getattr(const char *path, struct stat *stbuf)
 
     memset(stbuf, 0, sizeof(struct stat));
 
-    if ((dbconn = pool_get()) == NULL)
+    if ((dbconn = pool_get_read(0)) == NULL)
       return -EMFILE;
 
     ret = query_getattr(dbconn, path, stbuf);
-
-    if(ret){
-        if (ret != -ENOENT)
-            log_printf(LOG_ERROR, "Error: query_getattr()\n");
-        pool_put(dbconn);
-        return ret;
-    }else{
-        long inode = query_inode(dbconn, path);
-        if(inode < 0){
-            log_printf(LOG_ERROR, "Error: query_inode()\n");
-            pool_put(dbconn);
-            return inode;
+    if (ret && ret != -ENOENT)
+        log_printf(LOG_ERROR, "Error: query_getattr()\n");
+
+    /* Writes still sitting in a write-back buffer already count. */
+    if (!ret && S_ISREG(stbuf->st_mode)) {
+        off_t end = fh_pending_size(stbuf->st_ino);
+        if (end > stbuf->st_size) {
+            stbuf->st_size = end;
+            stbuf->st_blocks = (end + 511) / 512;
         }
-
-        stbuf->st_size = query_size(dbconn, inode);
-	stbuf->st_blocks = (blkcnt_t)ceill(stbuf->st_size / 512);
     }
 
     pool_put(dbconn);
@@ -84,7 +88,7 @@ static int mysqlfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
     log_printf(LOG_D_CALL, "mysqlfs_readdir(\"%s\")\n", path);
 
-    if ((dbconn = pool_get()) == NULL)
+    if ((dbconn = pool_get_read(0)) == NULL)
       return -EMFILE;
 
     inode = query_inode(dbconn, path);
@@ -221,33 +225,23 @@ static int mysqlfs_unlink(const char *path)
         log_printf(LOG_ERROR, "Error: query_rmdirentry()\n");
 	goto err_out;
     }
+    icache_invalidate(inode);	/* nlinks changed */
 
-    /* Only the last unlink() must set deleted flag. 
-     * This is a shortcut - query_set_deleted() wouldn't
-     * set the flag if there is still an existing direntry
-     * anyway. But we'll save some DB processing here. */
-    if (nlinks > 1)
-        return 0;
-    
-    /* Due to the introduction of InnoDB referencial integrity
-     * (and cascading), this should be totaly useless,
-     * But let's keep it here for a while. */
-    /* Useless_Start... */
-
+    /* Only the last unlink() sets the deleted flag, query_set_deleted()
+     * checks that no directory entry is left.  The inode and its data are
+     * removed in the background, see gc.c. */
     ret = query_set_deleted(dbconn, inode);
     if (ret < 0) {
         log_printf(LOG_ERROR, "Error: query_set_deleted()\n");
 	goto err_out;
     }
 
-    ret = query_purge_deleted(dbconn, inode);
+    ret = gc_purge(dbconn, inode);
     if (ret < 0) {
-        log_printf(LOG_ERROR, "Error: query_purge_deleted()\n");
+        log_printf(LOG_ERROR, "Error: gc_purge()\n");
 	goto err_out;
     }
 
-    /* ...Useless_End */
-
     pool_put(dbconn);
 
     return 0;
@@ -318,6 +312,7 @@ static int mysqlfs_chown(const char *path, uid_t uid, gid_t gid)
 static int mysqlfs_truncate(const char* path, off_t length)
 {
     int ret;
+    long inode;
     MYSQL *dbconn;
 
     log_printf(LOG_D_CALL, "mysql_truncate(\"%s\"): len=%lld\n", path, length);
@@ -325,6 +320,13 @@ static int mysqlfs_truncate(const char* path, off_t length)
     if ((dbconn = pool_get()) == NULL)
       return -EMFILE;
 
+    /* Buffered writes happened before the truncate. */
+    inode = query_inode(dbconn, path);
+    if (inode >= 0 && fh_flush_inode(inode, dbconn) < 0) {
+        pool_put(dbconn);
+        return -EIO;
+    }
+
     ret = query_truncate(dbconn, path, length);
     if (ret < 0) {
         log_printf(LOG_ERROR, "Error: query_length()\n");
@@ -369,6 +371,7 @@ static int mysqlfs_utime(const char *path, struct utimbuf *time)
 static int mysqlfs_open(const char *path, struct fuse_file_info *fi)
 {
     MYSQL *dbconn;
+    struct fhandle *fh;
     long inode;
     int ret;
 
@@ -383,10 +386,7 @@ static int mysqlfs_open(const char *path, struct fuse_file_info *fi)
         return -ENOENT;
     }
 
-    /* Save inode for future use. Lets us skip path->inode translation.  */
-    fi->fh = inode;
-
-    log_printf(LOG_D_OTHER, "inode(\"%s\") = %d\n", path, fi->fh);
+    log_printf(LOG_D_OTHER, "inode(\"%s\") = %ld\n", path, inode);
 
     ret = query_inuse_inc(dbconn, inode, 1);
     if (ret < 0) {
@@ -394,6 +394,15 @@ static int mysqlfs_open(const char *path, struct fuse_file_info *fi)
         return ret;
     }
 
+    /* Save inode and write-back buffer for future use. Lets us skip path->inode translation.  */
+    fh = fh_open(inode);
+    if (!fh) {
+        query_inuse_inc(dbconn, inode, -1);
+        pool_put(dbconn);
+        return -ENOMEM;
+    }
+    fi->fh = (uintptr_t)fh;
+
     pool_put(dbconn);
 
     return 0;
@@ -404,13 +413,21 @@ static int mysqlfs_read(const char *path, char *buf, size_t size, off_t offset,
 {
     int ret;
     MYSQL *dbconn;
+    struct fhandle *fh = (struct fhandle *)(uintptr_t)fi->fh;
 
     log_printf(LOG_D_CALL, "mysqlfs_read(\"%s\" %zu@%llu)\n", path, size, offset);
 
-    if ((dbconn = pool_get()) == NULL)
+    /* Buffered writes go to the primary first, which then serves this read too. */
+    ret = fh_flush_inode(fh->inode, NULL);
+    if (ret < 0)
+        return ret;
+
+    if ((dbconn = pool_get_read(fh->inode)) == NULL)
       return -EMFILE;
 
-    ret = query_read(dbconn, fi->fh, buf, size, offset);
+    ra_read(fh, offset, size);
+
+    ret = query_read(dbconn, fh->inode, buf, size, offset);
     pool_put(dbconn);
 
     return ret;
@@ -421,35 +438,66 @@ static int mysqlfs_write(const char *path, const char *buf, size_t size,
 {
     int ret;
     MYSQL *dbconn;
+    struct fhandle *fh = (struct fhandle *)(uintptr_t)fi->fh;
 
     log_printf(LOG_D_CALL, "mysqlfs_write(\"%s\" %zu@%lld)\n", path, size, offset);
 
     if ((dbconn = pool_get()) == NULL)
       return -EMFILE;
 
-    ret = query_write(dbconn, fi->fh, buf, size, offset);
+    ret = fh_write(fh, dbconn, buf, size, offset);
+    pool_put(dbconn);
+
+    return ret;
+}
+
+/** Write out the write-back buffer of a handle; called on every close() of a file descriptor */
+static int mysqlfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int ret;
+    MYSQL *dbconn;
+
+    log_printf(LOG_D_CALL, "mysqlfs_flush(\"%s\")\n", path);
+
+    if ((dbconn = pool_get()) == NULL)
+      return -EMFILE;
+
+    ret = fh_flush((struct fhandle *)(uintptr_t)fi->fh, dbconn);
     pool_put(dbconn);
 
     return ret;
 }
 
+static int mysqlfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void) datasync;
+
+    return mysqlfs_flush(path, fi);
+}
+
 static int mysqlfs_release(const char *path, struct fuse_file_info *fi)
 {
     int ret;
+    long inode;
     MYSQL *dbconn;
+    struct fhandle *fh = (struct fhandle *)(uintptr_t)fi->fh;
 
     log_printf(LOG_D_CALL, "mysqlfs_release(\"%s\")\n", path);
 
     if ((dbconn = pool_get()) == NULL)
       return -EMFILE;
 
-    ret = query_inuse_inc(dbconn, fi->fh, -1);
+    /* The data has to hit the database before the inode may be purged. */
+    inode = fh->inode;
+    fh_release(fh, dbconn);
+
+    ret = query_inuse_inc(dbconn, inode, -1);
     if (ret < 0) {
         pool_put(dbconn);
         return ret;
     }
 
-    ret = query_purge_deleted(dbconn, fi->fh);
+    ret = gc_purge(dbconn, inode);
     if (ret < 0) {
         pool_put(dbconn);
         return ret;
@@ -584,6 +632,59 @@ static int mysqlfs_rename(const char *from, const char *to)
 
 /**
 
+void *(* fuse_operations::init)(struct fuse_conn_info *conn)
+Initialize filesystem
+
+Called once FUSE is running, after it daemonized: threads started before
+then would not survive the fork.
+
+Introduced in version 2.3
+
+**/
+static void *mysqlfs_init(struct fuse_conn_info *conn)
+{
+    (void) conn;
+
+    if (fh_start() < 0)
+        log_printf(LOG_ERROR, "Error: write-back flusher not started, relying on close() and fsync()\n");
+    if (ra_start() < 0)
+        log_printf(LOG_ERROR, "Error: prefetch threads not started, read-ahead disabled\n");
+    if (scrub_start() < 0)
+        log_printf(LOG_ERROR, "Error: scrubber thread not started\n");
+    if (gc_start() < 0)
+        log_printf(LOG_ERROR, "Error: garbage collector not started, deleting files right away\n");
+    if (fsstat_start() < 0)
+        log_printf(LOG_ERROR, "Error: statfs refresh thread not started, statfs cache expires instead\n");
+    if (pool_start() < 0)
+        log_printf(LOG_ERROR, "Error: connection maintenance thread not started\n");
+
+    return NULL;
+}
+
+/**
+
+void(* fuse_operations::destroy)(void *)
+Clean up filesystem
+
+Called on filesystem exit.
+
+Introduced in version 2.3
+
+**/
+static void mysqlfs_destroy(void *data)
+{
+    (void) data;
+
+    scrub_stop();
+    gc_stop();
+    fsstat_stop();
+    ra_stop();
+    fh_stop();
+    pool_stop();
+}
+
+/**
+
 int(* fuse_operations::create)(const char *, mode_t, struct fuse_file_info *)
 Create and open a file
 
@@ -632,36 +733,9 @@ Replaced 'struct statfs' parameter with 'struct statvfs' in version 2.5
 **/
 static int mysqlfs_statfs(const char *path, struct statvfs *buf)
 {
+    log_printf(LOG_D_CALL, "%s(\"%s\")\n", __func__, path);
 
-	MYSQL *dbconn;
-
-	log_printf(LOG_D_CALL, "mysqlfs_unlink(\"%s\")\n", path);
-
-	if ((dbconn = pool_get()) == NULL)
-		return -EMFILE;
-
-
-        buf->f_namemax = 255;
-
-        buf->f_bsize = DATA_BLOCK_SIZE;
-
-        /*
-         * df seems to use f_bsize instead of f_frsize, so make them
-         * the same
-         */
-        buf->f_frsize = buf->f_bsize;
-
-	buf->f_files = query_total_inodes(dbconn)+1024;
-	buf->f_ffree = 1024; /* arbitrary value */
-	buf->f_favail = buf->f_ffree;
-
-	buf->f_blocks = query_total_blocks(dbconn)+10240;
-	buf->f_bfree = 10240; /* arbitrary value */
-	buf->f_bavail = buf->f_bfree;
-
-	pool_put(dbconn);
-
-        return 0;
+    return fsstat_get(buf);
 }
 
 static int
@@ -696,7 +770,7 @@ mysqlfs_getxattr(const char *path, const char *attr, char * val, size_t sz)
 
     log_printf(LOG_D_CALL, "%s(%s:%s)->%ld\n", __func__, path, attr, sz);
 
-    if ((dbconn = pool_get()) == NULL)
+    if ((dbconn = pool_get_read(0)) == NULL)
       return -EMFILE;
 
     inode = query_inode(dbconn, path);
@@ -720,7 +794,7 @@ mysqlfs_listxattr(const char *path, char * val, size_t sz)
 
     log_printf(LOG_D_CALL, "%s(%s)\n", __func__, path);
 
-    if ((dbconn = pool_get()) == NULL)
+    if ((dbconn = pool_get_read(0)) == NULL)
       return -EMFILE;
 
     inode = query_inode(dbconn, path);
@@ -777,6 +851,8 @@ static struct fuse_operations mysqlfs_oper = {
     .open	= mysqlfs_open,
     .read	= mysqlfs_read,
     .write	= mysqlfs_write,
+    .flush	= mysqlfs_flush,
+    .fsync	= mysqlfs_fsync,
     .release	= mysqlfs_release,
     .link	= mysqlfs_link,
     .symlink	= mysqlfs_symlink,
@@ -784,6 +860,8 @@ static struct fuse_operations mysqlfs_oper = {
     .rename	= mysqlfs_rename,
     .create	= mysqlfs_create,
     .statfs     = mysqlfs_statfs,
+    .init       = mysqlfs_init,
+    .destroy    = mysqlfs_destroy,
 
     .setxattr   = mysqlfs_setxattr,
     .getxattr   = mysqlfs_getxattr,
@@ -796,7 +874,7 @@ void usage(){
     fprintf(stderr,
             "usage: mysqlfs [opts] <mountpoint>\n\n");
     fprintf(stderr,
-            "       mysqlfs [-osocket=/tmp/mysql.sock] [-obig_writes] [-oallow_other] [-odefault_permissions] [-oport=####] [-otable_prefix=prefix] -ohost=host -ouser=user -opassword=password "
+            "       mysqlfs [-osocket=/tmp/mysql.sock] [-obig_writes] [-oallow_other] [-odefault_permissions] [-oport=####] [-otable_prefix=prefix] [-odcache_size=KiB] [-onegative_ttl=secs] [-oattr_ttl=secs] [-ostatfs_ttl=secs] [-ostatfs_headroom=bytes] [-obcache_size=KiB] [-oreadahead=KiB] [-ocompress=none|lz4|zstd] [-odedup] [-oinline_max=bytes] [-owriteback_size=KiB] [-owriteback_delay=secs] [-omin_conns=#] [-omax_idle_conns=#] [-omax_conns=#] [-oconn_timeout=secs] [-othread_conns] [-oconn_check=secs] [-oconn_max_age=secs] [-oconn_max_uses=#] [-oreplicas=host[:port],...] [-oreplica_lag=secs] [-oshards=host[:port],...] [-ofsck] [-ofsck_threads=#] [-ofsck_chunk=#] [-oscrub_rate=#] [-ogc_rate=#] -ohost=host -ouser=user -opassword=password "
             "-odatabase=database ./mountpoint\n");
     fprintf(stderr,
             "       mysqlfs [-d] [-ologfile=filename] [-obig_writes] [-oallow_other] [-odefault_permissions] [-otable_prefix=prefix] -ohost=host -ouser=user -opassword=password "
@@ -829,35 +907,91 @@ enum
 /** fuse_opt for use with fuse_opt_parse() */
 static struct fuse_opt mysqlfs_opts[] =
   {
+    MYSQLFS_OPT_KEY(  "attr_ttl=%u",	attr_ttl,	0),
+    MYSQLFS_OPT_KEY("--attr_ttl=%u",	attr_ttl,	0),
     MYSQLFS_OPT_KEY(  "background",	bg,	1),
+    MYSQLFS_OPT_KEY(  "bcache_size=%u",	bcache_size,	0),
+    MYSQLFS_OPT_KEY("--bcache_size=%u",	bcache_size,	0),
+    MYSQLFS_OPT_KEY(  "compress=%s",	compress,	0),
+    MYSQLFS_OPT_KEY("--compress=%s",	compress,	0),
+    MYSQLFS_OPT_KEY(  "conn_check=%u",	conn_check,	0),
+    MYSQLFS_OPT_KEY("--conn_check=%u",	conn_check,	0),
+    MYSQLFS_OPT_KEY(  "conn_max_age=%u",	conn_max_age,	0),
+    MYSQLFS_OPT_KEY("--conn_max_age=%u",	conn_max_age,	0),
+    MYSQLFS_OPT_KEY(  "conn_max_uses=%u",	conn_max_uses,	0),
+    MYSQLFS_OPT_KEY("--conn_max_uses=%u",	conn_max_uses,	0),
+    MYSQLFS_OPT_KEY(  "conn_timeout=%u",	conn_timeout,	0),
+    MYSQLFS_OPT_KEY("--conn_timeout=%u",	conn_timeout,	0),
     MYSQLFS_OPT_KEY(  "database=%s",	db,	1),
+    MYSQLFS_OPT_KEY(  "dcache_size=%u",	dcache_size,	0),
+    MYSQLFS_OPT_KEY("--dcache_size=%u",	dcache_size,	0),
+    MYSQLFS_OPT_KEY(  "dedup",		dedup,	1),
+    MYSQLFS_OPT_KEY("--dedup",		dedup,	1),
     MYSQLFS_OPT_KEY("--database=%s",	db,	1),
     MYSQLFS_OPT_KEY( "-D %s",		db,	1),
     MYSQLFS_OPT_KEY(  "fsck",		fsck,	1),
     MYSQLFS_OPT_KEY(  "fsck=%d",	fsck,	1),
     MYSQLFS_OPT_KEY("--fsck=%d",	fsck,	1),
     MYSQLFS_OPT_KEY("nofsck",		fsck,	0),
+    MYSQLFS_OPT_KEY(  "fsck_chunk=%u",	fsck_chunk,	0),
+    MYSQLFS_OPT_KEY("--fsck_chunk=%u",	fsck_chunk,	0),
+    MYSQLFS_OPT_KEY(  "fsck_threads=%u",	fsck_threads,	0),
+    MYSQLFS_OPT_KEY("--fsck_threads=%u",	fsck_threads,	0),
+    MYSQLFS_OPT_KEY(  "gc_rate=%u",	gc_rate,	0),
+    MYSQLFS_OPT_KEY("--gc_rate=%u",	gc_rate,	0),
     MYSQLFS_OPT_KEY(  "host=%s",	host,	0),
     MYSQLFS_OPT_KEY("--host=%s",	host,	0),
     MYSQLFS_OPT_KEY( "-h %s",		host,	0),
+    MYSQLFS_OPT_KEY(  "inline_max=%u",	inline_max,	0),
+    MYSQLFS_OPT_KEY("--inline_max=%u",	inline_max,	0),
     MYSQLFS_OPT_KEY(  "logfile=%s",	logfile,	0),
     MYSQLFS_OPT_KEY("--logfile=%s",	logfile,	0),
+    MYSQLFS_OPT_KEY(  "max_conns=%u",	max_conns,	0),
+    MYSQLFS_OPT_KEY("--max_conns=%u",	max_conns,	0),
+    MYSQLFS_OPT_KEY(  "max_idle_conns=%u",	max_idling_conns,	0),
+    MYSQLFS_OPT_KEY("--max_idle_conns=%u",	max_idling_conns,	0),
+    MYSQLFS_OPT_KEY(  "min_conns=%u",	min_conns,	0),
+    MYSQLFS_OPT_KEY("--min_conns=%u",	min_conns,	0),
     MYSQLFS_OPT_KEY(  "mycnf_group=%s",	mycnf_group,	0), /* Read defaults from specified group in my.cnf  -- Command line options still have precedence.  */
     MYSQLFS_OPT_KEY("--mycnf_group=%s",	mycnf_group,	0),
+    MYSQLFS_OPT_KEY(  "negative_max=%u",	negative_max,	0),
+    MYSQLFS_OPT_KEY("--negative_max=%u",	negative_max,	0),
+    MYSQLFS_OPT_KEY(  "negative_ttl=%u",	negative_ttl,	0),
+    MYSQLFS_OPT_KEY("--negative_ttl=%u",	negative_ttl,	0),
     MYSQLFS_OPT_KEY(  "password=%s",	passwd,	0),
     MYSQLFS_OPT_KEY("--password=%s",	passwd,	0),
     MYSQLFS_OPT_KEY(  "port=%d",	port,	0),
     MYSQLFS_OPT_KEY("--port=%d",	port,	0),
     MYSQLFS_OPT_KEY( "-P %d",		port,	0),
+    MYSQLFS_OPT_KEY(  "readahead=%u",	readahead,	0),
+    MYSQLFS_OPT_KEY("--readahead=%u",	readahead,	0),
+    MYSQLFS_OPT_KEY(  "replica_lag=%u",	replica_lag,	0),
+    MYSQLFS_OPT_KEY("--replica_lag=%u",	replica_lag,	0),
+    MYSQLFS_OPT_KEY(  "replicas=%s",	replicas,	0),
+    MYSQLFS_OPT_KEY("--replicas=%s",	replicas,	0),
+    MYSQLFS_OPT_KEY(  "scrub_rate=%u",	scrub_rate,	0),
+    MYSQLFS_OPT_KEY("--scrub_rate=%u",	scrub_rate,	0),
+    MYSQLFS_OPT_KEY(  "shards=%s",	shards,	0),
+    MYSQLFS_OPT_KEY("--shards=%s",	shards,	0),
     MYSQLFS_OPT_KEY(  "socket=%s",	socket,	0),
     MYSQLFS_OPT_KEY("--socket=%s",	socket,	0),
     MYSQLFS_OPT_KEY( "-S %s",		socket,	0),
+    MYSQLFS_OPT_KEY(  "statfs_headroom=%llu",	statfs_headroom,	0),
+    MYSQLFS_OPT_KEY("--statfs_headroom=%llu",	statfs_headroom,	0),
+    MYSQLFS_OPT_KEY(  "statfs_ttl=%u",	statfs_ttl,	0),
+    MYSQLFS_OPT_KEY("--statfs_ttl=%u",	statfs_ttl,	0),
     MYSQLFS_OPT_KEY(  "table_prefix=%s",tableprefix,    0),
     MYSQLFS_OPT_KEY("--table_prefix=%s",tableprefix,    0),
     MYSQLFS_OPT_KEY( "-tp %s",          tableprefix,    0),
+    MYSQLFS_OPT_KEY(  "thread_conns",	thread_conns,	1),
+    MYSQLFS_OPT_KEY("--thread_conns",	thread_conns,	1),
     MYSQLFS_OPT_KEY(  "user=%s",	user,	0),
     MYSQLFS_OPT_KEY("--user=%s",	user,	0),
     MYSQLFS_OPT_KEY( "-u %s",		user,	0),
+    MYSQLFS_OPT_KEY(  "writeback_delay=%u",	writeback_delay,	0),
+    MYSQLFS_OPT_KEY("--writeback_delay=%u",	writeback_delay,	0),
+    MYSQLFS_OPT_KEY(  "writeback_size=%u",	writeback_size,	0),
+    MYSQLFS_OPT_KEY("--writeback_size=%u",	writeback_size,	0),
     MYSQLFS_OPT_KEY( "-d",		debug,	0xFF),//LOG_ERROR | LOG_INFO |  LOG_DEBUG),
 
     FUSE_OPT_KEY("debug-dnq",	        KEY_DEBUG_DNQ),
@@ -895,9 +1029,27 @@ static int mysqlfs_opt_proc(void *data, const char *arg, int key, struct fuse_ar
             fprintf (stderr, "connect: mysql://%s:%s@%s:%d/%s\n", opt->user, opt->passwd, opt->host, opt->port, opt->db);
             fprintf (stderr, "connect: sock://%s\n", opt->socket);
             fprintf (stderr, "fsck? %s\n", (opt->fsck ? "yes" : "no"));
+            fprintf (stderr, "fsck: %u threads, %u inodes at a time\n", opt->fsck_threads, opt->fsck_chunk);
+            fprintf (stderr, "scrub: %u inodes a second\n", opt->scrub_rate);
+            fprintf (stderr, "gc: %u data blocks a second\n", opt->gc_rate);
             fprintf (stderr, "group: %s\n", opt->mycnf_group);
-            fprintf (stderr, "pool: %d initial connections\n", opt->init_conns);
-            fprintf (stderr, "pool: %d idling connections\n", opt->max_idling_conns);
+            fprintf (stderr, "pool: %u warm connections\n", opt->min_conns);
+            fprintf (stderr, "pool: %u idling connections\n", opt->max_idling_conns);
+            fprintf (stderr, "pool: %u connections at most, waiting %us for one\n", opt->max_conns, opt->conn_timeout);
+            fprintf (stderr, "pool: per-thread connections? %s\n", (opt->thread_conns ? "yes" : "no"));
+            fprintf (stderr, "replicas: %s, primary reads for %us after a change\n", opt->replicas, opt->replica_lag);
+            fprintf (stderr, "shards: %s\n", opt->shards);
+            fprintf (stderr, "pool: checked every %us, replaced after %us or %u uses\n", opt->conn_check, opt->conn_max_age, opt->conn_max_uses);
+            fprintf (stderr, "dcache: %u KiB\n", opt->dcache_size);
+            fprintf (stderr, "dcache: %u negative entries for %us\n", opt->negative_max, opt->negative_ttl);
+            fprintf (stderr, "icache: attributes cached for %us\n", opt->attr_ttl);
+            fprintf (stderr, "statfs: cached for %us, %llu bytes of headroom\n", opt->statfs_ttl, opt->statfs_headroom);
+            fprintf (stderr, "bcache: %u KiB\n", opt->bcache_size);
+            fprintf (stderr, "read-ahead: up to %u KiB\n", opt->readahead);
+            fprintf (stderr, "compression: %s\n", opt->compress ? opt->compress : "none");
+            fprintf (stderr, "deduplication? %s\n", (opt->dedup ? "yes" : "no"));
+            fprintf (stderr, "inline data: up to %u bytes\n", opt->inline_max);
+            fprintf (stderr, "write-back: %u KiB, flushed after %us\n", opt->writeback_size, opt->writeback_delay);
             fprintf (stderr, "logfile: file://%s\n", opt->logfile);
             fprintf (stderr, "bg? %s (debug)\n", (opt->bg ? "yes" : "no"));
             fprintf (stderr, "table prefix: %s\n\n", opt->tableprefix);
@@ -941,10 +1093,28 @@ static int mysqlfs_opt_proc(void *data, const char *arg, int key, struct fuse_ar
 int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char timeout_arg[64];
     struct mysqlfs_opt opt = {
-	.init_conns	= 1,
+	.min_conns	= 2,
 	.debug=LOG_ERROR | LOG_INFO,
-	.max_idling_conns = 5,
+	.max_idling_conns = 8,
+	.max_conns	= 16,
+	.conn_timeout	= 10,
+	.conn_check	= 30,
+	.conn_max_age	= 3600,
+	.replica_lag	= 2,
+	.fsck_threads	= 4,
+	.fsck_chunk	= 10000,
+	.gc_rate	= 4096,
+	.dcache_size	= 16384,
+	.negative_ttl	= 5,
+	.negative_max	= 65536,
+	.attr_ttl	= 1,
+	.statfs_ttl	= 5,
+	.writeback_size	= 4096,
+	.bcache_size	= 32768,
+	.readahead	= 1024,
+	.writeback_delay = 1,
 	.mycnf_group	= "mysqlfs",
 	.logfile	= "mysqlfs.log",
     };
@@ -957,12 +1127,49 @@ int main(int argc, char *argv[])
 	log_types_mask=opt.debug;
 	if (log_types_mask & LOG_DEBUG) log_debug_mask=0xFFFF;//LOG_D_CALL | LOG_D_SQL | LOG_D_OTHER;
 
+    if (dcache_init((size_t)opt.dcache_size * 1024, opt.negative_ttl, opt.negative_max) < 0) {
+        log_printf(LOG_ERROR, "Error: dcache_init() failed\n");
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    if (icache_init(opt.attr_ttl) < 0) {
+        log_printf(LOG_ERROR, "Error: icache_init() failed\n");
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    if (compress_init(opt.compress) < 0) {
+        log_printf(LOG_ERROR, "Error: compress_init() failed\n");
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    /* Let the kernel cache attributes and lookups for as long as we do. */
+    snprintf(timeout_arg, sizeof(timeout_arg), "-oattr_timeout=%u", opt.attr_ttl);
+    fuse_opt_add_arg(&args, timeout_arg);
+    snprintf(timeout_arg, sizeof(timeout_arg), "-oentry_timeout=%u", opt.attr_ttl);
+    fuse_opt_add_arg(&args, timeout_arg);
+
     if (pool_init(&opt) < 0) {
         log_printf(LOG_ERROR, "Error: pool_init() failed\n");
         fuse_opt_free_args(&args);
         return EXIT_FAILURE;
     }
 
+    /* These count in blocks, whose size pool_init() read from the filesystem. */
+    fh_init(opt.writeback_size, opt.writeback_delay);
+
+    if (bcache_init((size_t)opt.bcache_size * 1024) < 0) {
+        log_printf(LOG_ERROR, "Error: bcache_init() failed\n");
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+    ra_init(opt.readahead);
+    scrub_init(opt.scrub_rate);
+    gc_init(opt.gc_rate);
+    fsstat_init(opt.statfs_ttl, opt.statfs_headroom);
+
     /*
      * I found that -- running from a script (ie no term?) -- the MySQLfs would not background, so the terminal is held; this makes automated testing difficult.
      *
@@ -984,6 +1191,9 @@ int main(int argc, char *argv[])
     fuse_opt_free_args(&args);
 
     pool_cleanup();
+    bcache_cleanup();
+    icache_cleanup();
+    dcache_cleanup();
 
     return EXIT_SUCCESS;
 }
@@ -11,13 +11,21 @@
 /** maximum length of a full pathname */
 #define PATH_MAX 1024
 
-/** size of a single datablock written to the database; should be less than the size of a "blob" or mysqlfs.sql needs to be altered */
+/** block size recorded for filesystems that have none, see query_block_size_init() */
 #ifdef FUSE_CAP_BIG_WRITES
  #define DATA_BLOCK_SIZE	131072
 #else
  #define DATA_BLOCK_SIZE	4096
 #endif
 
+/** smallest supported block size */
+#define DATA_BLOCK_SIZE_MIN	4096
+/** largest supported block size; a block must fit in the server's max_allowed_packet */
+#define DATA_BLOCK_SIZE_MAX	(16 * 1024 * 1024)
+
+/** size of a single datablock written to the database, read from the filesystem at mount time */
+extern unsigned long data_block_size;
+
 
 /** basic preprocessor-phase maximum macro */
 #define MIN(a,b)	((a) < (b) ? (a) : (b))
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
 
 #include <fuse/fuse.h>
@@ -20,6 +21,7 @@
 #include <mysql/mysql.h>
 
 #include "query.h"
+#include "fsck.h"
 #include "pool.h"
 #include "log.h"
 
@@ -32,19 +34,104 @@ struct pool_lifo {
     void		*conn;		/**< payload if this item in the list */
 };
 
-/* We have only one pool -> use global variables. */
-struct pool_lifo *lifo_pool = NULL;
-struct pool_lifo *lifo_unused = NULL;
-static pthread_mutex_t lifo_mutex = PTHREAD_MUTEX_INITIALIZER;
-unsigned int lifo_unused_cnt = 0;
-unsigned int lifo_pool_cnt = 0;
+/**
+ * The connections to one server.  There is one for the primary, plus one
+ * per replica given with the replicas option and one per data shard given
+ * with the shards option.
+ */
+struct pool {
+    char		*host;		/**< server host */
+    unsigned int	port;		/**< server port */
+    char		*socket;	/**< server socket, primary only */
+    pthread_mutex_t	lifo_mutex;	/**< protects everything below */
+    pthread_cond_t	lifo_cond;	/**< signalled when a connection is put back or closed */
+    struct pool_lifo	*lifo_pool;	/**< idling connections, most recently used first */
+    struct pool_lifo	*lifo_unused;	/**< spare list items */
+    unsigned int	lifo_pool_cnt;
+    unsigned int	lifo_unused_cnt;
+    unsigned int	conns;		/**< connections open, idling or in use */
+    time_t		down_until;	/**< replicas: don't try connecting before then */
+};
+
+/**
+ * A pooled connection.  The MYSQL handle comes first, so the MYSQL * handed
+ * out by pool_get() is the struct pool_conn * too, and everything that
+ * takes a MYSQL * keeps working unchanged.
+ */
+struct pool_conn {
+    MYSQL		mysql;			/**< must stay the first member */
+    struct pool		*pool;			/**< where the connection goes back to */
+    unsigned long	thread_id;		/**< server thread the statements were prepared on */
+    MYSQL_STMT		*stmts[POOL_STMTS];	/**< prepared statements, see pool_stmt() */
+    int			busy;			/**< a thread-bound connection handed out by pool_get() */
+    time_t		opened;			/**< when the connection was opened */
+    time_t		last_used;		/**< when it was last put back, or checked */
+    unsigned long	uses;			/**< times it was handed out by pool_get() */
+};
+
+/* pools[0] is the primary, followed by the replicas, then the shards. */
+static struct pool *pools = NULL;
+static unsigned int pool_count = 0;
+static unsigned int pool_replicas = 0;
+static unsigned int pool_shard_count = 0;
+static unsigned int pool_next_replica = 0;	/**< round robin among the replicas */
+
+/*
+ * With the thread_conns option, the first primary connection a thread gets
+ * stays bound to it (up to max_idle_conns such threads), and the thread's
+ * later pool_get() and pool_put() calls don't touch lifo_mutex at all.  The
+ * connection goes back to the pool when the thread exits.  Background
+ * threads, which live until unmount, are marked with pool_thread_unbound()
+ * and never bind one: the connections are meant for FUSE's threads.
+ */
+static pthread_key_t pool_key;
+static unsigned int pool_bound = 0;	/**< connections bound to a thread, under the primary's lifo_mutex */
+static char pool_unbound_mark;
+#define POOL_UNBOUND	((void *)&pool_unbound_mark)	/**< pool_key of threads that don't bind */
+
+/*
+ * The maintenance thread wakes up every conn_check seconds.  It pings the
+ * connections that have been idling since its last round, replaces dead
+ * and retired ones (see pool_conn_expired()), and opens connections back
+ * up to min_conns, so that a server restart or failover is dealt with
+ * before the next file operation needs a connection.
+ */
+static pthread_mutex_t pool_maint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_maint_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_maint;
+static int pool_maint_running = 0;
+
+/*
+ * Read-your-writes: when each inode was last changed, in a small table
+ * indexed by inode number.  Reads of an inode changed less than
+ * replica_lag seconds ago go to the primary.  Collisions only send more
+ * reads to the primary.
+ */
+#define POOL_RYW_SLOTS	4096
+
+static time_t pool_ryw[POOL_RYW_SLOTS];
+static time_t pool_ryw_any = 0;		/**< last change of any inode */
 
 /*********************************
  * Pool MySQL-specific functions *
  *********************************/
 
-static MYSQL *pool_open_mysql_connection()
+/** Close every prepared statement of a connection */
+static void pool_close_stmts(struct pool_conn *conn)
 {
+    int i;
+
+    for (i = 0; i < POOL_STMTS; i++) {
+	if (conn->stmts[i]) {
+	    mysql_stmt_close(conn->stmts[i]);
+	    conn->stmts[i] = NULL;
+	}
+    }
+}
+
+static MYSQL *pool_open_mysql_connection(struct pool *pool)
+{
+    struct pool_conn *conn;
     MYSQL *mysql;
 #if defined(LIBMYSQL_VERSION_ID) && (LIBMYSQL_VERSION_ID >= 80000)
     bool reconnect = 1;
@@ -52,38 +139,53 @@ static MYSQL *pool_open_mysql_connection()
     my_bool reconnect = 1;
 #endif
 
-    mysql = mysql_init(NULL);
-    if (!mysql) {
+    conn = calloc(1, sizeof(struct pool_conn));
+    if (!conn || !mysql_init(&conn->mysql)) {
 	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	free(conn);
         return NULL;
     }
+    mysql = &conn->mysql;
 
     if (opt->mycnf_group)
 	mysql_options(mysql, MYSQL_READ_DEFAULT_GROUP, opt->mycnf_group);
 
-    if (! mysql_real_connect(mysql, opt->host, opt->user,
+    if (! mysql_real_connect(mysql, pool->host, opt->user,
 			     opt->passwd, opt->db,
-			     opt->port, opt->socket, 0)) {
-        log_printf(LOG_ERROR, "ERROR: mysql_real_connect(): %s\n",
-		   mysql_error(mysql));
+			     pool->port, pool->socket, 0)) {
+        log_printf(LOG_ERROR, "ERROR: mysql_real_connect(%s): %s\n",
+		   pool->host ? pool->host : "localhost", mysql_error(mysql));
 	mysql_close(mysql);
+	free(conn);
+	if (pool != pools)
+	    pool->down_until = time(NULL) + POOL_REPLICA_RETRY;
         return NULL;
     }
 
     /* Reconnect must be set *after* real_connect()! */
     mysql_options(mysql, MYSQL_OPT_RECONNECT, (char*)&reconnect);
+    conn->pool = pool;
+    conn->thread_id = mysql_thread_id(mysql);
+    conn->opened = conn->last_used = time(NULL);
 
     return mysql;
 }
 
 static void pool_close_mysql_connection(MYSQL *mysql)
 {
-    if (mysql)
-        mysql_close(mysql);
+    struct pool_conn *conn = (struct pool_conn *)mysql;
+
+    if (!conn)
+	return;
+
+    pool_close_stmts(conn);
+    mysql_close(mysql);
+    free(conn);
 }
 
 static int pool_check_mysql_setup(MYSQL *mysql)
 {
+    unsigned int threads;
     int ret = 0;
 
     /* Check the server version.  */
@@ -100,6 +202,10 @@ static int pool_check_mysql_setup(MYSQL *mysql)
 	goto out;
     }
 
+    ret = query_block_size_init(mysql);
+    if (ret < 0)
+	goto out;
+
     /* Create root directory if it doesn't exist. */
     ret = query_inode_full(mysql, "/", NULL, 0, NULL, NULL, NULL);
     if (ret == -ENOENT)
@@ -109,7 +215,11 @@ static int pool_check_mysql_setup(MYSQL *mysql)
 
     /* Cleanup. */
     if (opt->fsck == 1) {
-        ret = query_fsck(mysql);
+        /* The workers take their connections from the pool, next to this one. */
+        threads = opt->fsck_threads;
+        if (opt->max_conns && threads > opt->max_conns - 1)
+            threads = opt->max_conns - 1;
+        ret = fsck_run(mysql, threads, opt->fsck_chunk);
     }
 
 out:
@@ -120,66 +230,336 @@ out:
  * Pool DB-independent (almost) functions *
  ******************************************/
 
-static inline int lifo_put(void *conn)
+/* The lifo_*() functions are called with the pool's lifo_mutex held. */
+
+static inline int lifo_put(struct pool *pool, void *conn)
 {
     struct pool_lifo *ent;
 
     log_printf(LOG_D_POOL, "%s() <= %p\n", __func__, conn);
-    pthread_mutex_lock(&lifo_mutex);
-    if (lifo_unused) {
-	ent = lifo_unused;
-	lifo_unused = ent->next;
-	lifo_unused_cnt--;
+    if (pool->lifo_unused) {
+	ent = pool->lifo_unused;
+	pool->lifo_unused = ent->next;
+	pool->lifo_unused_cnt--;
     } else {
 	ent = calloc(1, sizeof(struct pool_lifo));
-	if (!ent) {
-	    pthread_mutex_unlock(&lifo_mutex);
+	if (!ent)
 	    return -ENOMEM;
-	}
     }
     ent->conn = conn;
-    ent->next = lifo_pool;
-    lifo_pool = ent;
-    lifo_pool_cnt++;
-    pthread_mutex_unlock(&lifo_mutex);
+    ent->next = pool->lifo_pool;
+    pool->lifo_pool = ent;
+    pool->lifo_pool_cnt++;
 
     return 0;
 }
 
-static inline void *lifo_get()
+/** Move a list item from the idling connections to the spare ones */
+static inline void *lifo_release(struct pool *pool, struct pool_lifo **entp)
 {
-    struct pool_lifo *ent;
-    void *conn;
+    struct pool_lifo *ent = *entp;
+    void *conn = ent->conn;
 
-    pthread_mutex_lock(&lifo_mutex);
-    if (lifo_pool) {
-	ent = lifo_pool;
-	conn = ent->conn;
-	lifo_pool = ent->next;
-	lifo_pool_cnt--;
-	ent->next = lifo_unused;
-	ent->conn = NULL;
-	lifo_unused = ent;
-	lifo_unused_cnt++;
-    } else
-	conn = NULL;
-    pthread_mutex_unlock(&lifo_mutex);
+    *entp = ent->next;
+    pool->lifo_pool_cnt--;
+    ent->conn = NULL;
+    ent->next = pool->lifo_unused;
+    pool->lifo_unused = ent;
+    pool->lifo_unused_cnt++;
 
     return conn;
 }
 
+static inline void *lifo_get(struct pool *pool)
+{
+    if (!pool->lifo_pool)
+	return NULL;
+
+    return lifo_release(pool, &pool->lifo_pool);
+}
+
+/** Take the connection that has been idling the longest */
+static inline void *lifo_get_last(struct pool *pool)
+{
+    struct pool_lifo **entp;
+
+    if (!pool->lifo_pool)
+	return NULL;
+
+    for (entp = &pool->lifo_pool; (*entp)->next; entp = &(*entp)->next)
+	;
+
+    return lifo_release(pool, entp);
+}
+
+static void pool_put_shared(void *conn);
+
+/** Whether a connection is due for retirement, by age or number of uses */
+static int pool_conn_expired(struct pool_conn *conn, time_t now)
+{
+    return (opt->conn_max_age && now - conn->opened >= opt->conn_max_age) ||
+	(opt->conn_max_uses && conn->uses >= opt->conn_max_uses);
+}
+
+/** Close a connection that won't go back to its pool */
+static void pool_drop(void *conn)
+{
+    struct pool *pool = ((struct pool_conn *)conn)->pool;
+
+    pool_close_mysql_connection(conn);
+
+    pthread_mutex_lock(&pool->lifo_mutex);
+    pool->conns--;
+    pthread_cond_signal(&pool->lifo_cond);
+    pthread_mutex_unlock(&pool->lifo_mutex);
+}
+
+/** Open a connection for the idling ones, counted by the caller; called and returns with lifo_mutex held */
+static int pool_add_idle(struct pool *pool)
+{
+    void *conn;
+
+    pthread_mutex_unlock(&pool->lifo_mutex);
+    conn = pool_open_mysql_connection(pool);
+    pthread_mutex_lock(&pool->lifo_mutex);
+
+    if (!conn)
+	return -EIO;
+    if (lifo_put(pool, conn) < 0) {
+	pthread_mutex_unlock(&pool->lifo_mutex);
+	pool_close_mysql_connection(conn);
+	pthread_mutex_lock(&pool->lifo_mutex);
+	return -ENOMEM;
+    }
+    pthread_cond_signal(&pool->lifo_cond);
+
+    return 0;
+}
+
+/** One round of the maintenance thread, for one server */
+static void pool_maintain(struct pool *pool)
+{
+    struct pool_conn *conn, *fresh;
+    unsigned int n;
+    time_t now = time(NULL);
+
+    /* The longest idling connections are at the end of the list, and
+     * checked ones go back to the front: stop at the first recent one. */
+    pthread_mutex_lock(&pool->lifo_mutex);
+    for (n = pool->lifo_pool_cnt; n > 0 && (conn = lifo_get_last(pool)); n--) {
+	if (now - conn->last_used < opt->conn_check && !pool_conn_expired(conn, now)) {
+	    lifo_put(pool, conn);
+	    break;
+	}
+	pthread_mutex_unlock(&pool->lifo_mutex);
+
+	if (pool_conn_expired(conn, now)) {
+	    log_printf(LOG_D_POOL, "%s(): retiring conn=%p after %lus and %lu uses\n", __func__,
+		       conn, (unsigned long)(now - conn->opened), conn->uses);
+	    fresh = NULL;
+	} else if (mysql_ping(&conn->mysql)) {
+	    log_printf(LOG_INFO, "%s(): conn=%p is dead: %s\n", __func__,
+		       conn, mysql_error(&conn->mysql));
+	    fresh = NULL;
+	} else {
+	    conn->last_used = now;
+	    fresh = conn;
+	}
+	if (!fresh)
+	    pool_close_mysql_connection(&conn->mysql);
+
+	pthread_mutex_lock(&pool->lifo_mutex);
+	if (fresh) {
+	    if (lifo_put(pool, fresh) < 0) {
+		pthread_mutex_unlock(&pool->lifo_mutex);
+		pool_drop(fresh);
+		pthread_mutex_lock(&pool->lifo_mutex);
+	    }
+	} else if (pool_add_idle(pool) < 0) {
+	    pool->conns--;
+	}
+	pthread_cond_signal(&pool->lifo_cond);
+    }
+
+    /* Keep min_conns warm. */
+    while (pool_maint_running && pool->conns < opt->min_conns &&
+	   (pool == pools || pool->down_until <= now)) {
+	pool->conns++;
+	if (pool_add_idle(pool) < 0) {
+	    pool->conns--;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&pool->lifo_mutex);
+}
+
+static void *pool_maint_thread(void *arg)
+{
+    struct timespec ts;
+    unsigned int i;
+
+    (void) arg;
+    mysql_thread_init();
+
+    pthread_mutex_lock(&pool_maint_lock);
+    while (pool_maint_running) {
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += opt->conn_check;
+	pthread_cond_timedwait(&pool_maint_cond, &pool_maint_lock, &ts);
+	if (!pool_maint_running)
+	    break;
+	pthread_mutex_unlock(&pool_maint_lock);
+
+	for (i = 0; i < pool_count; i++)
+	    pool_maintain(&pools[i]);
+
+	pthread_mutex_lock(&pool_maint_lock);
+    }
+    pthread_mutex_unlock(&pool_maint_lock);
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+int pool_start()
+{
+    int ret;
+
+    if (!opt->conn_check)
+	return 0;
+
+    pool_maint_running = 1;
+    ret = pthread_create(&pool_maint, NULL, pool_maint_thread, NULL);
+    if (ret) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ret));
+	pool_maint_running = 0;
+	return -ret;
+    }
+
+    return 0;
+}
+
+void pool_stop()
+{
+    if (!pool_maint_running)
+	return;
+
+    pthread_mutex_lock(&pool_maint_lock);
+    pool_maint_running = 0;
+    pthread_cond_signal(&pool_maint_cond);
+    pthread_mutex_unlock(&pool_maint_lock);
+
+    pthread_join(pool_maint, NULL);
+}
+
+/** Destructor of pool_key: give the connection of an exiting thread back to the pool */
+static void pool_thread_exit(void *conn)
+{
+    if (conn == POOL_UNBOUND)
+	return;
+
+    log_printf(LOG_D_POOL, "%s(%p)\n", __func__, conn);
+    ((struct pool_conn *)conn)->busy = 0;
+
+    pthread_mutex_lock(&pools[0].lifo_mutex);
+    pool_bound--;
+    pthread_mutex_unlock(&pools[0].lifo_mutex);
+
+    pool_put_shared(conn);
+}
+
+/** Set up the pool of a server and open its warm connections */
+static void pool_setup(struct pool *pool, char *host, unsigned int port, char *socket)
+{
+    unsigned int i;
+
+    pool->host = host;
+    pool->port = port;
+    pool->socket = socket;
+    pthread_mutex_init(&pool->lifo_mutex, NULL);
+    pthread_cond_init(&pool->lifo_cond, NULL);
+
+    /* The warm connections: pool_put() never lets the pool shrink below them. */
+    pthread_mutex_lock(&pool->lifo_mutex);
+    for (i = 0; i < opt->min_conns; i++) {
+	pool->conns++;
+	if (pool_add_idle(pool) < 0) {
+	    pool->conns--;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&pool->lifo_mutex);
+}
+
+/**
+ * Count the servers listed in the replicas or shards option, a comma
+ * separated list of host[:port], and split the list in place.
+ */
+static unsigned int pool_parse_servers(char *list, char **hosts, unsigned int *ports, unsigned int max)
+{
+    char *host, *port, *saveptr = NULL;
+    unsigned int n = 0;
+
+    for (host = strtok_r(list, ",", &saveptr); host && n < max;
+	 host = strtok_r(NULL, ",", &saveptr)) {
+	port = strchr(host, ':');
+	if (port)
+	    *port++ = '\0';
+	hosts[n] = host;
+	ports[n] = port ? (unsigned int)atoi(port) : opt->port;
+	n++;
+    }
+
+    return n;
+}
+
 int pool_init(struct mysqlfs_opt *opt_arg)
 {
-    int i, ret;
+    char *hosts[POOL_MAX_REPLICAS + POOL_MAX_SHARDS];
+    unsigned int ports[POOL_MAX_REPLICAS + POOL_MAX_SHARDS];
+    unsigned int i;
+    int ret;
 
     log_printf(LOG_D_POOL, "%s()\n", __func__);
     opt = opt_arg;
 
+    if (opt->max_conns && opt->min_conns > opt->max_conns)
+	opt->min_conns = opt->max_conns;
+    if (opt->max_idling_conns < opt->min_conns)
+	opt->max_idling_conns = opt->min_conns;
+    if (opt->max_conns && opt->max_idling_conns > opt->max_conns)
+	opt->max_idling_conns = opt->max_conns;
+
     query_tablename_init(opt->tableprefix);
+    query_dedup_init(opt->dedup);
 
-    for (i = 0; i < opt->init_conns; i++) {
-	void *conn = pool_open_mysql_connection();
-	lifo_put(conn);
+    if (opt->thread_conns && (ret = pthread_key_create(&pool_key, pool_thread_exit))) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ret));
+	opt->thread_conns = 0;
+    }
+
+    if (opt->replicas)
+	pool_replicas = pool_parse_servers(opt->replicas, hosts, ports, POOL_MAX_REPLICAS);
+    if (opt->shards)
+	pool_shard_count = pool_parse_servers(opt->shards, hosts + pool_replicas,
+					      ports + pool_replicas, POOL_MAX_SHARDS);
+
+    pools = calloc(1 + pool_replicas + pool_shard_count, sizeof(struct pool));
+    if (!pools) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	return -1;
+    }
+    pool_count = 1 + pool_replicas + pool_shard_count;
+    query_inline_init(opt->inline_max);
+
+    pool_setup(&pools[0], opt->host, opt->port, opt->socket);
+    for (i = 0; i < pool_replicas + pool_shard_count; i++) {
+	if (i < pool_replicas)
+	    log_printf(LOG_INFO, "replica %u: %s:%u\n", i + 1, hosts[i], ports[i]);
+	else
+	    log_printf(LOG_INFO, "shard %u: %s:%u\n", i - pool_replicas, hosts[i], ports[i]);
+	pool_setup(&pools[1 + i], hosts[i], ports[i], NULL);
     }
 
     /* The following check should go to MySQL-specific section
@@ -200,36 +580,273 @@ int pool_init(struct mysqlfs_opt *opt_arg)
 
 void pool_cleanup()
 {
+    struct pool *pool;
     void *conn;
+    unsigned int i;
+
     log_printf(LOG_D_POOL, "%s()...\n", __func__);
-    while ((conn = lifo_get())) {
-	log_printf(LOG_D_POOL, "%s(): closing conn=%p\n", __func__, conn);
-	pool_close_mysql_connection(conn);
+
+    /* Other threads are gone by now, but ours may still hold a connection. */
+    if (opt->thread_conns && (conn = pthread_getspecific(pool_key))) {
+	pthread_setspecific(pool_key, NULL);
+	pool_thread_exit(conn);	/* nothing if POOL_UNBOUND */
+    }
+
+    for (i = 0; i < pool_count; i++) {
+	pool = &pools[i];
+	pthread_mutex_lock(&pool->lifo_mutex);
+	while ((conn = lifo_get(pool))) {
+	    pool->conns--;
+	    pthread_mutex_unlock(&pool->lifo_mutex);
+	    log_printf(LOG_D_POOL, "%s(): closing conn=%p\n", __func__, conn);
+	    pool_close_mysql_connection(conn);
+	    pthread_mutex_lock(&pool->lifo_mutex);
+	}
+	pthread_mutex_unlock(&pool->lifo_mutex);
     }
 }
 
-void *pool_get()
+/**
+ * Get a connection to a server: an idling one if there is any, else a new
+ * one as long as there are fewer than max_conns, else wait up to
+ * conn_timeout seconds for another thread to put one back.
+ *
+ * @return the connection, NULL if none could be opened or the wait timed out
+ * @param pool server to connect to
+ * @param timeout seconds to wait when max_conns are in use
+ */
+static void *pool_get_from(struct pool *pool, unsigned int timeout)
 {
-    void *conn = lifo_get();
-    if (!conn) {
-	conn = pool_open_mysql_connection();
-	log_printf(LOG_D_POOL, "%s(): Allocated new connection = %p\n", __func__, conn);
-    } else
-	log_printf(LOG_D_POOL, "%s(): Reused connection = %p\n", __func__, conn);
+    struct timespec deadline;
+    void *conn;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&pool->lifo_mutex);
+    while (!(conn = lifo_get(pool))) {
+	if (!opt->max_conns || pool->conns < opt->max_conns) {
+	    /* Count it now, so that other threads don't go over the limit meanwhile. */
+	    pool->conns++;
+	    pthread_mutex_unlock(&pool->lifo_mutex);
+
+	    conn = pool_open_mysql_connection(pool);
+	    log_printf(LOG_D_POOL, "%s(): Allocated new connection = %p\n", __func__, conn);
+	    if (!conn) {
+		pthread_mutex_lock(&pool->lifo_mutex);
+		pool->conns--;
+		pthread_cond_signal(&pool->lifo_cond);
+		pthread_mutex_unlock(&pool->lifo_mutex);
+		return NULL;
+	    }
+	    ((struct pool_conn *)conn)->uses++;
+	    return conn;
+	}
+	if (ret == ETIMEDOUT || !timeout) {
+	    pthread_mutex_unlock(&pool->lifo_mutex);
+	    if (timeout)
+		log_printf(LOG_ERROR, "%s(): all %u connections busy for %us\n", __func__,
+			   opt->max_conns, timeout);
+	    return NULL;
+	}
+	ret = pthread_cond_timedwait(&pool->lifo_cond, &pool->lifo_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&pool->lifo_mutex);
+
+    ((struct pool_conn *)conn)->uses++;
+    log_printf(LOG_D_POOL, "%s(): Reused connection = %p\n", __func__, conn);
 
     return conn;
 }
 
-void pool_put(void *conn)
+/** Put a connection back to the idling ones of its server, or close it if there are enough */
+static void pool_put_shared(void *conn)
 {
+    struct pool *pool = ((struct pool_conn *)conn)->pool;
+    int discard = 1;
+
     log_printf(LOG_D_POOL, "%s(%p)\n", __func__, conn);
 
-    /* This doesn't have to be mutex-protected.
-     * If we close more conns or don't close some nothing
-     * too bad happens. */
-    if (lifo_pool_cnt >= opt->max_idling_conns)
-	pool_close_mysql_connection(conn);
+    ((struct pool_conn *)conn)->last_used = time(NULL);
+
+    pthread_mutex_lock(&pool->lifo_mutex);
+    if (pool->lifo_pool_cnt < opt->max_idling_conns && lifo_put(pool, conn) == 0)
+	discard = 0;
     else
-	if (lifo_put(conn) < 0)
-	    pool_close_mysql_connection(conn);
+	pool->conns--;
+    /* Either way, a waiting thread may now have a connection or open one. */
+    pthread_cond_signal(&pool->lifo_cond);
+    pthread_mutex_unlock(&pool->lifo_mutex);
+
+    if (discard)
+	pool_close_mysql_connection(conn);
+}
+
+void *pool_get()
+{
+    struct pool_conn *conn;
+    int bind = 0;
+
+    if (!opt->thread_conns)
+	return pool_get_from(&pools[0], opt->conn_timeout);
+
+    /* Fast path: our own connection, unless we're already using it. */
+    conn = pthread_getspecific(pool_key);
+    if (conn == POOL_UNBOUND)
+	return pool_get_from(&pools[0], opt->conn_timeout);
+    if (conn && !conn->busy) {
+	time_t now = time(NULL);
+
+	/* The maintenance thread doesn't see bound connections: check them here,
+	 * when they have been idling longer than it would let them. */
+	if (!pool_conn_expired(conn, now) &&
+	    (!opt->conn_check || now - conn->last_used < opt->conn_check || !mysql_ping(&conn->mysql))) {
+	    conn->busy = 1;
+	    conn->uses++;
+	    return conn;
+	}
+	log_printf(LOG_D_POOL, "%s(): unbinding connection %p\n", __func__, conn);
+	pthread_setspecific(pool_key, NULL);
+	pthread_mutex_lock(&pools[0].lifo_mutex);
+	pool_bound--;
+	pthread_mutex_unlock(&pools[0].lifo_mutex);
+	pool_drop(conn);
+    }
+
+    conn = pool_get_from(&pools[0], opt->conn_timeout);
+    if (!conn || pthread_getspecific(pool_key))
+	return conn;
+
+    pthread_mutex_lock(&pools[0].lifo_mutex);
+    if (pool_bound < opt->max_idling_conns) {
+	pool_bound++;
+	bind = 1;
+    }
+    pthread_mutex_unlock(&pools[0].lifo_mutex);
+
+    if (bind && !pthread_setspecific(pool_key, conn)) {
+	log_printf(LOG_D_POOL, "%s(): bound connection %p to this thread\n", __func__, conn);
+	conn->busy = 1;
+    } else if (bind) {
+	pthread_mutex_lock(&pools[0].lifo_mutex);
+	pool_bound--;
+	pthread_mutex_unlock(&pools[0].lifo_mutex);
+    }
+
+    return conn;
+}
+
+int pool_is_replica(void *conn)
+{
+    struct pool *pool = ((struct pool_conn *)conn)->pool;
+
+    return pool > &pools[0] && pool <= &pools[pool_replicas];
+}
+
+void *pool_get_read(long inode)
+{
+    struct pool *pool;
+    time_t now, written;
+    unsigned int i, replicas = pool_replicas;
+    void *conn;
+
+    if (!replicas)
+	return pool_get();
+
+    if (inode >= 0 && opt->replica_lag) {
+	written = inode ? pool_ryw[inode % POOL_RYW_SLOTS] : pool_ryw_any;
+	if (time(NULL) - written < opt->replica_lag)
+	    return pool_get();
+    }
+
+    /* Round robin over the replicas that are up; don't wait for a busy one. */
+    now = time(NULL);
+    for (i = 0; i < replicas; i++) {
+	pool = &pools[1 + __sync_fetch_and_add(&pool_next_replica, 1) % replicas];
+	if (pool->down_until > now)
+	    continue;
+	conn = pool_get_from(pool, 0);
+	if (conn)
+	    return conn;
+    }
+
+    return pool_get();
+}
+
+void pool_thread_unbound()
+{
+    if (opt->thread_conns)
+	pthread_setspecific(pool_key, POOL_UNBOUND);
+}
+
+void pool_put(void *conn)
+{
+    if (opt->thread_conns && conn == pthread_getspecific(pool_key)) {
+	((struct pool_conn *)conn)->last_used = time(NULL);
+	((struct pool_conn *)conn)->busy = 0;
+	return;
+    }
+
+    pool_put_shared(conn);
+}
+
+void pool_written(long inode)
+{
+    time_t now = time(NULL);
+
+    if (!pool_replicas)
+	return;
+
+    if (inode > 0)
+	pool_ryw[inode % POOL_RYW_SLOTS] = now;
+    pool_ryw_any = now;
+}
+
+unsigned int pool_shards()
+{
+    return pool_shard_count;
+}
+
+unsigned int pool_shard_of(long inode)
+{
+    return pool_shard_count ? (unsigned long)inode % pool_shard_count : 0;
+}
+
+void *pool_get_shard(unsigned int shard)
+{
+    return pool_get_from(&pools[1 + pool_replicas + shard], opt->conn_timeout);
+}
+
+MYSQL_STMT *pool_stmt(MYSQL *mysql, unsigned int id, const char *sql)
+{
+    struct pool_conn *conn = (struct pool_conn *)mysql;
+    MYSQL_STMT *stmt;
+
+    /* An automatic reconnect loses the statements prepared on the old session. */
+    if (conn->thread_id != mysql_thread_id(mysql)) {
+	log_printf(LOG_D_POOL, "%s(%p): reconnected, preparing statements again\n", __func__, mysql);
+	pool_close_stmts(conn);
+	conn->thread_id = mysql_thread_id(mysql);
+    }
+
+    if (conn->stmts[id])
+	return conn->stmts[id];
+
+    stmt = mysql_stmt_init(mysql);
+    if (!stmt) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	return NULL;
+    }
+
+    log_printf(LOG_D_SQL, "prepare %u: %s\n", id, sql);
+    if (mysql_stmt_prepare(stmt, sql, strlen(sql))) {
+	log_printf(LOG_ERROR, "mysql_stmt_prepare() failed: %s\n", mysql_stmt_error(stmt));
+	mysql_stmt_close(stmt);
+	return NULL;
+    }
+
+    conn->stmts[id] = stmt;
+
+    return stmt;
 }
@@ -20,13 +20,39 @@ struct mysqlfs_opt {
     char *db;                   /**< MySQL database name */
     unsigned int port;		/**< MySQL port */
     char *socket;		/**< MySQL socket */
-    unsigned int fsck;		/**< fsck boolean 1 => do fsck, 0 => don't.  Used in pool_check_mysql_setup() to call query_fsck()  */
+    unsigned int fsck;		/**< fsck boolean 1 => do fsck, 0 => don't.  Used in pool_check_mysql_setup() to call fsck_run()  */
+    unsigned int fsck_threads;	/**< Connections fsck works with in parallel */
+    unsigned int fsck_chunk;	/**< Inodes checked at a time by an fsck connection */
+    unsigned int scrub_rate;	/**< Inodes a second the background scrubber checks (0 disables it) */
+    unsigned int gc_rate;	/**< Data blocks a second the garbage collector deletes (0 for no limit) */
     char *mycnf_group;		/**< Group in my.cnf to read defaults from */
-    unsigned int init_conns;	/**< Number of DB connections to init on startup */
+    unsigned int min_conns;	/**< Number of DB connections opened on startup and kept open */
     unsigned int max_idling_conns;	/**< Maximum number of idling DB connections */
+    unsigned int max_conns;	/**< Maximum number of DB connections (0 for no limit) */
+    unsigned int conn_timeout;	/**< Seconds to wait for a connection when max_conns are in use */
+    unsigned int thread_conns;	/**< Whether threads keep the connection they got, see pool_get() */
+    unsigned int conn_check;	/**< Seconds between health checks of idle connections (0 disables them) */
+    unsigned int conn_max_age;	/**< Seconds after which a connection is replaced (0 for no limit) */
+    unsigned int conn_max_uses;	/**< Operations after which a connection is replaced (0 for no limit) */
+    char *replicas;		/**< Read replicas, as a comma separated list of host[:port] */
+    unsigned int replica_lag;	/**< Seconds reads of a changed inode keep going to the primary (0 disables it) */
+    char *shards;		/**< Servers holding the data blocks, as a comma separated list of host[:port] */
     char *logfile;		/**< filename to which local debug/log information will be written */
     int bg;			/**< (used for autotest) whether a term-less execution should background */
     char *tableprefix;          /**< the prefix of the tables if applicable */
+    unsigned int dcache_size;	/**< Memory budget of the dentry cache, in KiB (0 disables it) */
+    unsigned int negative_ttl;	/**< Seconds a missing name is remembered by the dentry cache (0 disables it) */
+    unsigned int negative_max;	/**< Maximum number of missing names remembered by the dentry cache */
+    unsigned int attr_ttl;	/**< Seconds inode attributes are cached, here and in the kernel (0 disables it) */
+    unsigned int statfs_ttl;	/**< Seconds statfs() results are cached (0 disables it) */
+    unsigned long long statfs_headroom;	/**< Bytes statfs() counts free for tablespaces without a maximum size */
+    unsigned int writeback_size;	/**< Memory budget of the write-back buffers, in KiB (0 makes writes synchronous) */
+    unsigned int writeback_delay;	/**< Seconds written data may stay in a write-back buffer */
+    unsigned int bcache_size;	/**< Memory budget of the data block cache, in KiB (0 disables it, and read-ahead) */
+    unsigned int readahead;	/**< Largest read-ahead window, in KiB (0 disables read-ahead) */
+    char *compress;		/**< Codec of the data blocks written: none, lz4 or zstd */
+    unsigned int dedup;		/**< Whether the payloads of the data blocks written are deduplicated */
+    unsigned int inline_max;	/**< Largest file kept in its inodes row, in bytes (0 disables it) */
 	int debug;
 };
 
@@ -36,8 +62,55 @@ int pool_init(struct mysqlfs_opt *opt);
 /** Close all connections and cleanup pool */
 void pool_cleanup();
 
+/** Start the maintenance thread (to be called once FUSE is running) */
+int pool_start();
+
+/** Stop the maintenance thread */
+void pool_stop();
+
 /** Get DB connection from pool */
 void *pool_get();
 
 /** Put DB connection back to the pool */
 void pool_put(void *conn);
+
+/** Keep the calling thread from binding a connection with thread_conns: for threads living until unmount */
+void pool_thread_unbound();
+
+/** Most replicas taken from the replicas option */
+#define POOL_MAX_REPLICAS	16
+
+/** Seconds an unreachable replica is left alone */
+#define POOL_REPLICA_RETRY	5
+
+/**
+ * Get DB connection for reading, from a replica if there are any.  Reads
+ * of inode go to the primary for replica_lag seconds after it changed; an
+ * inode of 0 stands for any inode (for lookups by path), and a negative one
+ * for none.
+ */
+void *pool_get_read(long inode);
+
+/** Whether conn, from pool_get_read(), is connected to a replica: what it reads may be stale */
+int pool_is_replica(void *conn);
+
+/** Record a change of inode (0 if unknown), see pool_get_read() */
+void pool_written(long inode);
+
+/** Most shards taken from the shards option */
+#define POOL_MAX_SHARDS		64
+
+/** Number of data shards, 0 if the data blocks are kept with the metadata */
+unsigned int pool_shards();
+
+/** Shard holding the data blocks of inode */
+unsigned int pool_shard_of(long inode);
+
+/** Get DB connection to a data shard */
+void *pool_get_shard(unsigned int shard);
+
+/** Number of prepared statements cached by each connection */
+#define POOL_STMTS	16
+
+/** Get prepared statement id of a pooled connection, preparing sql on first use */
+MYSQL_STMT *pool_stmt(MYSQL *mysql, unsigned int id, const char *sql);
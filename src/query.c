@@ -22,17 +22,40 @@
 #include <fuse/fuse.h>
 
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
 #include <sys/xattr.h>
 
 #include "mysqlfs.h"
 #include "query.h"
+#include "pool.h"
+#include "dcache.h"
+#include "icache.h"
+#include "bcache.h"
+#include "compress.h"
+#include "sha256.h"
 #include "log.h"
 
 #define SQL_MAX 10240
+
+/** Bytes of data sent by one query_write_blocks() statement */
+#define WRITE_BATCH_BYTES	(1024 * 1024)
+/** Rows of one query_write_blocks() statement */
+#define WRITE_BATCH_BLOCKS	(WRITE_BATCH_BYTES / data_block_size > 0 ? WRITE_BATCH_BYTES / data_block_size : 1)
+/** WRITE_BATCH_BLOCKS with the smallest block size, to size arrays */
+#define WRITE_BATCH_MAX		(WRITE_BATCH_BYTES / DATA_BLOCK_SIZE_MIN)
+
 #define INODE_CACHE_MAX 4096
 
 struct table_names *tables;
 
+unsigned long data_block_size = DATA_BLOCK_SIZE;
+
+/** Store the payloads of data blocks once, in the data_blobs table */
+static int dedup = 0;
+
+/** Largest file kept in its inodes row, see query_inline_init() */
+static unsigned int inline_max = 0;
+
 static inline int lock_inode(MYSQL *mysql, long inode)
 {
     // TODO
@@ -45,100 +68,310 @@ static inline int unlock_inode(MYSQL *mysql, long inode)
     return 0;
 }
 
+/**
+ * Connection to the server holding the data blocks of an inode: mysql
+ * itself, unless the data blocks are spread over shards.  To be given back
+ * with data_conn_put().
+ */
+static MYSQL *data_conn(MYSQL *mysql, long inode)
+{
+    if (!pool_shards())
+	return mysql;
+
+    return pool_get_shard(pool_shard_of(inode));
+}
+
+static inline void data_conn_put(MYSQL *mysql, MYSQL *data)
+{
+    if (data && data != mysql)
+	pool_put(data);
+}
+
 static struct data_blocks_info *
 fill_data_blocks_info(struct data_blocks_info *info, size_t size, off_t offset)
 {
-    info->seq_first = offset / DATA_BLOCK_SIZE;
-    info->offset_first = offset % DATA_BLOCK_SIZE;
+    info->seq_first = offset / data_block_size;
+    info->offset_first = offset % data_block_size;
 
-    unsigned long  nr_following_blocks = ((info->offset_first + size) / DATA_BLOCK_SIZE);	
-    info->length_first = nr_following_blocks > 0 ? DATA_BLOCK_SIZE - info->offset_first : size;
+    unsigned long  nr_following_blocks = ((info->offset_first + size) / data_block_size);	
+    info->length_first = nr_following_blocks > 0 ? data_block_size - info->offset_first : size;
 
     info->seq_last = info->seq_first + nr_following_blocks;
-    info->length_last = (info->offset_first + size) % DATA_BLOCK_SIZE;
+    info->length_last = (info->offset_first + size) % data_block_size;
     /* offset in last block (if it's a different one from the first block) 
      * is always 0 */
 
     return info;
 }
 
+/** Columns of the inodes table read by query_getattr(), in the order fill_stat() expects them */
+#define STAT_COLUMNS	"%s.mode, %s.uid, %s.gid, %s.atime, %s.mtime, %s.ctime, %s.size"
+/** Expand the table alias of every STAT_COLUMNS column */
+#define STAT_COLUMNS_ARGS(t)	t, t, t, t, t, t, t
+
 /**
- * Get the attributes of an inode, filling in a struct stat.  This function
- * uses query_inode_full() to get the inode and nlinks of the given path, then
- * reads the inode data from the database, storing this data into the provided
- * structure.
+ * Fill a struct stat from a row holding the STAT_COLUMNS columns.
  *
- * @return 0 if successful
- * @return -EIO if the result of mysql_query() is non-zero
- * @return -ENOENT if the inode at the give path is not found (actually, if the number of results is not exactly 1)
- * @param mysql handle to connection to the database
- * @param path pathname to check
- * @param stbuf struct stat to fill with the inode contents
+ * @param stbuf struct stat to fill
+ * @param row first STAT_COLUMNS column of the row
+ * @param inode inode number the row belongs to
+ * @param nlinks number of links to the inode
  */
-int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf)
+static void fill_stat_values(struct stat *stbuf, const long long *col, long inode, long nlinks)
 {
-    int ret;
-    long inode, nlinks;
-    char sql[SQL_MAX];
-    MYSQL_RES* result;
-    MYSQL_ROW row;
-    ret = query_inode_full(mysql, path, NULL, 0, &inode, NULL, &nlinks);
-    if (ret < 0)
-      return ret;
+    stbuf->st_ino = inode;
+    stbuf->st_mode = col[0];
+    stbuf->st_uid = col[1];
+    stbuf->st_gid = col[2];
+    stbuf->st_atime = col[3];
+    stbuf->st_mtime = col[4];
+    stbuf->st_ctime = col[5];
+    stbuf->st_size = col[6];
+    stbuf->st_nlink = nlinks;
+    stbuf->st_blksize = data_block_size;
+    stbuf->st_blocks = (stbuf->st_size + 511) / 512;
+}
 
-    snprintf(sql, SQL_MAX,
-             "SELECT inode, mode, uid, gid, atime, mtime "
-             "FROM %s WHERE inode=%ld",
-             tables->inodes, inode);
+/** Same as fill_stat_values(), from a text protocol row */
+static void fill_stat(struct stat *stbuf, MYSQL_ROW row, long inode, long nlinks)
+{
+    long long col[7];
+    int i;
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    for (i = 0; i < 7; i++)
+	col[i] = row[i] ? atoll(row[i]) : 0;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "ERROR: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    fill_stat_values(stbuf, col, inode, nlinks);
+}
+
+/**
+ * Statements of the hot paths, prepared once per connection and cached by
+ * pool_stmt().  Parameters and results travel in binary form, so these
+ * paths neither escape strings nor parse numbers out of them.
+ */
+enum query_stmt {
+    STMT_LOOKUP,	/**< a directory entry, with the attributes of its inode */
+    STMT_GETATTR,	/**< attributes and link count of an inode */
+    STMT_NLINKS,	/**< link count of an inode */
+    STMT_READDIR,	/**< names in a directory */
+    STMT_READ_BLOCKS,	/**< a range of data blocks */
+    STMT_BLOCK_LENGTH,	/**< length of a data block */
+    STMT_BLOCK_CREATE,	/**< an empty data block */
+    STMT_BLOCK_UPDATE,	/**< part of a data block */
+    STMT_WRITE_BLOCK,	/**< a whole data block */
+    STMT_WRITE_BATCH,	/**< WRITE_BATCH_BLOCKS whole data blocks */
+    STMT_EXTEND_SIZE,	/**< growth of an inode */
+    STMT_BLOB_REF,	/**< new reference to a deduplicated payload */
+    STMT_BLOB_STORE,	/**< a new deduplicated payload */
+    STMT_READ_HEAD,	/**< the first data blocks, with the inline data */
+    STMT_INLINE_WRITE,	/**< part of the inline data */
+};
+
+static inline void bind_longlong(MYSQL_BIND *bind, long long *value, my_bool *is_null)
+{
+    memset(bind, 0, sizeof(MYSQL_BIND));
+    bind->buffer_type = MYSQL_TYPE_LONGLONG;
+    bind->buffer = value;
+    bind->is_null = is_null;
+}
+
+static inline void bind_buffer(MYSQL_BIND *bind, enum enum_field_types type, const void *buffer,
+			       unsigned long buffer_length, unsigned long *length)
+{
+    memset(bind, 0, sizeof(MYSQL_BIND));
+    bind->buffer_type = type;
+    bind->buffer = (void *)buffer;
+    bind->buffer_length = buffer_length;
+    bind->length = length;
+}
+
+/**
+ * Execute a cached prepared statement.  Prepared statements don't survive
+ * an automatic reconnect, so when the server has gone away the connection
+ * is pinged back to life and the statement prepared and executed again,
+ * once.
+ *
+ * @return the statement, with its result set stored if results is given
+ * @return NULL on error
+ * @param mysql handle to connection to the database
+ * @param id statement to run
+ * @param sql text of the statement, used the first time only
+ * @param params parameters of the statement
+ * @param results where the columns of each fetched row go, or NULL
+ */
+static MYSQL_STMT *stmt_execute(MYSQL *mysql, enum query_stmt id, const char *sql,
+				MYSQL_BIND *params, MYSQL_BIND *results)
+{
+    MYSQL_STMT *stmt;
+    unsigned int err;
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+	stmt = pool_stmt(mysql, id, sql);
+	if (stmt && !mysql_stmt_bind_param(stmt, params) && !mysql_stmt_execute(stmt) &&
+	    (!results || (!mysql_stmt_bind_result(stmt, results) &&
+			  !mysql_stmt_store_result(stmt))))
+	    return stmt;
+
+	err = stmt ? mysql_stmt_errno(stmt) : mysql_errno(mysql);
+	log_printf(LOG_ERROR, "%s(%d): %u %s\n", __func__, id, err,
+		   stmt ? mysql_stmt_error(stmt) : mysql_error(mysql));
+	if (err != CR_SERVER_GONE_ERROR && err != CR_SERVER_LOST)
+	    break;
+	mysql_ping(mysql);
     }
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    return NULL;
+}
+
+/** Fetch the next row of a stored result: 1 if there is one, 0 at the end */
+static inline int stmt_fetch(MYSQL_STMT *stmt)
+{
+    int ret = mysql_stmt_fetch(stmt);
+
+    return ret == 0 || ret == MYSQL_DATA_TRUNCATED;
+}
+
+/**
+ * Read the attributes and link count of an inode.
+ *
+ * @return 0 on success, -ENOENT if there is no such inode, -EIO on error
+ */
+static int stmt_getattr(MYSQL *mysql, long inode, struct stat *stbuf)
+{
+    char sql[SQL_MAX];
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[1], results[8];
+    long long id = inode, col[8];
+    my_bool is_null[8];
+    int i, ret = -ENOENT;
+
+    snprintf(sql, SQL_MAX, "SELECT mode, uid, gid, atime, mtime, ctime, size, nlink "
+	     "FROM %s WHERE inode=?", tables->inodes);
+    bind_longlong(&params[0], &id, NULL);
+    for (i = 0; i < 8; i++)
+	bind_longlong(&results[i], &col[i], &is_null[i]);
+
+    stmt = stmt_execute(mysql, STMT_GETATTR, sql, params, results);
+    if (!stmt)
+	return -EIO;
+
+    if (stmt_fetch(stmt)) {
+	fill_stat_values(stbuf, col, inode, col[7]);
+	ret = 0;
     }
+    mysql_stmt_free_result(stmt);
 
-    if(mysql_num_rows(result) != 1){
-        mysql_free_result(result);
-        return -ENOENT;
+    return ret;
+}
+
+/**
+ * Link count of an inode, i.e. the number of its directory entries.
+ *
+ * @return number of links, -EIO on error
+ */
+static long stmt_nlinks(MYSQL *mysql, long inode)
+{
+    char sql[SQL_MAX];
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[1], results[1];
+    long long id = inode, links = 0;
+
+    snprintf(sql, SQL_MAX, "SELECT nlink FROM %s WHERE inode=?", tables->inodes);
+    bind_longlong(&params[0], &id, NULL);
+    bind_longlong(&results[0], &links, NULL);
+
+    stmt = stmt_execute(mysql, STMT_NLINKS, sql, params, results);
+    if (!stmt)
+	return -EIO;
+
+    stmt_fetch(stmt);
+    mysql_stmt_free_result(stmt);
+
+    return links;
+}
+
+/**
+ * Look up one name in a directory, with the link count and attributes of
+ * the inode it leads to, and cache the result in the dentry cache unless
+ * cache is 0.  Part of query_path_walk(), whose output parameters it fills.
+ *
+ * @return 0 on success, -ENOENT if there is no such entry, -EIO on error
+ */
+static int stmt_lookup(MYSQL *mysql, long dir, const char *entry, unsigned long gen,
+		       int cache, long *inode, char *name, size_t name_len, long *nlinks,
+		       struct stat *stbuf)
+{
+    char sql[SQL_MAX], found[PATH_MAX];
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[2], results[10];
+    long long parent = dir, id, links, col[7];
+    my_bool is_null[7];
+    unsigned long entry_len = strlen(entry), found_len;
+    int i, ret = 0;
+
+    snprintf(sql, SQL_MAX, "SELECT t.inode, t.name, IFNULL(i.nlink, 0), " STAT_COLUMNS
+	     " FROM %s AS t LEFT JOIN %s AS i ON i.inode = t.inode"
+	     " WHERE t.parent=? AND t.name=?",
+	     STAT_COLUMNS_ARGS("i"), tables->tree, tables->inodes);
+    bind_longlong(&params[0], &parent, NULL);
+    bind_buffer(&params[1], MYSQL_TYPE_STRING, entry, entry_len, &entry_len);
+    bind_longlong(&results[0], &id, NULL);
+    bind_buffer(&results[1], MYSQL_TYPE_STRING, found, sizeof(found), &found_len);
+    bind_longlong(&results[2], &links, NULL);
+    for (i = 0; i < 7; i++)
+	bind_longlong(&results[3 + i], &col[i], &is_null[i]);
+
+    stmt = stmt_execute(mysql, STMT_LOOKUP, sql, params, results);
+    if (!stmt)
+	return -EIO;
+
+    if (!stmt_fetch(stmt)) {
+	mysql_stmt_free_result(stmt);
+	if (cache)
+	    dcache_insert_negative(dir, entry, gen);
+	return -ENOENT;
     }
-    row = mysql_fetch_row(result);
-    if(!row){
-        return -EIO;
+    mysql_stmt_free_result(stmt);
+    found[MIN(found_len, sizeof(found) - 1)] = '\0';
+
+    if (cache)
+	dcache_insert(dir, found, id, gen);
+
+    if (stbuf != NULL) {
+	if (is_null[0])
+	    /* Direntry without inode, fsck will clean it up */
+	    return -ENOENT;
+	fill_stat_values(stbuf, col, id, links);
     }
 
-    stbuf->st_ino = inode;
-    stbuf->st_mode = atoi(row[1]);
-    stbuf->st_uid = atol(row[2]);
-    stbuf->st_gid = atol(row[3]);
-    stbuf->st_atime = atol(row[4]);
-    stbuf->st_mtime = atol(row[5]);
-    stbuf->st_nlink = nlinks;
-    stbuf->st_blksize = DATA_BLOCK_SIZE;
+    log_printf(LOG_D_OTHER, "%s(%ld, '%s') => %lld\n", __func__, dir, entry, id);
 
-    mysql_free_result(result);
+    if (inode)
+	*inode = id;
+    if (name)
+	snprintf(name, name_len, "%s", found);
+    if (nlinks)
+	*nlinks = links;
 
-    return 0;
+    return ret;
 }
 
 /**
- * Walk the directory tree to find the inode at the given absolute path,
- * storing name, inode, parent inode, and number of links.  Last developer of
- * this function indicates that the pathname may overflow -- sounds like a
- * good testcase :)
+ * Walk the directory tree to find the inode at the given absolute path.
+ * This is the worker behind query_inode_full() and query_getattr().
  *
- * If any of the name, inode, parent, or nlinks are given, those values will be
- * recorded form the inode data to the given buffers.  The name is written to
- * the given name_len.
+ * The path is first walked through the dentry cache.  Only the components
+ * past the longest cached prefix are resolved in the database, with a chain
+ * of LEFT JOINs starting from the last cached directory; every component the
+ * query does find is added to the cache, even when a later one is missing.
+ * If stbuf or nlinks is given the inodes row is joined in as well, so the
+ * attributes and the link count (inodes.nlink) come back with the same
+ * round trip.
+ *
+ * Nothing read from a replica is cached: only local changes invalidate
+ * the caches, so what a lagging replica returns would stay there long
+ * after it caught up.
  *
  * @return 0 if successful
  * @return -EIO if the result of mysql_query() is non-zero
@@ -150,60 +383,138 @@ int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf)
  * @param inode where to write the inode value, if found (may be NULL)
  * @param parent where to write the parent's inode value, if found (may be NULL)
  * @param nlinks where to write the number of links to the inode, if found (may be NULL)
+ * @param stbuf struct stat to fill with the inode contents (may be NULL)
  */
-int query_inode_full(MYSQL *mysql, const char *path, char *name, size_t name_len,
-		      long *inode, long *parent, long *nlinks)
+static int query_path_walk(MYSQL *mysql, const char *path, char *name, size_t name_len,
+			   long *inode, long *parent, long *nlinks, struct stat *stbuf)
 {
     long ret;
     char sql[SQL_MAX];
     MYSQL_RES* result;
     MYSQL_ROW row;
 
-    int depth = 0;
-    char *pathptr = strdup(path), *pathptr_saved = pathptr;
-    char *nameptr, *saveptr = NULL;
-    char sql_from[SQL_MAX], sql_where[SQL_MAX];
-    char *sql_from_end = sql_from, *sql_where_end = sql_where;
+    int depth = 0, known, i, sql_end;
+    int want_nlinks = (nlinks != NULL || stbuf != NULL);
+    char *pathptr = strdup(path), *nameptr, *saveptr = NULL;
+    char *names[PATH_MAX / 2 + 1];
+    long inodes[PATH_MAX / 2 + 1];
+    unsigned long gens[PATH_MAX / 2 + 1];
+    char sql_from[SQL_MAX], sql_select[SQL_MAX];
+    char *sql_from_end = sql_from, *sql_select_end = sql_select;
     char esc_name[PATH_MAX * 2];
-
-    // TODO: Handle too long or too nested paths that don't fit in SQL_MAX!!!
-    sql_from_end += snprintf(sql_from_end, SQL_MAX, "%s AS t0", tables->tree);
-    sql_where_end += snprintf(sql_where_end, SQL_MAX, "t0.parent IS NULL");
-    while ((nameptr = strtok_r(pathptr, "/", &saveptr)) != NULL) {
-        if (depth++ == 0) {
-	  pathptr = NULL;
+    long links;
+    unsigned long igen = 0;
+    int cache = !pool_is_replica(mysql);
+
+    /* names[0] is the root directory, names[1..depth] the path components. */
+    names[0] = "/";
+    for (nameptr = strtok_r(pathptr, "/", &saveptr); nameptr != NULL;
+	 nameptr = strtok_r(NULL, "/", &saveptr)) {
+	if (depth == PATH_MAX / 2) {
+	    free(pathptr);
+	    return -ENAMETOOLONG;
 	}
+	names[++depth] = nameptr;
+    }
 
-    mysql_real_escape_string(mysql, esc_name, nameptr, strlen(nameptr));
-	sql_from_end += snprintf(sql_from_end, SQL_MAX, " JOIN %s AS t%d ON t%d.inode = t%d.parent",
-		 tables->tree, depth, depth-1, depth);
-	sql_where_end += snprintf(sql_where_end, SQL_MAX, " AND t%d.name = '%s'",
-		 depth, esc_name);
+    /* Walk down the dentry cache as far as it goes. */
+    for (known = 0; known <= depth; known++) {
+	ret = dcache_lookup(known ? inodes[known - 1] : DCACHE_ROOT_PARENT,
+			    names[known], &inodes[known]);
+	if (ret < 0) {
+	    free(pathptr);
+	    return ret;
+	}
+	if (ret == 0)
+	    break;
+    }
+
+    if (known > depth) {
+	/* Every component is cached. */
+	links = 1;
+	if (stbuf != NULL && icache_get(inodes[depth], stbuf)) {
+	    links = stbuf->st_nlink;
+	} else if (stbuf != NULL) {
+	    igen = icache_generation(inodes[depth]);
+	    ret = stmt_getattr(mysql, inodes[depth], stbuf);
+	    if (ret < 0) {
+		free(pathptr);
+		return ret;
+	    }
+	    links = stbuf->st_nlink;
+	    if (cache)
+		icache_put(inodes[depth], stbuf, igen);
+	} else if (nlinks != NULL) {
+	    links = stmt_nlinks(mysql, inodes[depth]);
+	    if (links < 0) {
+		free(pathptr);
+		return links;
+	    }
+	}
+	if (inode)
+	    *inode = inodes[depth];
+	if (name)
+	    snprintf(name, name_len, "%s", names[depth]);
+	if (parent)
+	    *parent = depth ? inodes[depth - 1] : -1;
+	if (nlinks)
+	    *nlinks = links;
+	free(pathptr);
+	return 0;
+    }
+
+    for (i = known; i <= depth; i++)
+        gens[i] = dcache_generation(names[i]);
+
+    if (known == depth && known > 0) {
+	/* Only the last component is missing: that's a plain directory lookup. */
+	ret = stmt_lookup(mysql, inodes[known - 1], names[known], gens[known], cache,
+			  inode, name, name_len, nlinks, stbuf);
+	if (ret == 0 && parent)
+	    *parent = inodes[known - 1];
+	free(pathptr);
+	return ret;
     }
-    free(pathptr_saved);
 
-    // TODO: Only run subquery when pointer to nlinks != NULL, otherwise we don't need it.
-    if (nlinks != NULL) {
-        snprintf(sql, SQL_MAX, "SELECT t%d.inode, t%d.name, t%d.parent, "
-                        "       (SELECT COUNT(inode) FROM %s AS t%d WHERE t%d.inode=t%d.inode) "
-                        "               AS nlinks "
-                        "FROM %s WHERE %s",
-                    depth, depth, depth, 
-                    tables->tree, depth+1, depth+1, depth,
-                    sql_from, sql_where);
+    // TODO: Handle too long or too nested paths that don't fit in SQL_MAX!!!
+    sql_from_end += snprintf(sql_from_end, SQL_MAX, "%s AS t%d", tables->tree, known);
+    for (i = known + 1; i <= depth; i++) {
+        mysql_real_escape_string(mysql, esc_name, names[i], strlen(names[i]));
+	sql_from_end += snprintf(sql_from_end, SQL_MAX - (sql_from_end - sql_from),
+		 " LEFT JOIN %s AS t%d ON t%d.parent = t%d.inode AND t%d.name = '%s'",
+		 tables->tree, i, i, i-1, i, esc_name);
+    }
+    for (i = known; i <= depth; i++)
+	sql_select_end += snprintf(sql_select_end, SQL_MAX - (sql_select_end - sql_select),
+		 ", t%d.inode, t%d.name", i, i);
+    if (want_nlinks)
+	sql_from_end += snprintf(sql_from_end, SQL_MAX - (sql_from_end - sql_from),
+		 " LEFT JOIN %s AS i ON i.inode = t%d.inode", tables->inodes, depth);
+    if (stbuf != NULL)
+	sql_select_end += snprintf(sql_select_end, SQL_MAX - (sql_select_end - sql_select),
+		 ", " STAT_COLUMNS, STAT_COLUMNS_ARGS("i"));
+
+    if (want_nlinks) {
+        sql_end = snprintf(sql, SQL_MAX, "SELECT t%d.parent, IFNULL(i.nlink, 0) AS nlinks"
+                        "%s FROM %s WHERE ",
+                    depth, sql_select, sql_from);
+    } else {
+        sql_end = snprintf(sql, SQL_MAX, "SELECT t%d.parent, 1 AS nlinks%s FROM %s WHERE ",
+		    depth, sql_select, sql_from);
     }
-    else
-    {
-        snprintf(sql, SQL_MAX, "SELECT t%d.inode, t%d.name, t%d.parent, 1 AS nlinks "
-        	     		   "FROM %s WHERE %s",
-        	     depth, depth, depth, 
-        	     sql_from, sql_where);
+    if (known == 0) {
+        snprintf(sql + sql_end, SQL_MAX - sql_end, "t0.parent IS NULL");
+    } else {
+        mysql_real_escape_string(mysql, esc_name, names[known], strlen(names[known]));
+        snprintf(sql + sql_end, SQL_MAX - sql_end, "t%d.parent = %ld AND t%d.name = '%s'",
+		 known, inodes[known - 1], known, esc_name);
     }
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
     ret = mysql_query(mysql, sql);
     if(ret){
         log_printf(LOG_ERROR, "ERROR: mysql_query()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	free(pathptr);
         return -EIO;
     }
 
@@ -211,36 +522,123 @@ int query_inode_full(MYSQL *mysql, const char *path, char *name, size_t name_len
     if(!result){
         log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	free(pathptr);
         return -EIO;
     }
 
     if(mysql_num_rows(result) != 1){
         mysql_free_result(result);
+	if (known > 0 && cache)
+	    dcache_insert_negative(inodes[known - 1], names[known], gens[known]);
+	free(pathptr);
         return -ENOENT;
     }
 
     row = mysql_fetch_row(result);
     if(!row){
         log_printf(LOG_ERROR, "ERROR: mysql_fetch_row()\n");
+	free(pathptr);
         return -EIO;
     }
-    log_printf(LOG_D_OTHER, "query_inode(path='%s') => %s, %s, %s, %s\n",
-	       path, row[0], row[1], row[2], row[3]);
-    
+
+    /* Cache every component found, stopping at the first missing one,
+     * which is cached as a negative entry. */
+    for (i = known; i <= depth; i++) {
+	char **col = &row[2 + 2 * (i - known)];
+	if (!col[0])
+	    break;
+	inodes[i] = atol(col[0]);
+	if (!cache)
+	    continue;
+	if (i)
+	    dcache_insert(inodes[i - 1], col[1], inodes[i], gens[i]);
+	else
+	    dcache_insert(DCACHE_ROOT_PARENT, names[0], inodes[0], gens[0]);
+    }
+    if (i <= depth) {
+	if (i > 0 && cache)
+	    dcache_insert_negative(inodes[i - 1], names[i], gens[i]);
+        mysql_free_result(result);
+	free(pathptr);
+        return -ENOENT;
+    }
+
+    log_printf(LOG_D_OTHER, "query_inode(path='%s') => %ld, %s, %s, %s\n",
+	       path, inodes[depth], row[2 + 2 * (depth - known) + 1], row[0], row[1]);
+
+    if (stbuf != NULL) {
+	MYSQL_ROW stat_row = &row[2 + 2 * (depth - known + 1)];
+	if (!stat_row[0]) {
+	    /* Direntry without inode, fsck will clean it up */
+	    mysql_free_result(result);
+	    free(pathptr);
+	    return -ENOENT;
+	}
+	fill_stat(stbuf, stat_row, inodes[depth], atol(row[1]));
+    }
+
     if (inode)
-        *inode = atol(row[0]);
+        *inode = inodes[depth];
     if (name)
-        snprintf(name, name_len, "%s", row[1]);
+        snprintf(name, name_len, "%s", row[2 + 2 * (depth - known) + 1]);
     if (parent)
-        *parent = row[2] ? atol(row[2]) : -1;	/* parent may be NULL */
+        *parent = row[0] ? atol(row[0]) : -1;	/* parent may be NULL */
     if (nlinks)
-        *nlinks = atol(row[3]);
+        *nlinks = atol(row[1]);
 
     mysql_free_result(result);
+    free(pathptr);
 
     return 0;
 }
 
+/**
+ * Get the attributes of an inode, filling in a struct stat.  The path walk,
+ * the inode row, the file size and the number of links all come back from
+ * a single query (just the inode row when the path is in the dentry cache,
+ * and none at all when the inode cache still holds the attributes).
+ *
+ * @return 0 if successful
+ * @return -EIO if the result of mysql_query() is non-zero
+ * @return -ENOENT if the inode at the give path is not found (actually, if the number of results is not exactly 1)
+ * @param mysql handle to connection to the database
+ * @param path pathname to check
+ * @param stbuf struct stat to fill with the inode contents
+ */
+int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf)
+{
+    return query_path_walk(mysql, path, NULL, 0, NULL, NULL, NULL, stbuf);
+}
+
+/**
+ * Walk the directory tree to find the inode at the given absolute path,
+ * storing name, inode, parent inode, and number of links.  Last developer of
+ * this function indicates that the pathname may overflow -- sounds like a
+ * good testcase :)
+ *
+ * If any of the name, inode, parent, or nlinks are given, those values will be
+ * recorded form the inode data to the given buffers.  The name is written to
+ * the given name_len.
+ *
+ * Lookups go through the dentry cache, see query_path_walk().
+ *
+ * @return 0 if successful
+ * @return -EIO if the result of mysql_query() is non-zero
+ * @return -ENOENT if the file at this path is not found
+ * @param mysql handle to connection to the database
+ * @param path (absolute) pathname of inode to find
+ * @param name destination to record (relative) name of the inode (may be NULL)
+ * @param name_len length of destination buffer "name"
+ * @param inode where to write the inode value, if found (may be NULL)
+ * @param parent where to write the parent's inode value, if found (may be NULL)
+ * @param nlinks where to write the number of links to the inode, if found (may be NULL)
+ */
+int query_inode_full(MYSQL *mysql, const char *path, char *name, size_t name_len,
+		      long *inode, long *parent, long *nlinks)
+{
+    return query_path_walk(mysql, path, name, name_len, inode, parent, nlinks, NULL);
+}
+
 /**
  * Get the inode of a pathname.  This is really a convenience function wrapping
  * the query_inode_full() function, but can instead be used as a function with
@@ -263,6 +661,106 @@ long query_inode(MYSQL *mysql, const char *path)
 
 
 
+static int rewrite_block(MYSQL *mysql, long inode, unsigned long seq,
+			 const char *buf, size_t size, off_t offset);
+
+/**
+ * Write into the inline data of an inode, see query_inline_init().  The
+ * write must end within inline_max.
+ *
+ * @return 1 if the inode has inline data, now holding the write
+ * @return 0 if it has none
+ * @return -EIO on error
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param data the buffer of data to write
+ * @param size number of bytes to write
+ * @param offset offset within the file to write to
+ */
+static int inline_write(MYSQL *mysql, long inode, const char *data, size_t size,
+			off_t offset)
+{
+    MYSQL_BIND params[4];
+    MYSQL_STMT *stmt;
+    MYSQL_RES *result;
+    char sql[SQL_MAX];
+    long long id = inode, pad = offset, tail = offset + size + 1;
+    unsigned long length = size;
+    int found;
+
+    /* The same splice as write_one_block() */
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s SET inline_data=CONCAT(RPAD(inline_data, ?, '\\0'), ?, "
+	     "SUBSTRING(inline_data FROM ?)) WHERE inode=? AND inline_data IS NOT NULL",
+	     tables->inodes);
+    bind_longlong(&params[0], &pad, NULL);
+    bind_buffer(&params[1], MYSQL_TYPE_LONG_BLOB, data, size, &length);
+    bind_longlong(&params[2], &tail, NULL);
+    bind_longlong(&params[3], &id, NULL);
+
+    stmt = stmt_execute(mysql, STMT_INLINE_WRITE, sql, params, NULL);
+    if (!stmt)
+	return -EIO;
+    if (mysql_stmt_affected_rows(stmt) > 0)
+	return 1;
+
+    /* Nothing changed: either no inline data, or the same bytes again */
+    snprintf(sql, SQL_MAX,
+	     "SELECT 1 FROM %s WHERE inode=%ld AND inline_data IS NOT NULL",
+	     tables->inodes, inode);
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql) || !(result = mysql_store_result(mysql))) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	return -EIO;
+    }
+    found = mysql_num_rows(result) > 0;
+    mysql_free_result(result);
+
+    return found;
+}
+
+/**
+ * Take the inline data of an inode, if it has any, out of its inodes row:
+ * an inode has either inline data or a data block 0, never both.  To be
+ * called before block 0 is written to data_blocks.
+ *
+ * @return 0 on success, -EIO on error
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param keep non-zero to move the inline data to block 0, zero when
+ *        block 0 is about to be overwritten whole
+ */
+static int inline_evict(MYSQL *mysql, long inode, int keep)
+{
+    char sql[SQL_MAX];
+
+    if (keep) {
+	snprintf(sql, SQL_MAX,
+		 "INSERT INTO %s (inode, seq, data, datalength) "
+		 "SELECT inode, 0, inline_data, OCTET_LENGTH(inline_data) FROM %s "
+		 "WHERE inode=%ld AND inline_data IS NOT NULL",
+		 tables->data_blocks, tables->inodes, inode);
+	log_printf(LOG_D_SQL, "sql=%s\n", sql);
+	if (mysql_query(mysql, sql))
+	    goto err_out;
+	if (!mysql_affected_rows(mysql))
+	    return 0;
+    }
+
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s SET inline_data=NULL WHERE inode=%ld AND inline_data IS NOT NULL",
+	     tables->inodes, inode);
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql))
+	goto err_out;
+
+    return 0;
+
+err_out:
+    log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    return -EIO;
+}
+
 /**
  * Change the length of a file, truncating any additional data blocks and
  * immediately deleting the data blocks past the truncation length.  Function
@@ -272,7 +770,7 @@ long query_inode(MYSQL *mysql, const char *path)
  *
  * @see http://linux.die.net/man/2/truncate
  *
- * @return 0 on success; non-zero return of mysql_query() on error
+ * @return 0 on success, -EIO on database error, rolled back
  * @param mysql handle to connection to the database
  * @param path pathname of file to truncate
  * @param length new length of file
@@ -280,8 +778,11 @@ long query_inode(MYSQL *mysql, const char *path)
 int query_truncate(MYSQL *mysql, const char *path, off_t length)
 {
     int ret;
-    char sql[SQL_MAX];
+    char sql[SQL_MAX], inline_set[64] = "";
     struct data_blocks_info info;
+    MYSQL *data;
+    /* An emptied file goes back to its inodes row, see query_inline_init(). */
+    int inline_reset = !length && inline_max;
 
     fill_data_blocks_info(&info, length, 0);
 
@@ -289,50 +790,80 @@ int query_truncate(MYSQL *mysql, const char *path, off_t length)
     if (inode < 0)
       return inode;
 
+    if (!(data = data_conn(mysql, inode)))
+      return -EMFILE;
+
     lock_inode(mysql, inode);
 
-    /* Start a transaction */
-    ret = mysql_query(mysql, "BEGIN");
+    /* Start a transaction, on the shard too */
+    if ((ret = mysql_query(mysql, "BEGIN"))) goto err_out;
+    if (data != mysql && (ret = mysql_query(data, "BEGIN"))) goto err_out;
 
     snprintf(sql, SQL_MAX,
-             "DELETE FROM %s WHERE inode=%ld AND seq > %ld",
-	     tables->data_blocks, inode, info.seq_last);
+             "DELETE FROM %s WHERE inode=%ld AND seq >= %lu",
+	     tables->data_blocks, inode, inline_reset ? 0 : info.seq_last + 1);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if ((ret = mysql_query(mysql, sql))) goto err_out;
+    if ((ret = mysql_query(data, sql))) goto err_out;
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE %s SET data=RPAD(data, %zu, '\\0') "
-	     "WHERE inode=%ld AND seq=%ld",
-             tables->data_blocks, info.length_last, inode, info.seq_last);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if ((ret = mysql_query(mysql, sql))) goto err_out;
+    if (!inline_reset) {
+	snprintf(sql, SQL_MAX,
+		 "UPDATE %s SET data=RPAD(data, %zu, '\\0'), datalength=OCTET_LENGTH(data) "
+		 "WHERE inode=%ld AND seq=%ld AND codec=0 AND hash IS NULL",
+		 tables->data_blocks, info.length_last, inode, info.seq_last);
+	log_printf(LOG_D_SQL, "sql=%s\n", sql);
+	if ((ret = mysql_query(data, sql))) goto err_out;
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE %s SET datalength=OCTET_LENGTH(data) "
-	     "WHERE inode=%ld AND seq=%ld",
-             tables->data_blocks, inode, info.seq_last);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if ((ret = mysql_query(mysql, sql))) goto err_out;
+	/* No change: no such block, already that long, compressed or deduplicated. */
+	if (!mysql_affected_rows(data) &&
+	    (ret = rewrite_block(data, inode, info.seq_last, NULL, 0, info.length_last)) < 0)
+	    goto err_out;
+    }
+
+    /* Inline data is block 0 */
+    if (inline_reset)
+	strcpy(inline_set, ", inline_data=''");
+    else if (info.seq_last == 0)
+	snprintf(inline_set, sizeof(inline_set),
+		 ", inline_data=RPAD(inline_data, %zu, '\\0')", info.length_last);
 
     snprintf(sql, SQL_MAX,
-             "UPDATE %s SET size=%ld WHERE inode=%ld",
-             tables->inodes, length, inode);
+             "UPDATE %s SET size=%ld%s WHERE inode=%ld",
+             tables->inodes, length, inline_set, inode);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
     if ((ret = mysql_query(mysql, sql))) goto err_out;
 
-    /* Close the transaction */
-    ret = mysql_query(mysql, "COMMIT");
+    /* Close the transaction: data first, so the size never covers missing data */
+    if (data != mysql && mysql_query(data, "COMMIT")) {
+	ret = -EIO;
+	goto err_out;
+    }
+    if (mysql_query(mysql, "COMMIT")) {
+	ret = -EIO;
+	goto err_out;
+    }
 
+    icache_invalidate(inode);
+    bcache_invalidate(inode);
+    pool_written(inode);
     unlock_inode(mysql, inode);
+    data_conn_put(mysql, data);
 
     return 0;
 
 err_out:
     /* Rollback the transaction */
-    ret = mysql_query(mysql, "ROLLBACK");
-    unlock_inode(mysql, inode);
     log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-    return ret;
+    if (data != mysql) {
+	log_printf(LOG_ERROR, "mysql_error (shard): %s\n", mysql_error(data));
+	mysql_query(data, "ROLLBACK");
+    }
+    mysql_query(mysql, "ROLLBACK");
+    icache_invalidate(inode);
+    bcache_invalidate(inode);
+    pool_written(inode);
+    unlock_inode(mysql, inode);
+    data_conn_put(mysql, data);
+    return ret < 0 ? ret : -EIO;
 }
 
 /**
@@ -357,8 +888,21 @@ int query_mkdirentry(MYSQL *mysql, long inode, const char *name, long parent)
              "INSERT INTO %s (name, parent, inode) VALUES ('%s', %ld, %ld)",
              tables->tree, esc_name, parent, inode);
 
+    /* The entry and the link count change together */
+    mysql_query(mysql, "BEGIN");
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
     ret = mysql_query(mysql, sql);
+    if (!ret) {
+	snprintf(sql, SQL_MAX, "UPDATE %s SET nlink=nlink+1 WHERE inode=%ld",
+		 tables->inodes, inode);
+	log_printf(LOG_D_SQL, "sql=%s\n", sql);
+	ret = mysql_query(mysql, sql);
+    }
+    mysql_query(mysql, ret ? "ROLLBACK" : "COMMIT");
+    dcache_invalidate(parent, name);
+    icache_invalidate(inode);	/* nlinks changed */
+    pool_written(parent);
+    pool_written(inode);
     if(ret) {
       log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
       return -EIO;
@@ -424,12 +968,24 @@ int query_rmdirentry(MYSQL *mysql, const char *name, long parent)
 
     mysql_free_result(result);
     
+    /* The link count goes down with the entry */
+    mysql_query(mysql, "BEGIN");
     snprintf(sql, SQL_MAX,
-             "DELETE FROM %s WHERE name='%s' AND parent=%ld",
-             tables->tree, esc_name, parent);
-
+	     "UPDATE %s AS i JOIN %s AS t ON t.inode = i.inode SET i.nlink = i.nlink - 1 "
+	     "WHERE t.name='%s' AND t.parent=%ld AND i.nlink > 0",
+	     tables->inodes, tables->tree, esc_name, parent);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
     ret = mysql_query(mysql, sql);
+    if (!ret) {
+	snprintf(sql, SQL_MAX,
+		 "DELETE FROM %s WHERE name='%s' AND parent=%ld",
+		 tables->tree, esc_name, parent);
+	log_printf(LOG_D_SQL, "sql=%s\n", sql);
+	ret = mysql_query(mysql, sql);
+    }
+    mysql_query(mysql, ret ? "ROLLBACK" : "COMMIT");
+    dcache_invalidate(parent, name);
+    pool_written(parent);
     if(ret) {
       log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
       return -EIO;
@@ -454,7 +1010,7 @@ int query_rmdirentry(MYSQL *mysql, const char *name, long parent)
  * @param mode access mode of new directory
  * @param rdev type of inode to create
  * @param parent inode of directory holding files (parent inode)
- * @param alloc_data (unused)
+ * @param alloc_data non-zero for files with data, which start out inline when inline_max is set
  */
 long query_mknod(MYSQL *mysql, const char *path, mode_t mode, dev_t rdev,
                 long parent, int alloc_data)
@@ -464,7 +1020,11 @@ long query_mknod(MYSQL *mysql, const char *path, mode_t mode, dev_t rdev,
     long new_inode_number = 0;
     char *name, esc_name[PATH_MAX * 2];
 
+    /* The entry and its inode appear together, see query_scrub_range() */
+    mysql_query(mysql, "BEGIN");
     if (path[0] == '/' && path[1] == '\0')  {
+        name = "/";
+        parent = DCACHE_ROOT_PARENT;
         snprintf(sql, SQL_MAX,
                  "INSERT INTO %s (name, parent) VALUES ('/', NULL)", tables->tree);
 
@@ -474,8 +1034,10 @@ long query_mknod(MYSQL *mysql, const char *path, mode_t mode, dev_t rdev,
           goto err_out;
     } else {
         name = strrchr(path, '/');
-        if (!name || *++name == '\0') 
+        if (!name || *++name == '\0') {
+            mysql_query(mysql, "ROLLBACK");
             return -ENOENT;
+        }
             
         mysql_real_escape_string(mysql, esc_name, name, strlen(name));
         snprintf(sql, SQL_MAX,
@@ -491,21 +1053,29 @@ long query_mknod(MYSQL *mysql, const char *path, mode_t mode, dev_t rdev,
     new_inode_number = mysql_insert_id(mysql);
 
     snprintf(sql, SQL_MAX,
-             "INSERT INTO %s (inode, mode, uid, gid, atime, ctime, mtime)"
+             "INSERT INTO %s (inode, mode, uid, gid, atime, ctime, mtime, inline_data, nlink)"
              "VALUES(%ld, %d, %d, %d, UNIX_TIMESTAMP(NOW()), "
-	            "UNIX_TIMESTAMP(NOW()), UNIX_TIMESTAMP(NOW()))",
+	            "UNIX_TIMESTAMP(NOW()), UNIX_TIMESTAMP(NOW()), %s, 1)",
              tables->inodes, new_inode_number, mode,
-	     fuse_get_context()->uid, fuse_get_context()->gid);
+	     fuse_get_context()->uid, fuse_get_context()->gid,
+	     alloc_data && inline_max ? "''" : "NULL");
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
     ret = mysql_query(mysql, sql);
     if(ret)
       goto err_out;
+    mysql_query(mysql, "COMMIT");
+
+    /* Drop negative entries for any spelling of the name first. */
+    dcache_invalidate(parent, name);
+    dcache_insert(parent, name, new_inode_number, dcache_generation(name));
+    pool_written(parent);
 
     return new_inode_number;
 
 err_out:
     log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    mysql_query(mysql, "ROLLBACK");
     return ret;
 }
 
@@ -544,33 +1114,28 @@ long query_mkdir(MYSQL *mysql, const char *path, mode_t mode, long parent)
  */
 int query_readdir(MYSQL *mysql, long inode, void *buf, fuse_fill_dir_t filler)
 {
-    int ret;
-    char sql[SQL_MAX];
-    MYSQL_RES* result;
-    MYSQL_ROW row;
-
-    snprintf(sql, sizeof(sql), "SELECT name FROM %s WHERE parent = '%ld'",
-             tables->tree, inode);
+    char sql[SQL_MAX], name[PATH_MAX];
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[1], results[1];
+    long long parent = inode;
+    unsigned long name_len;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
-    }
+    snprintf(sql, sizeof(sql), "SELECT name FROM %s WHERE parent=?", tables->tree);
+    bind_longlong(&params[0], &parent, NULL);
+    bind_buffer(&results[0], MYSQL_TYPE_STRING, name, sizeof(name), &name_len);
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    stmt = stmt_execute(mysql, STMT_READDIR, sql, params, results);
+    if (!stmt)
         return -EIO;
-    }
 
-    while((row = mysql_fetch_row(result)) != NULL){
-        filler(buf, (char*)basename(row[0]), NULL, 0);
+    while (stmt_fetch(stmt)) {
+	name[MIN(name_len, sizeof(name) - 1)] = '\0';
+        filler(buf, (char*)basename(name), NULL, 0);
     }
 
-    mysql_free_result(result);
+    mysql_stmt_free_result(stmt);
 
-    return ret;
+    return 0;
 }
 
 /**
@@ -597,6 +1162,8 @@ int query_chmod(MYSQL *mysql, long inode, mode_t mode)
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
     ret = mysql_query(mysql, sql);
+    icache_invalidate(inode);
+    pool_written(inode);
     if(ret){
         log_printf(LOG_ERROR, "Error: mysql_query()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
@@ -640,6 +1207,8 @@ int query_chown(MYSQL *mysql, long inode, uid_t uid, gid_t gid)
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
     ret = mysql_query(mysql, sql);
+    icache_invalidate(inode);
+    pool_written(inode);
     if(ret){
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
         return -EIO;
@@ -675,6 +1244,8 @@ int query_utime(MYSQL *mysql, long inode, struct utimbuf *time)
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
     ret = mysql_query(mysql, sql);
+    icache_invalidate(inode);
+    pool_written(inode);
     if(ret){
         log_printf(LOG_ERROR, "Error: mysql_query()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
@@ -687,7 +1258,7 @@ int query_utime(MYSQL *mysql, long inode, struct utimbuf *time)
 /**
  * Read a number of bytes (perhaps larger than BLOCK_SIZE) at an offset from
  * a file.  The function does this by reading each block in succession, copying
- * the block contents into the target buffer.  The (offset % DATA_BLOCK_SIZE)
+ * the block contents into the target buffer.  The (offset % data_block_size)
  * issue is handled by shifting the copy slightly.
  *
  * @return < 0 in case of errors (propagating result of write_one_block() )
@@ -698,44 +1269,199 @@ int query_utime(MYSQL *mysql, long inode, struct utimbuf *time)
  * @param size number of bytes to read
  * @param offset offset within the file to read from
  */
+/**
+ * Copy the part of a block covered by a read into the read buffer.
+ *
+ * @return number of bytes copied, -1 if the read ends before this block
+ * @param dst where the block's part of the read goes
+ * @param info the blocks covered by the read
+ * @param seq sequence number of the block
+ * @param data contents of the block
+ * @param row_len length of the block
+ */
+static long read_copy_block(char *dst, const struct data_blocks_info *info,
+			    unsigned long seq, const char *data, size_t row_len)
+{
+    unsigned long copy_len;
+    const char *src;
+
+    if (seq == info->seq_first) {
+	if (row_len < info->offset_first)
+	    return -1;
+
+	copy_len = MIN(row_len - info->offset_first, info->length_first);
+	src = data + info->offset_first;
+    } else if (seq == info->seq_last) {
+	copy_len = MIN(info->length_last, row_len);
+	src = data;
+    } else {
+	copy_len = MIN(data_block_size, row_len);
+	src = data;
+    }
+
+    memcpy(dst, src, copy_len);
+
+    return copy_len;
+}
+
+/** Where stmt_read_blocks() puts the columns of each row */
+struct block_row {
+    long long		seq;
+    long long		datalength;	/**< length of the uncompressed block */
+    long long		codec;		/**< CODEC_NONE, or how data is compressed */
+    unsigned long	length;		/**< bytes of data actually fetched */
+    my_bool		is_null;
+    char		*data;		/**< data_block_size bytes */
+    char		*plain;		/**< data_block_size bytes for the uncompressed block */
+};
+
+/**
+ * Select the data blocks first to last of an inode, in order.  Rows are
+ * then fetched into row with stmt_fetch().  Unless the data blocks are
+ * sharded, the inline data of the inode comes along as block 0 when the
+ * range starts there, see query_inline_init().
+ *
+ * @return the statement, NULL on error
+ * @param with_inline 0 to select the data_blocks rows only
+ */
+static MYSQL_STMT *stmt_read_blocks(MYSQL *mysql, long inode, unsigned long first,
+				    unsigned long last, struct block_row *row, int with_inline)
+{
+    char sql[SQL_MAX];
+    MYSQL_BIND params[4], results[4];
+    long long p[4] = { inode, first, last, inode };
+    int i, head = with_inline && first == 0 && !pool_shards();
+
+    if (head)
+	snprintf(sql, SQL_MAX,
+		 "SELECT d.seq, IFNULL(d.data, b.data), d.datalength, IF(d.hash IS NULL, d.codec, b.codec) "
+		 "FROM %s d LEFT JOIN %s b ON b.hash=d.hash "
+		 "WHERE d.inode=? AND d.seq>=? AND d.seq<=? "
+		 "UNION ALL SELECT 0, inline_data, OCTET_LENGTH(inline_data), 0 "
+		 "FROM %s WHERE inode=? AND inline_data IS NOT NULL ORDER BY 1 ASC",
+		 tables->data_blocks, tables->data_blobs, tables->inodes);
+    else
+	snprintf(sql, SQL_MAX,
+		 "SELECT d.seq, IFNULL(d.data, b.data), d.datalength, IF(d.hash IS NULL, d.codec, b.codec) "
+		 "FROM %s d LEFT JOIN %s b ON b.hash=d.hash "
+		 "WHERE d.inode=? AND d.seq>=? AND d.seq<=? ORDER BY d.seq ASC",
+		 tables->data_blocks, tables->data_blobs);
+    for (i = 0; i < 3 + head; i++)
+	bind_longlong(&params[i], &p[i], NULL);
+    bind_longlong(&results[0], &row->seq, NULL);
+    bind_buffer(&results[1], MYSQL_TYPE_LONG_BLOB, row->data, data_block_size, &row->length);
+    results[1].is_null = &row->is_null;
+    bind_longlong(&results[2], &row->datalength, NULL);
+    bind_longlong(&results[3], &row->codec, NULL);
+
+    return stmt_execute(mysql, head ? STMT_READ_HEAD : STMT_READ_BLOCKS, sql, params, results);
+}
+
+/** Usable length of a fetched block: datalength, within what was actually fetched */
+static inline size_t block_row_len(const struct block_row *row)
+{
+    return MIN(MIN((unsigned long)row->datalength, row->length), data_block_size);
+}
+
+/**
+ * Contents of a fetched block, uncompressed into row->plain if need be.
+ *
+ * @return length of the block, -EIO if it can't be uncompressed
+ * @param row the fetched row
+ * @param data set to the contents of the block
+ */
+static long block_row_decode(struct block_row *row, const char **data)
+{
+    long len;
+
+    if (row->codec == CODEC_NONE) {
+	*data = row->data;
+	return block_row_len(row);
+    }
+
+    len = uncompress_block(row->codec, row->data, MIN(row->length, data_block_size),
+			   row->plain, data_block_size);
+    if (len < 0)
+	return len;
+    *data = row->plain;
+
+    return MIN(len, row->datalength);
+}
+
+/**
+ * Serve a read from the block cache.  All blocks must be cached: the read
+ * is not worth splitting between the cache and the database.
+ *
+ * @return -1 if a block is missing from the cache, else the length read
+ */
+static long query_read_cached(long inode, const struct data_blocks_info *info, char *dst)
+{
+    unsigned long seq;
+    long length = 0, copy_len;
+    size_t row_len;
+    char *block = malloc(data_block_size);
+
+    if (!block)
+	return -1;
+
+    for (seq = info->seq_first; seq <= info->seq_last; seq++) {
+	if (!bcache_get(inode, seq, block, &row_len)) {
+	    length = -1;
+	    break;
+	}
+	copy_len = read_copy_block(dst, info, seq, block, row_len);
+	if (copy_len < 0)
+	    break;
+	dst += copy_len;
+	length += copy_len;
+    }
+    free(block);
+
+    return length;
+}
+
 int query_read(MYSQL *mysql, long inode, const char *buf, size_t size,
                off_t offset)
 {
-    int ret;
-    char sql[SQL_MAX];
-    MYSQL_RES* result;
-    MYSQL_ROW row;
-    unsigned long length = 0L, copy_len, seq;
+    MYSQL_STMT *stmt;
+    struct block_row row;
+    unsigned long length = 0L, seq;
+    long copy_len;
     struct data_blocks_info info;
     char *dst = (char *)buf;
-    char *src, *zeroes = alloca(DATA_BLOCK_SIZE);
+    char *zeroes;
+    unsigned long gen;
+    int have_row, cache, ret = 0;
+    MYSQL *data;
 
     fill_data_blocks_info(&info, size, offset);
 
-    /* Read all required blocks */
-    if (info.seq_first == info.seq_last) {
-        snprintf(sql, SQL_MAX,
-                 "SELECT seq, data, datalength FROM %s WHERE inode=%ld AND seq=%lu",
-	         tables->data_blocks, inode, info.seq_first);
-    } else {
-        snprintf(sql, SQL_MAX,
-                 "SELECT seq, data, datalength FROM %s WHERE inode=%ld AND seq>=%lu AND seq <=%lu ORDER BY seq ASC",
-	         tables->data_blocks, inode, info.seq_first, info.seq_last);
-    }
-
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (bcache_enabled() && (copy_len = query_read_cached(inode, &info, dst)) >= 0)
+	return copy_len;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "ERROR: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
-    }
+    /* Sampled first: a write committing during the query makes the cache drop the rows. */
+    gen = bcache_generation(inode);
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    /* Read all required blocks */
+    if (!(data = data_conn(mysql, inode)))
+        return -EMFILE;
+    /*
+     * Only local writes invalidate the cache, so a block a lagging replica
+     * returns would stay stale there long after the replica caught up.
+     */
+    cache = !pool_is_replica(data);
+    /* Blocks may be megabytes: keep them off the stack. */
+    zeroes = calloc(3, data_block_size);
+    if (!zeroes) {
+        data_conn_put(mysql, data);
+        return -ENOMEM;
+    }
+    row.data = zeroes + data_block_size;
+    row.plain = row.data + data_block_size;
+    stmt = stmt_read_blocks(data, inode, info.seq_first, info.seq_last, &row, 1);
+    if (!stmt) {
+        free(zeroes);
+        data_conn_put(mysql, data);
         return -EIO;
     }
 
@@ -743,46 +1469,322 @@ int query_read(MYSQL *mysql, long inode, const char *buf, size_t size,
      * It means not all requested blocks must exist in the
      * database. For those that don't exist we'll return
      * a block of \0 instead.  */
-    row = mysql_fetch_row(result);
-    memset(zeroes, 0L, DATA_BLOCK_SIZE);
+    have_row = stmt_fetch(stmt);
     for (seq = info.seq_first; seq<=info.seq_last; seq++) {
-        off_t row_seq = -1;
-	size_t row_len = DATA_BLOCK_SIZE;
-	char *data = zeroes;
+	long row_len = data_block_size;
+	const char *block = zeroes;
+	int this_row = have_row && row.seq == seq;
+
+	if (this_row && !row.is_null) {
+	    row_len = block_row_decode(&row, &block);
+	    if (row_len < 0) {
+		ret = row_len;
+		break;
+	    }
+	    if (cache)
+		bcache_put(inode, seq, block, row_len, gen);
+	}
+
+	copy_len = read_copy_block(dst, &info, seq, block, row_len);
+	if (copy_len < 0)
+	    break;
+	dst += copy_len;
+	length += copy_len;
+
+	if (this_row)
+	    have_row = stmt_fetch(stmt);
+    }
+
+    mysql_stmt_free_result(stmt);
+    free(zeroes);
+    data_conn_put(mysql, data);
+
+    return ret < 0 ? ret : length;
+}
+
+/**
+ * Read a range of data blocks into the block cache, ahead of the reads
+ * that will need them.  Blocks that don't exist (holes, or past the end of
+ * the file) are simply not cached.
+ *
+ * @return number of blocks cached, -EIO on database error
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param first first block to read
+ * @param last last block to read
+ */
+int query_prefetch(MYSQL *mysql, long inode, unsigned long first, unsigned long last)
+{
+    MYSQL_STMT *stmt;
+    struct block_row row;
+    unsigned long gen;
+    int count = 0;
+    const char *block;
+    long len;
+    MYSQL *data;
+
+    /* Sampled first: a write committing during the query makes us drop the rows. */
+    gen = bcache_generation(inode);
+
+    if (!(data = data_conn(mysql, inode)))
+	return -EMFILE;
+
+    row.data = malloc(2 * data_block_size);
+    if (!row.data) {
+	data_conn_put(mysql, data);
+	return -ENOMEM;
+    }
+    row.plain = row.data + data_block_size;
+
+    stmt = stmt_read_blocks(data, inode, first, last, &row, 1);
+    if (!stmt) {
+	free(row.data);
+	data_conn_put(mysql, data);
+        return -EIO;
+    }
+
+    while (stmt_fetch(stmt)) {
+	if (row.is_null || (len = block_row_decode(&row, &block)) < 0)
+	    continue;
+	bcache_put(inode, row.seq, block, len, gen);
+	count++;
+    }
+    mysql_stmt_free_result(stmt);
+    free(row.data);
+    data_conn_put(mysql, data);
+
+    return count;
+}
+
+/**
+ * Take a reference to the deduplicated payload named hash, storing it first
+ * if nothing uses it yet; in that case the payload is compressed with the
+ * current codec.  The reference must exist before a data block points at
+ * the payload: the data_blocks triggers drop it, and the payload with the
+ * last one.
+ *
+ * @return 0 on success, -EIO on error
+ * @param mysql handle to connection to the server holding the data blocks
+ * @param hash SHA256_LEN bytes naming the payload
+ * @param data the payload
+ * @param len length of the payload
+ * @param packed len bytes for the compressed payload, NULL if compression is off
+ */
+static int blob_ref(MYSQL *mysql, const unsigned char *hash, const char *data,
+		    size_t len, char *packed)
+{
+    MYSQL_BIND params[4];
+    MYSQL_STMT *stmt;
+    char sql[SQL_MAX];
+    unsigned long hash_len = SHA256_LEN, length = len;
+    long long datalength = len, codec = CODEC_NONE;
+    size_t packed_len;
+
+    snprintf(sql, SQL_MAX, "UPDATE %s SET refs=refs+1 WHERE hash=?", tables->data_blobs);
+    bind_buffer(&params[0], MYSQL_TYPE_BLOB, hash, SHA256_LEN, &hash_len);
+    stmt = stmt_execute(mysql, STMT_BLOB_REF, sql, params, NULL);
+    if (!stmt)
+	return -EIO;
+    if (mysql_stmt_affected_rows(stmt))
+	return 0;
+
+    /* New payload.  Another writer may store the same one meanwhile. */
+    if (packed && len) {
+	codec = compress_block(data, len, packed, &packed_len);
+	if (codec != CODEC_NONE) {
+	    data = packed;
+	    length = packed_len;
+	}
+    }
+    snprintf(sql, SQL_MAX,
+	     "INSERT INTO %s (hash, data, datalength, codec, refs) VALUES (?, ?, ?, ?, 1) "
+	     "ON DUPLICATE KEY UPDATE refs=refs+1",
+	     tables->data_blobs);
+    bind_buffer(&params[0], MYSQL_TYPE_BLOB, hash, SHA256_LEN, &hash_len);
+    bind_buffer(&params[1], MYSQL_TYPE_LONG_BLOB, data, length, &length);
+    bind_longlong(&params[2], &datalength, NULL);
+    bind_longlong(&params[3], &codec, NULL);
+    if (!stmt_execute(mysql, STMT_BLOB_STORE, sql, params, NULL))
+	return -EIO;
+
+    return 0;
+}
+
+/**
+ * Store data blocks, many rows per INSERT ... ON DUPLICATE KEY UPDATE
+ * statement, each compressed with the current codec.  A stored block
+ * replaces whatever was there, so there is nothing to read or merge first,
+ * and datalength is known up front.  Statements are capped at
+ * WRITE_BATCH_BYTES of data to stay well below max_allowed_packet.
+ * With deduplication, the rows only name their payload, see blob_ref().
+ *
+ * @return 0 on success, < 0 in case of errors
+ * @param mysql handle to connection to the server holding the data blocks
+ * @param inode inode of the file in question
+ * @param seq sequence numbers of the blocks
+ * @param data len bytes for each block
+ * @param count number of blocks
+ * @param len length of every block
+ */
+static int store_blocks(MYSQL *mysql, long inode, const unsigned long *seq,
+			const char *const *data, unsigned int count, size_t len)
+{
+    MYSQL_STMT *stmt;
+    MYSQL_BIND bind[6 * WRITE_BATCH_MAX];
+    long long id = inode, datalength = len, block[WRITE_BATCH_MAX], codec[WRITE_BATCH_MAX];
+    unsigned long length[WRITE_BATCH_MAX], hash_len = SHA256_LEN;
+    unsigned char hash[WRITE_BATCH_MAX][SHA256_LEN];
+    my_bool no_data = dedup, no_hash = !dedup;
+    char sql[SQL_MAX + WRITE_BATCH_MAX * 24];
+    char *packed = NULL;
+    unsigned int done, n, i;
+    size_t pos, packed_len;
+    const char *ptr;
+    int cached, ret;
+
+    if (compress_codec() != CODEC_NONE && len) {
+	packed = malloc(MIN(count, WRITE_BATCH_BLOCKS) * len);
+	if (!packed)
+	    return -ENOMEM;
+    }
+
+    for (done = 0; done < count; done += n) {
+	n = count - done;
+	if (n > WRITE_BATCH_BLOCKS)
+	    n = WRITE_BATCH_BLOCKS;
 
-	if (row && (row_seq = atoll(row[0])) == seq) {
-	    data = row[1];
-	    row_len = atoll(row[2]);
+	pos = snprintf(sql, sizeof(sql),
+		       "INSERT INTO %s (inode, seq, data, datalength, codec, hash) VALUES ",
+		       tables->data_blocks);
+	for (i = 0; i < n; i++)
+	    pos += snprintf(sql + pos, sizeof(sql) - pos, "(?, ?, ?, ?, ?, ?),");
+	sql[--pos] = '\0';	/* Remove the trailing comma. */
+	snprintf(sql + pos, sizeof(sql) - pos,
+		 " ON DUPLICATE KEY UPDATE data=VALUES(data), datalength=VALUES(datalength), "
+		 "codec=VALUES(codec), hash=VALUES(hash)");
+	log_printf(LOG_D_SQL, "sql=INSERT INTO %s ... %u rows from seq %lu\n",
+		   tables->data_blocks, n, seq[done]);
+
+	for (i = 0; i < n; i++) {
+	    block[i] = seq[done + i];
+	    ptr = data[done + i];
+	    length[i] = len;
+	    codec[i] = CODEC_NONE;
+	    if (dedup) {
+		sha256(ptr, len, hash[i]);
+		if ((ret = blob_ref(mysql, hash[i], ptr, len, packed)) < 0) {
+		    free(packed);
+		    return ret;
+		}
+	    } else if (packed) {
+		codec[i] = compress_block(ptr, len, packed + i * len, &packed_len);
+		if (codec[i] != CODEC_NONE) {
+		    ptr = packed + i * len;
+		    length[i] = packed_len;
+		}
+	    }
+	    bind_longlong(&bind[6 * i], &id, NULL);
+	    bind_longlong(&bind[6 * i + 1], &block[i], NULL);
+	    bind_buffer(&bind[6 * i + 2], MYSQL_TYPE_LONG_BLOB, ptr, length[i], &length[i]);
+	    bind[6 * i + 2].is_null = &no_data;
+	    bind_longlong(&bind[6 * i + 3], &datalength, NULL);
+	    bind_longlong(&bind[6 * i + 4], &codec[i], NULL);
+	    bind_buffer(&bind[6 * i + 5], MYSQL_TYPE_BLOB, hash[i], SHA256_LEN, &hash_len);
+	    bind[6 * i + 5].is_null = &no_hash;
 	}
-	    
-	if (seq == info.seq_first) {
-	    if (row_len < info.offset_first)
-	        goto go_away;
-
-	    copy_len = MIN(row_len - info.offset_first, info.length_first);
-	    src = data + info.offset_first;
-	} else if (seq == info.seq_last) {
-	    copy_len = MIN(info.length_last, row_len);
-	    src = data;
+
+	/* Single blocks and full batches are the common shapes: keep those prepared. */
+	cached = n == 1 || n == WRITE_BATCH_BLOCKS;
+	if (cached) {
+	    stmt = stmt_execute(mysql, n == 1 ? STMT_WRITE_BLOCK : STMT_WRITE_BATCH,
+				sql, bind, NULL);
+	    if (!stmt) {
+		free(packed);
+		return -EIO;
+	    }
 	} else {
-	    copy_len = MIN(DATA_BLOCK_SIZE, row_len);
-	    src = data;
+	    stmt = mysql_stmt_init(mysql);
+	    if (!stmt) {
+		log_printf(LOG_ERROR, "%s(): mysql_stmt_init(), out of memory\n", __func__);
+		free(packed);
+		return -EIO;
+	    }
+	    if (mysql_stmt_prepare(stmt, sql, strlen(sql)) ||
+		mysql_stmt_bind_param(stmt, bind) ||
+		mysql_stmt_execute(stmt)) {
+		log_printf(LOG_ERROR, "%s(): %u %s\n", __func__,
+			   mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		free(packed);
+		return -EIO;
+	    }
+	    mysql_stmt_close(stmt);
 	}
+    }
+    free(packed);
 
-	memcpy(dst, src, copy_len);
-	dst += copy_len;
-	length += copy_len;
+    return 0;
+}
+
+/**
+ * Change part of a data block on the client side: fetch and uncompress it,
+ * put size bytes of buf at offset (or cut it at offset if buf is NULL),
+ * and store it again with the current codec.  Compressed and deduplicated
+ * blocks can't be spliced by the server, see write_one_block() and
+ * query_truncate().
+ *
+ * @return size on success, < 0 on error
+ * @param mysql handle to connection to the server holding the data blocks
+ * @param inode inode of the file in question
+ * @param seq sequence number of the block
+ * @param buf data to write, NULL to truncate the block at offset
+ * @param size length of buf
+ * @param offset where the change starts within the block
+ */
+static int rewrite_block(MYSQL *mysql, long inode, unsigned long seq,
+			 const char *buf, size_t size, off_t offset)
+{
+    MYSQL_STMT *stmt;
+    struct block_row row;
+    const char *old;
+    char *block;
+    long len = 0;
+    int have_row, ret;
+
+    block = malloc(3 * data_block_size);
+    if (!block)
+	return -ENOMEM;
+    row.data = block + data_block_size;
+    row.plain = row.data + data_block_size;
+
+    stmt = stmt_read_blocks(mysql, inode, seq, seq, &row, 0);
+    if (!stmt) {
+	free(block);
+	return -EIO;
+    }
+    have_row = stmt_fetch(stmt);
+    if (have_row && !row.is_null && (len = block_row_decode(&row, &old)) > 0)
+	memcpy(block, old, len);
+    mysql_stmt_free_result(stmt);
 
-	if (row && row_seq == seq)
-	    row = mysql_fetch_row(result);
+    if (len < 0 || (!have_row && !buf)) {
+	/* Corrupt block, or nothing to truncate. */
+	free(block);
+	return len < 0 ? len : 0;
     }
 
-go_away:
-    /* Read all remaining rows */
-    while (mysql_fetch_row(result));
-    mysql_free_result(result);
+    if (offset > len)
+	memset(block + len, 0, offset - len);
+    if (buf) {
+	memcpy(block + offset, buf, size);
+	len = MAX(len, (long)(offset + size));
+    } else
+	len = offset;
 
-    return length;
+    ret = store_blocks(mysql, inode, &seq, (const char *const *)&block, 1, len);
+    free(block);
+
+    return ret < 0 ? ret : (int)size;
 }
 
 /**
@@ -791,12 +1793,12 @@ go_away:
  * This function takes an early bail-out if the size to write is zero, or if the total size to write exceeds the block size.
  *
  * This function checks to see if the previous block didn't exist -- in such
- * case, it then writes out a zero-length block.  The function then creates a
- * statement that has a '?' token representing the new data.  If the previous
- * data didn't exist, the function uses a "SET x == y" format; otherwise, a
- * "CONCAT (data, ?)".  The statement is snprintf'd, prepared, and executed; the
- * result produces either a 0 on success, or a -EIO on failure (with an error
- * message logged).
+ * case, it then writes out a zero-length block.  The new data is then spliced
+ * into the block by a single prepared UPDATE, which also sets datalength.
+ * Compressed and deduplicated blocks, and every block while compression or
+ * deduplication is on, go through rewrite_block() instead.
+ * The result is either the size written on success, or a -EIO on failure
+ * (with an error message logged).
  *
  * @return 0 on success; -EIO on failure
  * @param mysql handle to connection to the database
@@ -811,136 +1813,129 @@ static int write_one_block(MYSQL *mysql, long inode,
 				 const char *data, size_t size,
 				 off_t offset)
 {
+    MYSQL_BIND params[5];
     MYSQL_STMT *stmt;
-    MYSQL_BIND bind[1];
-    unsigned int mysqlerrno;
     char sql[SQL_MAX];
-    size_t current_block_size = query_size_block(mysql, inode, seq);
+    long long id = inode, block = seq, pad = offset, tail = offset + size + 1;
+    unsigned long length = size;
+    ssize_t current_block_size;
 
     /* Shortcut */
     if (size == 0) return 0;
 
-    if (offset + size > DATA_BLOCK_SIZE) {
-        log_printf(LOG_ERROR, "%s(): offset(%zu)+size(%zu)>max_block(%d)\n", 
-		   __func__, offset, size, DATA_BLOCK_SIZE);
+    if (offset + size > data_block_size) {
+        log_printf(LOG_ERROR, "%s(): offset(%zu)+size(%zu)>max_block(%lu)\n", 
+		   __func__, offset, size, data_block_size);
 	return -EIO;
     }
 
     /* We expect the inode is already locked for this thread by caller! */
 
+    if (compress_codec() != CODEC_NONE || dedup)
+	return rewrite_block(mysql, inode, seq, data, size, offset);
+
+    current_block_size = query_size_block(mysql, inode, seq);
     if (current_block_size == -ENXIO) {
         /* This data block has not yet been allocated */
         snprintf(sql, SQL_MAX,
-                 "INSERT INTO %s SET inode=%ld, seq=%lu, data=''", tables->data_blocks, inode, seq);
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        if(mysql_query(mysql, sql)){
-		mysqlerrno = mysql_errno(mysql);
-		log_printf(LOG_ERROR, "WriteOneBlock EmptyBlock - mysql_error: %u %s\n", mysqlerrno, mysql_error(mysql));
-		return -EIO;
-        }
+                 "INSERT INTO %s SET inode=?, seq=?, data=''", tables->data_blocks);
+	bind_longlong(&params[0], &id, NULL);
+	bind_longlong(&params[1], &block, NULL);
+	if (!stmt_execute(mysql, STMT_BLOCK_CREATE, sql, params, NULL))
+	    return -EIO;
+    } else if (current_block_size < 0)
+	return current_block_size;
 
-	/* If I just created the block then it must be zero */
-	current_block_size = 0;
-    }
-
-    stmt = mysql_stmt_init(mysql);
+    /*
+     * One statement covers every case: the old data up to offset (padded
+     * with \0 if the block is shorter), the new data, then whatever old
+     * data follows it.  Assignments are evaluated in order, so datalength
+     * sees the new data.
+     */
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s SET data=CONCAT(RPAD(IFNULL(data, ''), ?, '\\0'), ?, "
+	     "SUBSTRING(IFNULL(data, '') FROM ?)), datalength=OCTET_LENGTH(data) "
+	     "WHERE inode=? AND seq=? AND codec=0 AND hash IS NULL",
+	     tables->data_blocks);
+    bind_longlong(&params[0], &pad, NULL);
+    bind_buffer(&params[1], MYSQL_TYPE_LONG_BLOB, data, size, &length);
+    bind_longlong(&params[2], &tail, NULL);
+    bind_longlong(&params[3], &id, NULL);
+    bind_longlong(&params[4], &block, NULL);
+
+    stmt = stmt_execute(mysql, STMT_BLOCK_UPDATE, sql, params, NULL);
     if (!stmt)
-    {
-        log_printf(LOG_ERROR, "WriteOneBlock - mysql_stmt_init(), out of memory\n");
 	return -EIO;
-    }
 
-    memset(bind, 0, sizeof(bind));
-    if (offset == 0 && current_block_size == 0) {
-        snprintf(sql, SQL_MAX,
-                 "UPDATE %s "
-		 "SET data=? "
-		 "WHERE inode=%ld AND seq=%lu",
-		 tables->data_blocks, inode, seq);
-    } else if (offset == current_block_size) {
-        snprintf(sql, sizeof(sql),
-                 "UPDATE %s "
-		 "SET data=CONCAT(data, ?) "
-		 "WHERE inode=%ld AND seq=%lu",
-		 tables->data_blocks, inode, seq);
-    } else {
-        size_t pos, new_size;
-        pos = snprintf(sql, sizeof(sql),
-		 "UPDATE %s SET data=CONCAT(", tables->data_blocks);
-	if (offset > 0)
-	    pos += snprintf(sql + pos, sizeof(sql) - pos, "RPAD(IF(ISNULL(data),'', data), %ld, '\\0'),", offset);
-	pos += snprintf(sql + pos, sizeof(sql) - pos, "?,");
-	new_size = offset + size;
-	if (offset + size < current_block_size) {
-	    pos += snprintf(sql + pos, sizeof(sql) - pos, "SUBSTRING(data FROM %lu),", offset + size + 1);
-	    new_size = current_block_size;
-	}
-	sql[--pos] = '\0';	/* Remove the trailing comma. */
-	pos += snprintf(sql + pos, sizeof(sql) - pos, ") WHERE inode=%ld AND seq=%lu",
-			inode, seq);
-    }
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    /* Nothing changed: the block is compressed or deduplicated, or already held this data. */
+    if (!mysql_stmt_affected_rows(stmt))
+	return rewrite_block(mysql, inode, seq, data, size, offset);
 
-    if (mysql_stmt_prepare(stmt, sql, strlen(sql))) {
-	log_printf(LOG_ERROR, "mysql_stmt_prepare() failed: %s\n", mysql_stmt_error(stmt));
-	goto err_out;
-    }
+    return size;
+}
 
-    if (mysql_stmt_param_count(stmt) != 1) {
-      log_printf(LOG_ERROR, "%s(): stmt_param_count=%d, expected 1\n", __func__, mysql_stmt_param_count(stmt));
-      return -EIO;
-    }
-    bind[0].buffer_type= MYSQL_TYPE_LONG_BLOB;
-    bind[0].buffer= (char *)data;
-    bind[0].is_null= 0;
-    bind[0].length= (unsigned long *)(void *)&size;
+/**
+ * Write whole data blocks, see store_blocks(), and update the block cache.
+ *
+ * @return < 0 in case of errors
+ * @return > 0 number of bytes written (count * data_block_size)
+ * @param mysql handle to connection to the server holding the data blocks
+ * @param inode inode of the file in question
+ * @param seq sequence numbers of the blocks
+ * @param data data_block_size bytes for each block
+ * @param count number of blocks
+ */
+static int write_full_blocks(MYSQL *mysql, long inode, const unsigned long *seq,
+                             const char *const *data, unsigned int count)
+{
+    unsigned int i;
+    int ret;
 
-    if (mysql_stmt_bind_param(stmt, bind)) {
-	log_printf(LOG_ERROR, "mysql_stmt_bind_param() failed: %s\n", mysql_stmt_error(stmt));
-	goto err_out;
-    }
+    ret = store_blocks(mysql, inode, seq, data, count, data_block_size);
+    if (ret < 0)
+	return ret;
 
-    /*
-    if (!mysql_stmt_send_long_data(stmt, 0, data, size))
-    {
-        log_printf(" send_long_data failed");
-	goto err_out;
-    }
-    */
-    if (mysql_stmt_execute(stmt)) {
-	log_printf(LOG_ERROR, "WriteOneBlock - mysql_stmt_execute() failed: %u %s\n", mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
-	goto err_out;
-    }
+    for (i = 0; i < count; i++)
+	bcache_write(inode, data[i], data_block_size, (off_t)seq[i] * data_block_size);
 
-    if (mysql_stmt_close(stmt))
-	log_printf(LOG_ERROR, "failed closing the statement: %s\n", mysql_stmt_error(stmt));
+    return count * data_block_size;
+}
 
+/**
+ * Write whole data blocks, see write_full_blocks(), on the shard of the
+ * inode if the data blocks are sharded.
+ *
+ * @return < 0 in case of errors
+ * @return > 0 number of bytes written (count * data_block_size)
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param seq sequence numbers of the blocks
+ * @param data data_block_size bytes for each block
+ * @param count number of blocks
+ */
+int query_write_blocks(MYSQL *mysql, long inode, const unsigned long *seq,
+                       const char *const *data, unsigned int count)
+{
+    MYSQL *shard;
+    int ret;
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE %s SET datalength=OCTET_LENGTH(data) "
-             "WHERE inode=%ld AND seq=%ld",
-             tables->data_blocks, inode, seq);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if(mysql_query(mysql, sql)){
-             mysqlerrno = mysql_errno(mysql);
-             log_printf(LOG_ERROR, "WriteOneBlock Update DataLength - mysql_error: %u %s\n", mysqlerrno, mysql_error(mysql));
-             return -EIO;
-    }
+    if (!(shard = data_conn(mysql, inode)))
+	return -EMFILE;
 
+    if (seq[0] == 0 && shard == mysql && (ret = inline_evict(mysql, inode, 0)) < 0)
+	return ret;
 
-    return size;
+    ret = write_full_blocks(shard, inode, seq, data, count);
+    data_conn_put(mysql, shard);
 
-err_out:
-	log_printf(LOG_ERROR, " %s\n", mysql_stmt_error(stmt));
-	if (mysql_stmt_close(stmt))
-	    log_printf(LOG_ERROR, "failed closing the statement: %s\n", mysql_stmt_error(stmt));
-	return -EIO;
+    return ret;
 }
 
 /**
  * Write a number of bytes (perhaps larger than BLOCK_SIZE) at an offset into
- * a file.  The function does this by writing the first partial block, then
- * writing successive blocks until the full @c size is written.
+ * a file.  Partial blocks at either end go through write_one_block(), the
+ * full blocks in between through query_write_blocks().  The size of the
+ * inode is left alone, see query_extend_size().
  *
  * @return < 0 in case of errors (propagating result of write_one_block() )
  * @return > 0 number of bytes written (should equal size parameter)
@@ -950,111 +1945,169 @@ err_out:
  * @param size number of bytes to write
  * @param offset offset within the file to write to
  */
-int query_write(MYSQL *mysql, long inode, const char *data, size_t size,
-                off_t offset)
+int query_write_data(MYSQL *mysql, long inode, const char *data, size_t size,
+                     off_t offset)
 {
     struct data_blocks_info info;
-    unsigned long seq;
-    unsigned int mysqlerrno;
-    const char *ptr;
-    char sql[SQL_MAX];
+    unsigned long seq[WRITE_BATCH_BLOCKS];
+    const char *blocks[WRITE_BATCH_BLOCKS];
+    unsigned long next;
+    unsigned int n;
+    const char *ptr = data;
     int ret, commitret, ret_size = 0;
+    MYSQL *shard;
 
     fill_data_blocks_info(&info, size, offset);
+    next = info.seq_first;
 
-    /* Start a transaction */
-    commitret = mysql_query(mysql, "BEGIN");
-    
-    /* Handle first block */
+    if (!(shard = data_conn(mysql, inode)))
+	return -EMFILE;
+
+    /* Start a transaction, where the data blocks are */
+    commitret = mysql_query(shard, "BEGIN");
     lock_inode(mysql, inode);
-    ret = write_one_block(mysql, inode, info.seq_first, data,
-			  info.length_first, info.offset_first);
-    unlock_inode(mysql, inode);
-    if (ret < 0)
-        return ret;
-    ret_size = ret;
-
-    /* Shortcut - if last block seq is the same as first block
-     * seq simply go away as it's the same block */
-    if (info.seq_first != info.seq_last)
-    {
-     
-        ptr = data + info.length_first;
-
-        /* Handle all full-sized intermediate blocks */
-        for (seq = info.seq_first + 1; seq < info.seq_last; seq++) {
-                lock_inode(mysql, inode);
-                ret = write_one_block(mysql, inode, seq, ptr, DATA_BLOCK_SIZE, 0);
-                unlock_inode(mysql, inode);
-                if (ret < 0) {
-                    /* Better rollback... */
-                    commitret = mysql_query(mysql, "ROLLBACK");
-                    return ret;
-                }
-        	ptr += DATA_BLOCK_SIZE;
-        	ret_size += ret;
-        }
 
-        /* Handle last block */
-        lock_inode(mysql, inode);
-        ret = write_one_block(mysql, inode, info.seq_last, ptr,
-        			  info.length_last, 0);
-        unlock_inode(mysql, inode);
-        if (ret < 0) {
-            /* Better rollback... */
-            commitret = mysql_query(mysql, "ROLLBACK");
-            return ret;
-        }
-        ret_size += ret;
-    }
-
-    /* Let's commit the transaction (and the size update...) */
-    commitret = mysql_query(mysql, "COMMIT");
-
-    /* Update file size */
-    /* This has to be changed to better interact with replication.
-	Specifically there's no need to run the update as select
-	on the slave nodes. The solution for this is to put the
-	result of the select into a variable and then use the variable
-	to update the value of the DB. Doing this the replication
-	will save the already computer value and the slave will run
-	a simple update. Furthermore I have some feelings that 
-	this will also avoid problems with non-deterministic
-	updates.... */
-    snprintf(sql, SQL_MAX,
-             "SELECT SUM(datalength) INTO @iNodeSize FROM %s WHERE inode = %ld",
-             tables->data_blocks, inode);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    mysql_query(mysql, sql);
+    /* Block 0 stays in the inodes row while the file is small enough */
+    if (info.seq_first == 0 && shard == mysql) {
+	if (offset + size <= inline_max &&
+	    (ret = inline_write(mysql, inode, data, size, offset)) != 0) {
+	    if (ret < 0)
+		goto err_out;
+	    ret_size = size;
+	    goto out;
+	}
+	ret = inline_evict(mysql, inode, info.length_first < data_block_size);
+	if (ret < 0)
+	    goto err_out;
+    }
+
+    /* Handle a partial first block */
+    if (info.length_first < data_block_size) {
+	ret = write_one_block(shard, inode, next, ptr,
+			      info.length_first, info.offset_first);
+	if (ret < 0)
+	    goto err_out;
+	ptr += ret;
+	ret_size += ret;
+	next++;
+    }
+
+    /* Handle all full-sized blocks, a batch at a time */
+    while (next < info.seq_last) {
+	for (n = 0; n < WRITE_BATCH_BLOCKS && next < info.seq_last; n++, next++) {
+	    seq[n] = next;
+	    blocks[n] = ptr;
+	    ptr += data_block_size;
+	}
+	ret = write_full_blocks(shard, inode, seq, blocks, n);
+	if (ret < 0)
+	    goto err_out;
+	ret_size += ret;
+    }
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE %s SET size = @iNodeSize WHERE inode = %ld",
-             tables->inodes, inode);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if(mysql_query(mysql, sql)) {
-	mysqlerrno = mysql_errno(mysql);
-	log_printf(LOG_ERROR, "mysql_error: %u %s\n", mysqlerrno, mysql_error(mysql));
-        return -EIO;
+    /* Handle a partial last block */
+    if (info.seq_last != info.seq_first && info.length_last) {
+	ret = write_one_block(shard, inode, info.seq_last, ptr,
+			      info.length_last, 0);
+	if (ret < 0)
+	    goto err_out;
+	ret_size += ret;
     }
 
+out:
+    unlock_inode(mysql, inode);
+
+    /* Let's commit the transaction */
+    commitret = mysql_query(shard, "COMMIT");
+    data_conn_put(mysql, shard);
+    bcache_write(inode, data, ret_size, offset);
+    pool_written(inode);
+
     return ret_size;
+
+err_out:
+    /* Better rollback... */
+    unlock_inode(mysql, inode);
+    commitret = mysql_query(shard, "ROLLBACK");
+    data_conn_put(mysql, shard);
+    bcache_invalidate(inode);
+    return ret;
 }
 
 /**
- * Check the size of a file.  Check the value by reading the attribute stored
- * in the inode table itself.  The function does not summarize the size "live"
- * by summing the size of each data block; rather this value is updated in
- * query_fsck(), query_truncate(), write_one_block().  This trust in the
- * various write functions optimizes this function's response time and
- * reduces DB load.
+ * Grow the size of an inode to at least @c size bytes.  The new size comes
+ * from the write itself, so appending costs the same however large the file
+ * already is.  Writes only ever grow a file: shrinking is the job of
+ * query_truncate().
  *
- * @return total size of the file at the inode as represented in the inode block
+ * @return 0 on success, -EIO on database error
  * @param mysql handle to connection to the database
  * @param inode inode of the file in question
+ * @param size end of the data just written
  */
-ssize_t query_size(MYSQL *mysql, long inode)
+int query_extend_size(MYSQL *mysql, long inode, off_t size)
 {
-    size_t ret;
+    char sql[SQL_MAX];
+    MYSQL_BIND params[2];
+    long long id = inode, end = size;
+
+    snprintf(sql, SQL_MAX,
+             "UPDATE %s SET size=GREATEST(size, ?) WHERE inode=?", tables->inodes);
+    bind_longlong(&params[0], &end, NULL);
+    bind_longlong(&params[1], &id, NULL);
+    if (!stmt_execute(mysql, STMT_EXTEND_SIZE, sql, params, NULL)) {
+	icache_invalidate(inode);
+        return -EIO;
+    }
+
+    icache_extend(inode, size);
+    pool_written(inode);
+
+    return 0;
+}
+
+/**
+ * Write data at an offset into a file and grow the file size accordingly.
+ *
+ * @return < 0 in case of errors
+ * @return > 0 number of bytes written (should equal size parameter)
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param data the buffer of data to write
+ * @param size number of bytes to write
+ * @param offset offset within the file to write to
+ */
+int query_write(MYSQL *mysql, long inode, const char *data, size_t size,
+                off_t offset)
+{
+    int ret, size_ret;
+
+    ret = query_write_data(mysql, inode, data, size, offset);
+    if (ret <= 0)
+        return ret;
+
+    size_ret = query_extend_size(mysql, inode, offset + ret);
+    if (size_ret < 0)
+        return size_ret;
+
+    return ret;
+}
+
+/**
+ * Check the size of a file.  Check the value by reading the attribute stored
+ * in the inode table itself.  The function does not summarize the size "live"
+ * by summing the size of each data block; rather this value is updated in
+ * query_fsck_range(), query_truncate(), write_one_block().  This trust in the
+ * various write functions optimizes this function's response time and
+ * reduces DB load.
+ *
+ * @return total size of the file at the inode as represented in the inode block
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ */
+ssize_t query_size(MYSQL *mysql, long inode)
+{
+    size_t ret;
     char sql[SQL_MAX];
     MYSQL_RES *result;
     MYSQL_ROW row;
@@ -1102,51 +2155,35 @@ ssize_t query_size(MYSQL *mysql, long inode)
  * @return -ENXIO if the inode/seq pair is not found (zero rows returned, implying that block doesn't exist)
  * @return -EIO if no row is returned (implying an error in the query response, signaled by mysql_fetch_row() returning NULL)
  * @return 0 if the rown is NULL (implying no result?)
- * @return 1 - DATA_BLOCK_SIZE (size of the actual block)
+ * @return 1 - data_block_size (size of the actual block)
  * @param mysql handle to connection to the database
  * @param inode inode of the file in question
  * @param seq sequence number of datablock to check
  */
 ssize_t query_size_block(MYSQL *mysql, long inode, unsigned long seq)
 {
-    size_t ret;
     char sql[SQL_MAX];
-    MYSQL_RES *result;
-    MYSQL_ROW row;
-
-    snprintf(sql, SQL_MAX, "SELECT datalength FROM %s WHERE inode=%ld AND seq=%lu",
-             tables->data_blocks, inode, seq);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
-    }
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
-    }
-
-    if(mysql_num_rows(result) == 0) {
-        mysql_free_result(result);
-        return -ENXIO;
-    }
-
-    row = mysql_fetch_row(result);
-    if(!row){
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[2], results[1];
+    long long id = inode, block = seq, length = 0;
+    my_bool is_null = 0;
+    ssize_t ret;
+
+    snprintf(sql, SQL_MAX, "SELECT datalength FROM %s WHERE inode=? AND seq=?",
+             tables->data_blocks);
+    bind_longlong(&params[0], &id, NULL);
+    bind_longlong(&params[1], &block, NULL);
+    bind_longlong(&results[0], &length, &is_null);
+
+    stmt = stmt_execute(mysql, STMT_BLOCK_LENGTH, sql, params, results);
+    if (!stmt)
         return -EIO;
-    }
 
-    if(row[0]){
-        ret = atoll(row[0]);
-    }else{
-        ret = 0;
-    }
-    mysql_free_result(result);
+    if (!stmt_fetch(stmt))
+	ret = -ENXIO;
+    else
+	ret = is_null ? 0 : length;
+    mysql_stmt_free_result(stmt);
 
     return ret;
 }
@@ -1203,6 +2240,16 @@ int query_rename(MYSQL *mysql, const char *from, const char *to)
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
     ret = mysql_query(mysql, sql);
+
+    tmp = strdup(from);
+    dcache_invalidate(parent_from, basename(tmp));
+    free(tmp);
+    tmp = strdup(to);
+    dcache_invalidate(parent_to, basename(tmp));
+    free(tmp);
+    pool_written(parent_from);
+    pool_written(parent_to);
+
     if(ret){
         log_printf(LOG_ERROR, "Error: mysql_query()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
@@ -1251,7 +2298,8 @@ int query_inuse_inc(MYSQL *mysql, long inode, int increment)
 
 /**
  * Purge inodes from files previously marked deleted (ie query_set_deleted() )
- * and are no longer in-use.  Called by mysqlfs_unlink() and mysqlfs_release()
+ * and are no longer in-use.  Called by the garbage collector once
+ * query_gc_blocks() removed the data blocks, or by gc_purge() right away.
  *
  * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
  * @param mysql handle to the database
@@ -1260,27 +2308,63 @@ int query_inuse_inc(MYSQL *mysql, long inode, int increment)
 int query_purge_deleted(MYSQL *mysql, long inode)
 {
     int ret;
+    my_ulonglong purged = 0;
     char sql[SQL_MAX];
 
-    snprintf(sql, SQL_MAX,
-	     "DELETE FROM %s WHERE inode=%ld AND inuse=0 AND deleted=1",
-             tables->inodes, inode);
-
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
+    /*
+     * The data blocks go first, rather than through the foreign key
+     * cascade, which doesn't fire the triggers dropping the references to
+     * deduplicated payloads.
+     */
+    ret = mysql_query(mysql, "BEGIN");
+    if (!pool_shards()) {
+	snprintf(sql, SQL_MAX,
+		 "DELETE FROM %s WHERE inode=%ld AND EXISTS "
+		 "(SELECT inode FROM %s WHERE inode=%ld AND inuse=0 AND deleted=1)",
+		 tables->data_blocks, inode, tables->inodes, inode);
+	log_printf(LOG_D_SQL, "sql=%s\n", sql);
+	ret = mysql_query(mysql, sql);
+    }
+
+    if (!ret) {
+	snprintf(sql, SQL_MAX,
+		 "DELETE FROM %s WHERE inode=%ld AND inuse=0 AND deleted=1",
+		 tables->inodes, inode);
+	log_printf(LOG_D_SQL, "sql=%s\n", sql);
+	ret = mysql_query(mysql, sql);
+	if (!ret)
+	    purged = mysql_affected_rows(mysql);	/* not the COMMIT's */
+    }
     if(ret){
         log_printf(LOG_ERROR, "Error: mysql_query()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        mysql_query(mysql, "ROLLBACK");
         return -EIO;
     }
+    mysql_query(mysql, "COMMIT");
+
+    /* The foreign key only cascades to data blocks on the same server. */
+    if (pool_shards() && purged > 0) {
+	MYSQL *shard = data_conn(mysql, inode);
+
+	if (!shard)
+	    return -EMFILE;
+	snprintf(sql, SQL_MAX, "DELETE FROM %s WHERE inode=%ld", tables->data_blocks, inode);
+	log_printf(LOG_D_SQL, "sql=%s\n", sql);
+	ret = mysql_query(shard, sql);
+	if (ret)
+	    log_printf(LOG_ERROR, "mysql_error (shard): %s\n", mysql_error(shard));
+	data_conn_put(mysql, shard);
+	if (ret)
+	    return -EIO;
+    }
 
     return 0;
 }
 
 /**
- * Mark the inode deleted where the name of the tree column is NULL.  This
- * allows files that are still in use to be deleted without wiping out their
+ * Mark the inode deleted once no directory entry is left (its nlink is
+ * 0).  This allows files that are still in use to be deleted without wiping out their
  * underlying data.
  *
  * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
@@ -1293,10 +2377,8 @@ int query_set_deleted(MYSQL *mysql, long inode)
     char sql[SQL_MAX];
 
     snprintf(sql, SQL_MAX,
-	     "UPDATE %s i LEFT JOIN %s t ON i.inode = t.inode SET i.deleted=1 "
-	     "WHERE i.inode = %ld AND t.name IS NULL",
-             tables->inodes, tables->tree,
-             inode);
+	     "UPDATE %s SET deleted=1 WHERE inode = %ld AND nlink = 0",
+             tables->inodes, inode);
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
@@ -1311,201 +2393,795 @@ int query_set_deleted(MYSQL *mysql, long inode)
 }
 
 /**
- * Clean filesystem.  Only run in pool_check_mysql_setup() if mysqlfs_opt::fsck == 1
- *
- * -# delete inodes with deleted==1
- * -# delete direntries without corresponding inode
- * -# set inuse=0 for all inodes
- * -# delete data without existing inode
- * -# synchronize inodes.size=data.LENGTH(data)
- * -# recalculate statistics table
- * -# optimize tables
+ * List inodes waiting for the garbage collector: marked deleted by
+ * query_set_deleted(), and no longer open.
  *
- * @return return from call to mysql_query()
- * @param mysql handle to database connection
+ * @return number of inodes stored in inodes, < 0 on error
+ * @param mysql handle to the database
+ * @param inodes where to store the inode numbers
+ * @param max room in inodes
  */
-int query_fsck(MYSQL *mysql)
+int query_gc_list(MYSQL *mysql, long *inodes, int max)
 {
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int count = 0;
 
-    /*
-     query_fsck by florian wiessner (f.wiessner@smart-weblications.de)
-    */
-    printf("Starting fsck\n");
+    snprintf(sql, SQL_MAX,
+	     "SELECT inode FROM %s WHERE deleted=1 AND inuse=0 LIMIT %d",
+	     tables->inodes, max);
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql) || !(result = mysql_store_result(mysql))) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	return -EIO;
+    }
+    while (count < max && (row = mysql_fetch_row(result)) != NULL)
+	inodes[count++] = atol(row[0]);
+    mysql_free_result(result);
 
-    // 1. delete inodes with deleted==1
-    int ret;
-//    int ret2;
-    int result;
+    return count;
+}
+
+/**
+ * Delete up to max data blocks of an inode marked deleted and no longer
+ * open, in a transaction of its own, so that large files are removed
+ * without holding locks and undo for long.
+ *
+ * @return number of blocks deleted, 0 once there are none left, < 0 on error
+ * @param mysql handle to the database
+ * @param inode inode listed by query_gc_list()
+ * @param max most blocks to delete
+ */
+long query_gc_blocks(MYSQL *mysql, long inode, unsigned int max)
+{
     char sql[SQL_MAX];
-    printf("Stage 1...\n");
-    snprintf(sql, SQL_MAX,
-             "DELETE from %s WHERE deleted = 1", tables->inodes);
+    MYSQL *data;
+    long ret;
 
+    if (!(data = data_conn(mysql, inode)))
+	return -EMFILE;
+
+    /* The inode can't be checked on a shard, query_gc_list() just did. */
+    if (data == mysql)
+	snprintf(sql, SQL_MAX,
+		 "DELETE FROM %s WHERE inode=%ld AND EXISTS "
+		 "(SELECT inode FROM %s WHERE inode=%ld AND inuse=0 AND deleted=1) LIMIT %u",
+		 tables->data_blocks, inode, tables->inodes, inode, max);
+    else
+	snprintf(sql, SQL_MAX, "DELETE FROM %s WHERE inode=%ld LIMIT %u",
+		 tables->data_blocks, inode, max);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(data, sql)) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(data));
+	ret = -EIO;
+    } else {
+	ret = mysql_affected_rows(data);
+    }
+    data_conn_put(mysql, data);
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    return ret;
+}
+
+/*
+ * fsck, driven by fsck.c.  The checks work on ranges of inode numbers, with
+ * one set-based statement per check, so that each range holds its locks
+ * for a short while and several ranges can be checked at once.
+ */
+
+/** Run a statement of fsck: 0 on success, -EIO on error */
+static int fsck_exec(MYSQL *mysql, const char *sql)
+{
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	return -EIO;
     }
-    // 2. - delete direntries without corresponding inode
-    printf("Stage 2...\n");
-    snprintf(sql, SQL_MAX, "delete from %s where inode not in (select inode from %s);", tables->tree, tables->inodes);
+
+    return 0;
+}
+
+/** Run a statement returning a single number into *value (0 if NULL): 0 on success, -EIO on error */
+static int fsck_number(MYSQL *mysql, const char *sql, long long *value)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
+    if (mysql_query(mysql, sql) || !(result = mysql_store_result(mysql))) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	return -EIO;
+    }
+    row = mysql_fetch_row(result);
+    *value = row && row[0] ? atoll(row[0]) : 0;
+    mysql_free_result(result);
 
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    return 0;
+}
+
+/**
+ * Add an item to a statement built in sql, which starts with head.  The
+ * statement is closed with tail and run first if the item doesn't fit.
+ * Call with a NULL item to run what is left.
+ *
+ * @return 0 on success, -EIO on error
+ */
+static int fsck_batch(MYSQL *mysql, char *sql, size_t *len, size_t head,
+		      const char *tail, const char *item)
+{
+    size_t tail_len = strlen(tail);
+    int ret = 0;
+
+    if (*len > head && (!item || *len + strlen(item) + tail_len >= SQL_MAX)) {
+	strcpy(sql + *len, tail);
+	ret = fsck_exec(mysql, sql);
+	*len = head;
     }
+    if (item)
+	*len += snprintf(sql + *len, SQL_MAX - *len, "%s", item);
 
+    return ret;
+}
 
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
 
-    // 3. set inuse=0 for all inodes
-    printf("Stage 3...\n");
-    snprintf(sql, SQL_MAX, "UPDATE %s SET inuse=0;", tables->inodes);
+    return x < y ? -1 : x > y;
+}
 
+/**
+ * fsck of a range, on one shard: delete the data blocks of inodes that are
+ * gone, and size the other inodes from their blocks.  The inodes table is
+ * on another server, so the two are matched here.
+ *
+ * @return 0 on success, -EIO on error
+ * @param mysql handle to connection to the database
+ * @param shard handle to connection to the shard
+ * @param first first inode of the range
+ * @param last last inode of the range
+ * @param inodes the inodes of the range, sorted
+ * @param count number of inodes
+ */
+static int fsck_shard_range(MYSQL *mysql, MYSQL *shard, long first, long last,
+			    const long *inodes, size_t count)
+{
+    char sql[SQL_MAX], del[SQL_MAX], upd[SQL_MAX], item[64];
+    size_t del_len, del_head, upd_len, upd_head;
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    long inode;
+    int ret = 0;
+
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s SET datalength = OCTET_LENGTH(data) WHERE inode BETWEEN %ld AND %ld "
+	     "AND codec = 0 AND hash IS NULL AND datalength <> OCTET_LENGTH(data)",
+	     tables->data_blocks, first, last);
+    if (fsck_exec(shard, sql) < 0)
+	return -EIO;
+
+    snprintf(sql, SQL_MAX,
+	     "SELECT inode, SUM(datalength) FROM %s WHERE inode BETWEEN %ld AND %ld GROUP BY inode",
+	     tables->data_blocks, first, last);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(shard, sql) || !(result = mysql_store_result(shard))) {
+	log_printf(LOG_ERROR, "mysql_error (shard): %s\n", mysql_error(shard));
+	return -EIO;
+    }
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    /* Inode 0 never exists: it starts both lists. */
+    del_len = del_head = snprintf(del, SQL_MAX, "DELETE FROM %s WHERE inode IN (0",
+				  tables->data_blocks);
+    upd_len = upd_head = snprintf(upd, SQL_MAX,
+				  "UPDATE %s i JOIN (SELECT 0 AS inode, 0 AS size", tables->inodes);
+    while (ret == 0 && (row = mysql_fetch_row(result)) != NULL) {
+	inode = atol(row[0]);
+	if (!bsearch(&inode, inodes, count, sizeof(long), cmp_long)) {
+	    snprintf(item, sizeof(item), ", %ld", inode);
+	    ret = fsck_batch(shard, del, &del_len, del_head, ")", item);
+	} else {
+	    snprintf(item, sizeof(item), " UNION ALL SELECT %ld, %s", inode, row[1] ? row[1] : "0");
+	    ret = fsck_batch(mysql, upd, &upd_len, upd_head,
+			     ") d ON d.inode = i.inode SET i.size = d.size WHERE i.size <> d.size", item);
+	}
     }
+    mysql_free_result(result);
+    if (ret == 0)
+	ret = fsck_batch(shard, del, &del_len, del_head, ")", NULL);
+    if (ret == 0)
+	ret = fsck_batch(mysql, upd, &upd_len, upd_head,
+			 ") d ON d.inode = i.inode SET i.size = d.size WHERE i.size <> d.size", NULL);
 
+    return ret;
+}
+
+/**
+ * Check and repair the inodes numbered first to last, and what hangs off
+ * them:
+ *
+ * -# delete inodes with deleted==1
+ * -# delete direntries without corresponding inode
+ * -# set inuse=0, and recount the links
+ * -# delete data without existing inode
+ * -# resync datalength, and inodes.size with the data
+ *
+ * Ranges are independent of each other, and may be checked in parallel.
+ *
+ * @return 0 on success, -EIO on error
+ * @param mysql handle to connection to the database
+ * @param first first inode of the range
+ * @param last last inode of the range
+ */
+int query_fsck_range(MYSQL *mysql, long first, long last)
+{
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    MYSQL *shard;
+    long *inodes;
+    size_t count = 0;
+    unsigned int i;
+    int ret;
+
+    snprintf(sql, SQL_MAX, "DELETE FROM %s WHERE inode BETWEEN %ld AND %ld AND deleted = 1",
+	     tables->inodes, first, last);
+    if (fsck_exec(mysql, sql) < 0)
+	return -EIO;
+
+    snprintf(sql, SQL_MAX,
+	     "DELETE t FROM %s t LEFT JOIN %s i ON i.inode = t.inode "
+	     "WHERE t.inode BETWEEN %ld AND %ld AND i.inode IS NULL",
+	     tables->tree, tables->inodes, first, last);
+    if (fsck_exec(mysql, sql) < 0)
+	return -EIO;
+
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s i LEFT JOIN (SELECT inode, COUNT(*) AS n FROM %s "
+	     "WHERE inode BETWEEN %ld AND %ld GROUP BY inode) t ON t.inode = i.inode "
+	     "SET i.inuse = 0, i.nlink = IFNULL(t.n, 0) "
+	     "WHERE i.inode BETWEEN %ld AND %ld AND (i.inuse <> 0 OR i.nlink <> IFNULL(t.n, 0))",
+	     tables->inodes, tables->tree, first, last, first, last);
+    if (fsck_exec(mysql, sql) < 0)
+	return -EIO;
 
-    // 4. delete data without existing inode
-    printf("Stage 4...\n");
-    snprintf(sql, SQL_MAX, "delete from %s where inode not in (select inode from %s);", tables->data_blocks, tables->inodes);
+    /* Inline data is the whole of a file without data blocks */
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s SET size = OCTET_LENGTH(inline_data) WHERE inode BETWEEN %ld AND %ld "
+	     "AND inline_data IS NOT NULL AND size <> OCTET_LENGTH(inline_data)",
+	     tables->inodes, first, last);
+    if (fsck_exec(mysql, sql) < 0)
+	return -EIO;
 
+    if (!pool_shards()) {
+	snprintf(sql, SQL_MAX,
+		 "DELETE d FROM %s d LEFT JOIN %s i ON i.inode = d.inode "
+		 "WHERE d.inode BETWEEN %ld AND %ld AND i.inode IS NULL",
+		 tables->data_blocks, tables->inodes, first, last);
+	if (fsck_exec(mysql, sql) < 0)
+	    return -EIO;
+
+	snprintf(sql, SQL_MAX,
+		 "UPDATE %s SET datalength = OCTET_LENGTH(data) WHERE inode BETWEEN %ld AND %ld "
+		 "AND codec = 0 AND hash IS NULL AND datalength <> OCTET_LENGTH(data)",
+		 tables->data_blocks, first, last);
+	if (fsck_exec(mysql, sql) < 0)
+	    return -EIO;
+
+	snprintf(sql, SQL_MAX,
+		 "UPDATE %s i JOIN (SELECT inode, SUM(datalength) AS size FROM %s "
+		 "WHERE inode BETWEEN %ld AND %ld GROUP BY inode) d ON d.inode = i.inode "
+		 "SET i.size = d.size + IFNULL(OCTET_LENGTH(i.inline_data), 0) "
+		 "WHERE i.size <> d.size + IFNULL(OCTET_LENGTH(i.inline_data), 0)",
+		 tables->inodes, tables->data_blocks, first, last);
+	return fsck_exec(mysql, sql);
+    }
+
+    /* Sharded: the inodes of the range, to be matched with the data blocks of each shard */
+    snprintf(sql, SQL_MAX, "SELECT inode FROM %s WHERE inode BETWEEN %ld AND %ld ORDER BY inode",
+	     tables->inodes, first, last);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql) || !(result = mysql_store_result(mysql))) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	return -EIO;
+    }
+    inodes = malloc((mysql_num_rows(result) + 1) * sizeof(long));
+    if (!inodes) {
+	mysql_free_result(result);
+	return -ENOMEM;
+    }
+    while ((row = mysql_fetch_row(result)) != NULL)
+	inodes[count++] = atol(row[0]);
+    mysql_free_result(result);
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    for (i = 0, ret = 0; ret == 0 && i < pool_shards(); i++) {
+	if (!(shard = pool_get_shard(i))) {
+	    ret = -EMFILE;
+	    break;
+	}
+	ret = fsck_shard_range(mysql, shard, first, last, inodes, count);
+	pool_put(shard);
     }
+    free(inodes);
 
+    return ret;
+}
 
-    // 5. synchronize inodes.size=data.LENGTH(data)
-    printf("Stage 5...\n");
-    long int inode;
-    long int size;
-    
-    printf("Stage 5... resync datablock length cache\n");
-    snprintf(sql, SQL_MAX, "UPDATE %s SET `datalength` = OCTET_LENGTH(`data`)", tables->data_blocks);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
-    
-    printf("Stage 5... recompute inode sizes\n");
-    snprintf(sql, SQL_MAX, "select inode, sum(datalength) as size from %s group by inode", tables->data_blocks);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
+/**
+ * Highest inode number in use anywhere: inodes, directory entries and data
+ * blocks, orphans included.  fsck checks the inodes from 1 up to it.
+ *
+ * @return the inode number, < 0 on error
+ * @param mysql handle to connection to the database
+ */
+long query_fsck_span(MYSQL *mysql)
+{
+    char sql[SQL_MAX];
+    long long max, data_max;
+    MYSQL *shard;
+    unsigned int i;
 
-    MYSQL_RES* myresult;
-    MYSQL_ROW row;
+    snprintf(sql, SQL_MAX,
+	     "SELECT GREATEST(IFNULL((SELECT MAX(inode) FROM %s), 0), "
+	     "IFNULL((SELECT MAX(inode) FROM %s), 0), IFNULL((SELECT MAX(inode) FROM %s), 0))",
+	     tables->inodes, tables->tree, tables->data_blocks);
+    if (fsck_number(mysql, sql, &max) < 0)
+	return -EIO;
 
-    myresult = mysql_store_result(mysql);
-    while ((row = mysql_fetch_row(myresult)) != NULL) {
-     inode = atol(row[0]);
-     size = atol(row[1]);
-                     
-      snprintf(sql, SQL_MAX, "update %s set size=%ld where inode=%ld;", tables->inodes, size, inode);
-      log_printf(LOG_D_SQL, "sql=%s\n", sql);
-      result = mysql_query(mysql, sql);
+    snprintf(sql, SQL_MAX, "SELECT MAX(inode) FROM %s", tables->data_blocks);
+    for (i = 0; i < pool_shards(); i++) {
+	if (!(shard = pool_get_shard(i)))
+	    return -EMFILE;
+	if (fsck_number(shard, sql, &data_max) < 0) {
+	    pool_put(shard);
+	    return -EIO;
+	}
+	pool_put(shard);
+	max = MAX(max, data_max);
+    }
 
-/*      if (myresult) { // something has gone wrong.. delete datablocks...
+    return max;
+}
 
-        snprintf(sql, SQL_MAX, "delete from %s where inode=%ld;", tables->inodes, inode);
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        ret2 = mysql_query(mysql, sql);
+/**
+ * Recount the references to the deduplicated payloads whose hash starts
+ * with the byte prefix, and delete those no longer used.  Deleting inodes
+ * cascades to their blocks without firing the triggers that maintain the
+ * counts.
+ *
+ * @return 0 on success, -EIO on error
+ * @param data handle to connection to the server holding the data blocks
+ * @param prefix first byte of the hashes, 0 to 255
+ */
+int query_fsck_blobs(MYSQL *data, unsigned int prefix)
+{
+    char sql[SQL_MAX], range[64];
+
+    if (prefix < 255)
+	snprintf(range, sizeof(range), "hash >= X'%02x' AND hash < X'%02x'", prefix, prefix + 1);
+    else
+	snprintf(range, sizeof(range), "hash >= X'%02x'", prefix);
 
-      }
-*/ // skip this for now!
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s b LEFT JOIN (SELECT hash, COUNT(*) AS n FROM %s WHERE %s GROUP BY hash) d "
+	     "ON d.hash = b.hash SET b.refs = IFNULL(d.n, 0) "
+	     "WHERE b.%s AND b.refs <> IFNULL(d.n, 0)",
+	     tables->data_blobs, tables->data_blocks, range, range);
+    if (fsck_exec(data, sql) < 0)
+	return -EIO;
 
-    }
+    snprintf(sql, SQL_MAX, "DELETE FROM %s WHERE %s AND refs = 0", tables->data_blobs, range);
+    return fsck_exec(data, sql);
+}
 
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-       return -EIO;
+/**
+ * Recompute the statistics table.  The totals are read first, so that
+ * the inodes table isn't locked while the statistics are updated.  They
+ * go to slot 0, the other slots being reset.
+ *
+ * @return 0 on success, -EIO on error
+ * @param mysql handle to connection to the database
+ */
+int query_fsck_totals(MYSQL *mysql)
+{
+    char sql[SQL_MAX];
+    long long count, size;
+
+    snprintf(sql, SQL_MAX, "SELECT COUNT(*) FROM %s", tables->inodes);
+    if (fsck_number(mysql, sql, &count) < 0)
+	return -EIO;
+    snprintf(sql, SQL_MAX, "SELECT SUM(size) FROM %s", tables->inodes);
+    if (fsck_number(mysql, sql, &size) < 0)
+	return -EIO;
+
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s SET value = IF(slot = 0, %lld, 0) WHERE `key` = 'total_inodes_count'",
+	     tables->statistics, count);
+    if (fsck_exec(mysql, sql) < 0)
+	return -EIO;
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s SET value = IF(slot = 0, %lld, 0) WHERE `key` = 'total_inodes_size'",
+	     tables->statistics, size);
+    return fsck_exec(mysql, sql);
+}
+
+/**
+ * Optimize the inodes and tree tables, i.e. rebuild them to reclaim the
+ * room of deleted rows.
+ *
+ * @return 0 on success, -EIO on error
+ * @param mysql handle to connection to the database
+ */
+int query_fsck_optimize(MYSQL *mysql)
+{
+    char sql[SQL_MAX];
+    const char *table[2] = { tables->inodes, tables->tree };
+    MYSQL_RES *myresult;
+    int i, ret = 0;
+
+    for (i = 0; i < 2; i++) {
+	snprintf(sql, SQL_MAX, "OPTIMIZE TABLE %s", table[i]);
+	if (fsck_exec(mysql, sql) < 0)
+	    ret = -EIO;
+
+	myresult = mysql_store_result(mysql);
+	mysql_free_result(myresult);
+
+	// flush any pending result from previous queries
+	for(; mysql_next_result(mysql) == 0;)
+	    /* do nothing */;
     }
-    mysql_free_result(myresult);
 
-    // 6. Recalculate statistics tables
-    printf("Stage 6...\n");
+    return ret;
+}
+
+/**
+ * Read a value of SW_DETAILS, whose key is prefixed with the table prefix.
+ *
+ * @return 0 if found, -ENOENT if not, -EIO on error
+ */
+static int sw_details_get(MYSQL *mysql, const char *key, char *value, size_t len)
+{
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int ret = -ENOENT;
 
-    printf("Stage 6... recompute total files count\n");
-    snprintf(sql, SQL_MAX, "UPDATE %s SET %s.value = (SELECT COUNT(*) FROM %s) WHERE %s.key = 'total_inodes_count'", tables->statistics, tables->statistics, tables->inodes, tables->statistics);
+    snprintf(sql, SQL_MAX, "SELECT `VALUE` FROM SW_DETAILS WHERE `KEY`='%s%s'",
+	     tables->prefix, key);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    if (mysql_query(mysql, sql) || !(result = mysql_store_result(mysql))) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	return -EIO;
     }
+    if ((row = mysql_fetch_row(result)) != NULL && row[0]) {
+	snprintf(value, len, "%s", row[0]);
+	ret = 0;
+    }
+    mysql_free_result(result);
+
+    return ret;
+}
+
+/**
+ * Set a value of SW_DETAILS, see sw_details_get(); a NULL value deletes it.
+ *
+ * @return 0 on success, -EIO on error
+ */
+static int sw_details_set(MYSQL *mysql, const char *key, const char *value)
+{
+    char sql[SQL_MAX];
+
+    if (!value)
+	snprintf(sql, SQL_MAX, "DELETE FROM SW_DETAILS WHERE `KEY`='%s%s'", tables->prefix, key);
+    else
+	snprintf(sql, SQL_MAX, "REPLACE INTO SW_DETAILS SET `KEY`='%s%s', `VALUE`='%s'",
+		 tables->prefix, key, value);
+
+    return fsck_exec(mysql, sql);
+}
 
-    printf("Stage 6... recompute total files size\n");
-    snprintf(sql, SQL_MAX, "UPDATE %s SET %s.value = (SELECT SUM(size) FROM %s) WHERE %s.key = 'total_inodes_size'", tables->statistics, tables->statistics, tables->inodes, tables->statistics);
+/**
+ * Where an interrupted fsck is to resume, as recorded in SW_DETAILS by
+ * query_fsck_set_resume().
+ *
+ * @return 0 if found, -ENOENT if fsck has nothing to resume, -EIO on error
+ * @param mysql handle to connection to the database
+ * @param pass set to the pass to resume
+ * @param position set to where to resume the pass
+ */
+int query_fsck_get_resume(MYSQL *mysql, int *pass, long *position)
+{
+    char value[64];
+    int ret;
+
+    ret = sw_details_get(mysql, "FSCK_RESUME", value, sizeof(value));
+    if (ret == 0 && sscanf(value, "%d %ld", pass, position) != 2)
+	ret = -ENOENT;
+
+    return ret;
+}
+
+/**
+ * Record where fsck is to resume if interrupted: everything before
+ * position in pass is done.
+ *
+ * @return 0 on success, -EIO on error
+ * @param mysql handle to connection to the database
+ * @param pass current pass, < 0 once fsck is complete
+ * @param position where to resume the pass
+ */
+int query_fsck_set_resume(MYSQL *mysql, int pass, long position)
+{
+    char value[64];
+
+    if (pass < 0)
+	return sw_details_set(mysql, "FSCK_RESUME", NULL);
+
+    snprintf(value, sizeof(value), "%d %ld", pass, position);
+    return sw_details_set(mysql, "FSCK_RESUME", value);
+}
+
+/*
+ * Scrubbing, driven by scrub.c: fsck checks that are safe while mounted,
+ * one range of inodes at a time.  Files in use are left alone, and every
+ * repair is a compare-and-set on what was found broken.
+ */
+
+/** An inode of a range being scrubbed */
+struct scrub_inode {
+    long		inode;
+    long long		size;
+    long long		inline_len;	/**< length of the inline data */
+    int			inuse;
+};
+
+static int cmp_scrub_inode(const void *a, const void *b)
+{
+    long x = ((const struct scrub_inode *)a)->inode, y = ((const struct scrub_inode *)b)->inode;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Scrub the data blocks of a range on one server: delete the blocks of
+ * inodes that are gone, and grow the sizes that don't cover their blocks,
+ * which is what a crash between the data and the size of a write leaves.
+ * Sizes beyond the blocks are holes, and fine.
+ *
+ * @return number of problems repaired, < 0 on error
+ * @param mysql handle to connection to the database
+ * @param data handle to connection to the server holding the data blocks
+ * @param first first inode of the range
+ * @param last last inode of the range
+ */
+static int scrub_data(MYSQL *mysql, MYSQL *data, long first, long last)
+{
+    char sql[SQL_MAX];
+    MYSQL_RES *sums, *result;
+    MYSQL_ROW row;
+    struct scrub_inode *inodes, key, *found;
+    size_t count = 0;
+    long long want;
+    int repaired = 0, ret = 0;
+
+    /* The blocks first: an inode created meanwhile shows up in the inodes below. */
+    snprintf(sql, SQL_MAX,
+	     "SELECT inode, SUM(datalength) FROM %s WHERE inode BETWEEN %ld AND %ld GROUP BY inode",
+	     tables->data_blocks, first, last);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    if (mysql_query(data, sql) || !(sums = mysql_store_result(data))) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(data));
+	return -EIO;
+    }
+    if (!mysql_num_rows(sums)) {
+	mysql_free_result(sums);
+	return 0;
     }
 
-    // flush any pending result from previous queries
-    for(; mysql_next_result(mysql) == 0;)
-        /* do nothing */;
+    snprintf(sql, SQL_MAX,
+	     "SELECT inode, size, IFNULL(OCTET_LENGTH(inline_data), 0), inuse FROM %s "
+	     "WHERE inode BETWEEN %ld AND %ld ORDER BY inode",
+	     tables->inodes, first, last);
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql) || !(result = mysql_store_result(mysql))) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	mysql_free_result(sums);
+	return -EIO;
+    }
+    inodes = malloc((mysql_num_rows(result) + 1) * sizeof(struct scrub_inode));
+    if (!inodes) {
+	mysql_free_result(result);
+	mysql_free_result(sums);
+	return -ENOMEM;
+    }
+    while ((row = mysql_fetch_row(result)) != NULL) {
+	inodes[count].inode = atol(row[0]);
+	inodes[count].size = atoll(row[1]);
+	inodes[count].inline_len = atoll(row[2]);
+	inodes[count].inuse = atoi(row[3]);
+	count++;
+    }
+    mysql_free_result(result);
 
-    // 7. Optimize general tables
-    printf("Stage 7... optimizing tables\n");
+    while (ret == 0 && (row = mysql_fetch_row(sums)) != NULL) {
+	key.inode = atol(row[0]);
+	found = bsearch(&key, inodes, count, sizeof(struct scrub_inode), cmp_scrub_inode);
+
+	if (!found) {
+	    log_printf(LOG_INFO, "scrub: inode %ld is gone, deleting its data blocks\n", key.inode);
+	    snprintf(sql, SQL_MAX, "DELETE FROM %s WHERE inode=%ld", tables->data_blocks, key.inode);
+	    ret = fsck_exec(data, sql);
+	    bcache_invalidate(key.inode);
+	    repaired++;
+	    continue;
+	}
 
-    printf("Stage 7... optimizing inodes table\n");
-    snprintf(sql, SQL_MAX, "OPTIMIZE TABLE %s", tables->inodes);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+	want = (row[1] ? atoll(row[1]) : 0) + found->inline_len;
+	if (found->inuse || found->size >= want)
+	    continue;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+	log_printf(LOG_INFO, "scrub: inode %ld is %lld bytes long, its data %lld, growing it\n",
+		   key.inode, found->size, want);
+	snprintf(sql, SQL_MAX,
+		 "UPDATE %s SET size=%lld WHERE inode=%ld AND size=%lld AND inuse=0",
+		 tables->inodes, want, key.inode, found->size);
+	ret = fsck_exec(mysql, sql);
+	icache_invalidate(key.inode);
+	repaired++;
     }
+    mysql_free_result(sums);
+    free(inodes);
 
-    myresult = mysql_store_result(mysql);
-    mysql_free_result(myresult);
+    return ret < 0 ? ret : repaired;
+}
 
-    // flush any pending result from previous queries
-    for(; mysql_next_result(mysql) == 0;)
-        /* do nothing */;
+/**
+ * Scrub the inodes numbered first to last while the filesystem is in use:
+ * remove directory entries leading to missing inodes, delete the data
+ * blocks of missing inodes, and fix sizes that don't cover the data of
+ * files not in use.  Every problem is logged.
+ *
+ * @return number of problems repaired, < 0 on error
+ * @param mysql handle to connection to the database
+ * @param first first inode of the range
+ * @param last last inode of the range
+ */
+int query_scrub_range(MYSQL *mysql, long first, long last)
+{
+    char sql[SQL_MAX], esc_name[PATH_MAX * 2];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    MYSQL *shard;
+    unsigned int i;
+    int ret = 0, repaired = 0;
 
-    printf("Stage 7... optimizing tree table\n");
-    snprintf(sql, SQL_MAX, "OPTIMIZE TABLE %s", tables->tree);
+    /* query_mknod() creates the entry and the inode in one transaction */
+    snprintf(sql, SQL_MAX,
+	     "SELECT t.parent, t.name, t.inode FROM %s t LEFT JOIN %s i ON i.inode = t.inode "
+	     "WHERE t.inode BETWEEN %ld AND %ld AND t.parent IS NOT NULL AND i.inode IS NULL",
+	     tables->tree, tables->inodes, first, last);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    if (mysql_query(mysql, sql) || !(result = mysql_store_result(mysql))) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	return -EIO;
+    }
+    while (ret == 0 && (row = mysql_fetch_row(result)) != NULL) {
+	log_printf(LOG_INFO, "scrub: entry '%s' of directory %s leads to missing inode %s, removing it\n",
+		   row[1], row[0], row[2]);
+	mysql_real_escape_string(mysql, esc_name, row[1], strlen(row[1]));
+	snprintf(sql, SQL_MAX,
+		 "DELETE t FROM %s t LEFT JOIN %s i ON i.inode = t.inode "
+		 "WHERE t.parent=%s AND t.name='%s' AND t.inode=%s AND i.inode IS NULL",
+		 tables->tree, tables->inodes, row[0], esc_name, row[2]);
+	ret = fsck_exec(mysql, sql);
+	dcache_invalidate(atol(row[0]), row[1]);
+	repaired++;
     }
+    mysql_free_result(result);
+    if (ret < 0)
+	return ret;
+
+    if (!pool_shards())
+	ret = scrub_data(mysql, mysql, first, last);
+    for (i = 0; i < pool_shards(); i++) {
+	if (!(shard = pool_get_shard(i)))
+	    return -EMFILE;
+	ret = scrub_data(mysql, shard, first, last);
+	pool_put(shard);
+	if (ret < 0)
+	    break;
+	repaired += ret;
+	ret = 0;
+    }
+    if (ret < 0)
+	return ret;
 
-    myresult = mysql_store_result(mysql);
-    mysql_free_result(myresult);
+    return repaired + ret;
+}
 
-    // flush any pending result from previous queries
-    for(; mysql_next_result(mysql) == 0;)
-        /* do nothing */;
+/**
+ * Check the statistics table against the inodes, repairing any drift.
+ * Both are read in the same snapshot, and the difference is added to the
+ * statistics, so that the changes made since the snapshot are kept.
+ *
+ * @return 1 if the statistics drifted, 0 if not, < 0 on error
+ * @param mysql handle to connection to the database
+ */
+int query_scrub_totals(MYSQL *mysql)
+{
+    char sql[SQL_MAX];
+    long long count, size, stat_count, stat_size;
+    int ret = 0;
 
-    printf("fsck done!\n");
-    return ret;
+    if (fsck_exec(mysql, "START TRANSACTION WITH CONSISTENT SNAPSHOT") < 0)
+	return -EIO;
+
+    snprintf(sql, SQL_MAX, "SELECT COUNT(*) FROM %s", tables->inodes);
+    if (fsck_number(mysql, sql, &count) < 0)
+	ret = -EIO;
+    snprintf(sql, SQL_MAX, "SELECT SUM(size) FROM %s", tables->inodes);
+    if (!ret && fsck_number(mysql, sql, &size) < 0)
+	ret = -EIO;
+    snprintf(sql, SQL_MAX, "SELECT SUM(CAST(value AS SIGNED)) FROM %s WHERE `key` = 'total_inodes_count'",
+	     tables->statistics);
+    if (!ret && fsck_number(mysql, sql, &stat_count) < 0)
+	ret = -EIO;
+    snprintf(sql, SQL_MAX, "SELECT SUM(CAST(value AS SIGNED)) FROM %s WHERE `key` = 'total_inodes_size'",
+	     tables->statistics);
+    if (!ret && fsck_number(mysql, sql, &stat_size) < 0)
+	ret = -EIO;
+
+    mysql_query(mysql, "COMMIT");
+    if (ret < 0 || (count == stat_count && size == stat_size))
+	return ret;
+
+    log_printf(LOG_INFO, "scrub: statistics say %lld inodes and %lld bytes, there are %lld and %lld\n",
+	       stat_count, stat_size, count, size);
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s SET value = value + %lld WHERE `key` = 'total_inodes_count' AND slot = 0",
+	     tables->statistics, count - stat_count);
+    if (fsck_exec(mysql, sql) < 0)
+	return -EIO;
+    snprintf(sql, SQL_MAX,
+	     "UPDATE %s SET value = value + %lld WHERE `key` = 'total_inodes_size' AND slot = 0",
+	     tables->statistics, size - stat_size);
+    if (fsck_exec(mysql, sql) < 0)
+	return -EIO;
 
+    return 1;
+}
+
+/**
+ * Where the scrubber is to go on, as recorded in SW_DETAILS.
+ *
+ * @return the first inode not scrubbed yet in this round, 1 if unknown
+ * @param mysql handle to connection to the database
+ */
+long query_scrub_get_position(MYSQL *mysql)
+{
+    char value[64];
+    long position;
+
+    if (sw_details_get(mysql, "SCRUB_NEXT", value, sizeof(value)) < 0 ||
+	(position = atol(value)) < 1)
+	return 1;
+
+    return position;
+}
+
+/**
+ * Record where the scrubber is to go on, for the next mount.
+ *
+ * @return 0 on success, -EIO on error
+ * @param mysql handle to connection to the database
+ * @param position first inode not scrubbed yet in this round
+ */
+int query_scrub_set_position(MYSQL *mysql, long position)
+{
+    char value[64];
+
+    snprintf(value, sizeof(value), "%ld", position);
+    return sw_details_set(mysql, "SCRUB_NEXT", value);
 }
 
 
@@ -1526,7 +3202,8 @@ fsfilcnt_t query_total_inodes(MYSQL *mysql)
     MYSQL_ROW row;
     fsfilcnt_t inodes;
 
-    snprintf(sql, SQL_MAX, "SELECT CAST(%s.value AS UNSIGNED) FROM %s WHERE %s.key = 'total_inodes_count'", tables->statistics, tables->statistics, tables->statistics);
+    /* The counters are striped over slots, see sql/updates/00000016.sql */
+    snprintf(sql, SQL_MAX, "SELECT SUM(CAST(%s.value AS SIGNED)) FROM %s WHERE %s.key = 'total_inodes_count'", tables->statistics, tables->statistics, tables->statistics);
 
     ret = mysql_query(mysql, sql);
     if(ret){
@@ -1576,7 +3253,7 @@ fsblkcnt_t query_total_blocks(MYSQL *mysql)
     MYSQL_ROW row;
     fsblkcnt_t blocks;
 
-    snprintf(sql, SQL_MAX, "SELECT CEIL(CAST(%s.value AS UNSIGNED)/%d) from %s WHERE %s.key = 'total_inodes_size'", tables->statistics, DATA_BLOCK_SIZE, tables->statistics, tables->statistics);
+    snprintf(sql, SQL_MAX, "SELECT CEIL(SUM(CAST(%s.value AS SIGNED))/%lu) from %s WHERE %s.key = 'total_inodes_size'", tables->statistics, data_block_size, tables->statistics, tables->statistics);
 
     ret = mysql_query(mysql, sql);
     if(ret){
@@ -1612,6 +3289,198 @@ fsblkcnt_t query_total_blocks(MYSQL *mysql)
     return blocks;
 }
 
+/**
+ * Add the free room of the InnoDB tablespaces matching where, as listed
+ * in information_schema.FILES, to *free: their free extents, plus what
+ * they may still grow by up to their maximum size.  *unbounded is set if
+ * one of them has no maximum size.
+ *
+ * @return number of tablespaces found, < 0 on error
+ */
+static int free_room_files(MYSQL *data, const char *where, long long *free, int *unbounded)
+{
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int ret = 0;
+
+    snprintf(sql, SQL_MAX,
+	     "SELECT COUNT(*), IFNULL(SUM(FREE_EXTENTS * EXTENT_SIZE), 0), "
+	     "IFNULL(SUM(GREATEST(CAST(MAXIMUM_SIZE AS SIGNED) - "
+	     "CAST(TOTAL_EXTENTS * EXTENT_SIZE AS SIGNED), 0)), 0), "
+	     "IFNULL(SUM(MAXIMUM_SIZE IS NULL), 0) "
+	     "FROM information_schema.FILES WHERE ENGINE = 'InnoDB' AND %s", where);
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(data, sql) || !(result = mysql_store_result(data))) {
+	log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(data));
+	return -EIO;
+    }
+    if ((row = mysql_fetch_row(result)) != NULL && (ret = atoi(row[0])) > 0) {
+	*free += atoll(row[1]) + atoll(row[2]);
+	if (atoll(row[3]))
+	    *unbounded = 1;
+    }
+    mysql_free_result(result);
+
+    return ret;
+}
+
+/**
+ * Add the free room for the data tables of one server to *free, see
+ * query_free_bytes().  Their own tablespaces are looked for first, then
+ * the system tablespace; servers without InnoDB tablespaces in
+ * information_schema.FILES (MariaDB) only tell the DATA_FREE of the
+ * tables, and may grow without bounds.
+ *
+ * @return 0 on success, < 0 on error
+ */
+static int free_room(MYSQL *data, long long *free, int *unbounded)
+{
+    char sql[SQL_MAX];
+    long long data_free;
+    int ret;
+
+    snprintf(sql, SQL_MAX,
+	     "TABLESPACE_NAME IN (CONCAT(DATABASE(), '/%s'), CONCAT(DATABASE(), '/%s'))",
+	     tables->data_blocks, tables->data_blobs);
+    if ((ret = free_room_files(data, sql, free, unbounded)) != 0)
+	return ret < 0 ? ret : 0;
+    if ((ret = free_room_files(data, "TABLESPACE_NAME = 'innodb_system'", free, unbounded)) != 0)
+	return ret < 0 ? ret : 0;
+
+    snprintf(sql, SQL_MAX,
+	     "SELECT SUM(DATA_FREE) FROM information_schema.TABLES "
+	     "WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME IN ('%s', '%s')",
+	     tables->data_blocks, tables->data_blobs);
+    if (fsck_number(data, sql, &data_free) < 0)
+	return -EIO;
+    *free += data_free;
+    *unbounded = 1;
+
+    return 0;
+}
+
+/**
+ * Free room for the data tables, from the InnoDB tablespace figures of
+ * information_schema.  With shards, the data tables of every shard are
+ * counted.
+ *
+ * @return free bytes, < 0 on error
+ * @param mysql handle to connection to the database
+ * @param unbounded set if a tablespace can grow further, up to what the
+ * disks of the server hold, which it doesn't tell
+ */
+long long query_free_bytes(MYSQL *mysql, int *unbounded)
+{
+    long long total = 0;
+    MYSQL *shard;
+    unsigned int i;
+    int ret;
+
+    *unbounded = 0;
+    if (!pool_shards())
+	return (ret = free_room(mysql, &total, unbounded)) < 0 ? ret : total;
+
+    for (i = 0; i < pool_shards(); i++) {
+	if (!(shard = pool_get_shard(i)))
+	    return -EMFILE;
+	ret = free_room(shard, &total, unbounded);
+	pool_put(shard);
+	if (ret < 0)
+	    return ret;
+    }
+
+    return total;
+}
+
+/**
+ * Load the block size of the filesystem, the <prefix>BLOCK_SIZE entry of
+ * SW_DETAILS, into data_block_size.  It is chosen when the filesystem is
+ * created; filesystems without one were written with DATA_BLOCK_SIZE
+ * blocks, which gets recorded for them.
+ *
+ * @return 0 on success, -EINVAL if the recorded size is not supported
+ * @param mysql handle to connection to the database
+ */
+int query_block_size_init(MYSQL *mysql)
+{
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    unsigned long size = 0;
+
+    snprintf(sql, SQL_MAX, "SELECT `VALUE` FROM SW_DETAILS WHERE `KEY`='%sBLOCK_SIZE'",
+	     tables->prefix);
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+
+    if (mysql_query(mysql, sql) || !(result = mysql_store_result(mysql))) {
+	log_printf(LOG_INFO, "%s(): %s, assuming %lu byte blocks\n",
+		   __func__, mysql_error(mysql), data_block_size);
+	return 0;
+    }
+    if ((row = mysql_fetch_row(result)) != NULL && row[0])
+	size = strtoul(row[0], NULL, 10);
+    mysql_free_result(result);
+
+    if (!size) {
+	snprintf(sql, SQL_MAX, "INSERT IGNORE INTO SW_DETAILS SET `KEY`='%sBLOCK_SIZE', `VALUE`='%lu'",
+		 tables->prefix, data_block_size);
+	log_printf(LOG_D_SQL, "sql=%s\n", sql);
+	if (mysql_query(mysql, sql))
+	    log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+	size = data_block_size;
+    }
+
+    if (size < DATA_BLOCK_SIZE_MIN || size > DATA_BLOCK_SIZE_MAX) {
+	log_printf(LOG_ERROR, "Unsupported block size %lu, it must be between %u and %u\n",
+		   size, DATA_BLOCK_SIZE_MIN, DATA_BLOCK_SIZE_MAX);
+	return -EINVAL;
+    }
+
+    data_block_size = size;
+    log_printf(LOG_INFO, "block size: %lu bytes\n", data_block_size);
+
+    return 0;
+}
+
+/**
+ * Turn deduplication of the data blocks written from now on on or off.
+ * Blocks already stored stay as they are either way.
+ *
+ * @param enable non-zero to store the payloads in the data_blobs table
+ */
+void query_dedup_init(int enable)
+{
+    dedup = enable;
+    if (dedup)
+	log_printf(LOG_INFO, "deduplicating data blocks\n");
+}
+
+/**
+ * Set the largest file kept in its inodes row.  Block 0 of a file is kept
+ * in inodes.inline_data rather than in data_blocks while the file is no
+ * longer than max, so that a small file or a symlink costs a single row,
+ * and reading it a single primary key lookup.  New files start out inline,
+ * and go back to it when truncated to 0; they move to data_blocks as soon
+ * as they grow past max.  Reads look for inline data whatever max is, so
+ * it may change between mounts.  Not available with sharded data blocks,
+ * the inodes table being on another server.
+ *
+ * @param max largest inline file, in bytes (0 disables inline storage)
+ */
+void query_inline_init(unsigned int max)
+{
+    if (max > DATA_BLOCK_SIZE_MIN)
+	max = DATA_BLOCK_SIZE_MIN;
+    if (max && pool_shards()) {
+	log_printf(LOG_ERROR, "inline data isn't available with shards, ignored\n");
+	max = 0;
+    }
+    inline_max = max;
+    if (inline_max)
+	log_printf(LOG_INFO, "files up to %u bytes kept inline\n", inline_max);
+}
+
 /**
  * Tables' name initialization
  *
@@ -1625,9 +3494,11 @@ void query_tablename_init(char *prefix)
 
     int prefixlength = strlen(prefix);
     tables = malloc(sizeof(struct table_names));
+    tables->prefix = strdup(prefix);
     tables->inodes = malloc(prefixlength + 8);        // Remember the null!
     tables->tree = malloc(prefixlength + 5);
     tables->data_blocks = malloc(prefixlength + 12);
+    tables->data_blobs = malloc(prefixlength + 11);
     tables->statistics = malloc(prefixlength + 11);
     tables->xattr = malloc(prefixlength + 6);
     strcpy(tables->inodes, prefix);
@@ -1636,6 +3507,8 @@ void query_tablename_init(char *prefix)
     strcat(tables->tree, "tree");
     strcpy(tables->data_blocks, prefix);
     strcat(tables->data_blocks, "data_blocks");
+    strcpy(tables->data_blobs, prefix);
+    strcat(tables->data_blobs, "data_blobs");
     strcpy(tables->statistics, prefix);
     strcat(tables->statistics, "statistics");
     strcpy(tables->xattr, prefix);
@@ -1644,6 +3517,7 @@ void query_tablename_init(char *prefix)
     fprintf(stderr, " ** Tree table: %s\n", tables->tree);
     fprintf(stderr, " ** Inodes table: %s\n", tables->inodes);
     fprintf(stderr, " ** Data blocks table: %s\n", tables->data_blocks);
+    fprintf(stderr, " ** Data blobs table: %s\n", tables->data_blobs);
     fprintf(stderr, " ** Statistics table: %s\n", tables->statistics);
     fprintf(stderr, " ** xAttr table: %s\n", tables->xattr);
 
@@ -1672,6 +3546,7 @@ int query_rmxattr(MYSQL *mysql, const char *attr, long inode)
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
     ret = mysql_query(mysql, sql);
+    pool_written(inode);
     if(ret) {
       log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
       return -EIO;
@@ -1937,6 +3812,7 @@ if (mysql_stmt_execute(stmt)){
 }
 
 affected_rows= mysql_stmt_affected_rows(stmt);
+pool_written(inode);
 
 if (mysql_stmt_close(stmt)){
       log_printf(LOG_ERROR, "%s(): mysql_stmt_close error: %s\n", __func__,mysql_error(mysql));
@@ -26,9 +26,11 @@ struct data_blocks_info {
 };
 
 struct table_names {
+    char *prefix;               /**< table prefix, also used for the keys of SW_DETAILS */
     char *inodes;               /**< inodes table name */
     char *tree;                 /**< tree table name */
     char *data_blocks;          /**< data_blocks table name */
+    char *data_blobs;           /**< data_blobs table name */
     char *statistics;           /**< statistics table name */
     char *xattr;                /**< xattr table name */
 };
@@ -45,7 +47,12 @@ long query_mknod(MYSQL *mysql, const char *path, mode_t mode, dev_t rdev,
 long query_mkdir(MYSQL *mysql, const char* path, mode_t mode, long parent);
 int query_readdir(MYSQL *mysql, long inode, void *buf, fuse_fill_dir_t filler);
 int query_read(MYSQL *mysql, long inode, const char* buf, size_t size, off_t offset);
+int query_prefetch(MYSQL *mysql, long inode, unsigned long first, unsigned long last);
 int query_write(MYSQL *mysql, long inode, const char* buf, size_t size, off_t offset);
+int query_write_blocks(MYSQL *mysql, long inode, const unsigned long *seq,
+                       const char *const *data, unsigned int count);
+int query_write_data(MYSQL *mysql, long inode, const char* buf, size_t size, off_t offset);
+int query_extend_size(MYSQL *mysql, long inode, off_t size);
 int query_truncate(MYSQL *mysql, const char *path, off_t length);
 
 int query_symlink(MYSQL *mysql, const char* from, const char* to);	/**< NOT IMPLEMENTED NOR CALLED */
@@ -63,13 +70,29 @@ ssize_t query_size_block(MYSQL *mysql, long inode, unsigned long seq);
 int query_inuse_inc(MYSQL *mysql, long inode, int increment);
 int query_set_deleted(MYSQL *mysql, long inode);
 int query_purge_deleted(MYSQL *mysql, long inode);
+int query_gc_list(MYSQL *mysql, long *inodes, int max);
+long query_gc_blocks(MYSQL *mysql, long inode, unsigned int max);
 
-int query_fsck(MYSQL *mysql);
+int query_fsck_range(MYSQL *mysql, long first, long last);
+long query_fsck_span(MYSQL *mysql);
+int query_fsck_blobs(MYSQL *data, unsigned int prefix);
+int query_fsck_totals(MYSQL *mysql);
+int query_fsck_optimize(MYSQL *mysql);
+int query_fsck_get_resume(MYSQL *mysql, int *pass, long *position);
+int query_fsck_set_resume(MYSQL *mysql, int pass, long position);
+int query_scrub_range(MYSQL *mysql, long first, long last);
+int query_scrub_totals(MYSQL *mysql);
+long query_scrub_get_position(MYSQL *mysql);
+int query_scrub_set_position(MYSQL *mysql, long position);
 
 void query_tablename_init(char *prefix);
+int query_block_size_init(MYSQL *mysql);
+void query_dedup_init(int enable);
+void query_inline_init(unsigned int max);
 
 fsfilcnt_t query_total_inodes(MYSQL *mysql);
 fsblkcnt_t query_total_blocks(MYSQL *mysql);
+long long query_free_bytes(MYSQL *mysql, int *unbounded);
 
 /* xattr operations */
 int query_rmxattr(MYSQL *mysql, const char *name, long inode);
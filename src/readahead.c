@@ -0,0 +1,216 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fuse/fuse.h>
+
+#include <mysql/mysql.h>
+
+#include "mysqlfs.h"
+#include "fhandle.h"
+#include "readahead.h"
+#include "bcache.h"
+#include "query.h"
+#include "pool.h"
+#include "log.h"
+
+/*
+ * Sequential read-ahead, modelled on the kernel's.  A read starting where
+ * the previous read on the same handle ended is sequential; the first one
+ * opens a window of twice its own size, and every time the reader gets
+ * within half a window of the prefetched area, the next window is queued
+ * and the window doubles, up to the configured maximum.  Any other read
+ * closes the window.
+ *
+ * Prefetch requests go to a small queue served by RA_THREADS threads with
+ * their own database connections, which read the blocks into the block
+ * cache where query_read() finds them.  When the queue is full, requests
+ * are dropped: read-ahead must never slow down the reads themselves.
+ */
+
+#define RA_THREADS	2
+#define RA_QUEUE	64	/**< pending prefetch requests */
+#define RA_MIN_BLOCKS	4	/**< smallest read-ahead window */
+
+/** A range of blocks to prefetch */
+struct ra_request {
+    long		inode;
+    unsigned long	first,
+			last;
+};
+
+static unsigned int ra_max_blocks = 0;
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static struct ra_request ra_queue[RA_QUEUE];
+static unsigned int ra_head = 0, ra_count = 0;
+static pthread_t ra_threads[RA_THREADS];
+static int ra_nthreads = 0;
+static int ra_running = 0;
+
+/** Queue a prefetch request, unless the queue is full */
+static void ra_submit(long inode, unsigned long first, unsigned long last)
+{
+    struct ra_request *req;
+
+    pthread_mutex_lock(&ra_lock);
+    if (ra_running && ra_count < RA_QUEUE) {
+	req = &ra_queue[(ra_head + ra_count) % RA_QUEUE];
+	req->inode = inode;
+	req->first = first;
+	req->last = last;
+	ra_count++;
+	pthread_cond_signal(&ra_cond);
+    }
+    pthread_mutex_unlock(&ra_lock);
+}
+
+static void *ra_worker(void *arg)
+{
+    struct ra_request req;
+    MYSQL *mysql;
+    int ret;
+
+    (void) arg;
+    mysql_thread_init();
+    pool_thread_unbound();
+
+    pthread_mutex_lock(&ra_lock);
+    while (ra_running) {
+	if (!ra_count) {
+	    pthread_cond_wait(&ra_cond, &ra_lock);
+	    continue;
+	}
+	req = ra_queue[ra_head];
+	ra_head = (ra_head + 1) % RA_QUEUE;
+	ra_count--;
+	pthread_mutex_unlock(&ra_lock);
+
+	/* Prefetched blocks go to the cache, which must not get a replica's. */
+	if ((mysql = pool_get()) != NULL) {
+	    ret = query_prefetch(mysql, req.inode, req.first, req.last);
+	    log_printf(LOG_D_OTHER, "%s(%ld, %lu-%lu) = %d\n", __func__,
+		       req.inode, req.first, req.last, ret);
+	    pool_put(mysql);
+	}
+
+	pthread_mutex_lock(&ra_lock);
+    }
+    pthread_mutex_unlock(&ra_lock);
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+int ra_init(unsigned int max_kb)
+{
+    ra_max_blocks = (unsigned long)max_kb * 1024 / data_block_size;
+
+    if (!ra_max_blocks || !bcache_enabled()) {
+	ra_max_blocks = 0;
+	log_printf(LOG_INFO, "read-ahead disabled\n");
+	return 0;
+    }
+
+    log_printf(LOG_INFO, "read-ahead: up to %u blocks\n", ra_max_blocks);
+
+    return 0;
+}
+
+int ra_start()
+{
+    int ret = 0;
+
+    if (!ra_max_blocks)
+	return 0;
+
+    ra_running = 1;
+    for (ra_nthreads = 0; ra_nthreads < RA_THREADS; ra_nthreads++) {
+	ret = pthread_create(&ra_threads[ra_nthreads], NULL, ra_worker, NULL);
+	if (ret) {
+	    log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ret));
+	    break;
+	}
+    }
+
+    if (!ra_nthreads) {
+	ra_running = 0;
+	ra_max_blocks = 0;
+	return -ret;
+    }
+
+    return 0;
+}
+
+void ra_stop()
+{
+    int i;
+
+    if (!ra_running)
+	return;
+
+    pthread_mutex_lock(&ra_lock);
+    ra_running = 0;
+    ra_count = 0;
+    pthread_cond_broadcast(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+
+    for (i = 0; i < ra_nthreads; i++)
+	pthread_join(ra_threads[i], NULL);
+    ra_nthreads = 0;
+}
+
+void ra_read(struct fhandle *fh, off_t offset, size_t size)
+{
+    unsigned long first, last, from, to;
+    unsigned int window;
+
+    if (!ra_max_blocks || !size)
+	return;
+
+    first = offset / data_block_size;
+    last = (offset + size - 1) / data_block_size;
+
+    pthread_mutex_lock(&fh->lock);
+
+    if (offset != fh->ra_next) {
+	/* Random access: close the window. */
+	fh->ra_window = 0;
+	fh->ra_end = 0;
+    } else if (!fh->ra_window) {
+	window = 2 * (last - first + 1);
+	fh->ra_window = MIN(MAX(window, RA_MIN_BLOCKS), ra_max_blocks);
+	fh->ra_end = last + 1;
+    }
+    fh->ra_next = offset + size;
+
+    if (fh->ra_window && last + fh->ra_window / 2 >= fh->ra_end) {
+	from = MAX(fh->ra_end, last + 1);
+	to = last + fh->ra_window;
+	fh->ra_end = to + 1;
+	fh->ra_window = MIN(2 * fh->ra_window, ra_max_blocks);
+	pthread_mutex_unlock(&fh->lock);
+
+	ra_submit(fh->inode, from, to);
+	return;
+    }
+
+    pthread_mutex_unlock(&fh->lock);
+}
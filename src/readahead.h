@@ -0,0 +1,21 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Set the largest read-ahead window; 0 disables read-ahead */
+int ra_init(unsigned int max_kb);
+
+/** Start the prefetch threads (to be called once FUSE is running) */
+int ra_start();
+
+/** Stop the prefetch threads, dropping pending requests */
+void ra_stop();
+
+/** Account for a read on fh and prefetch what the next reads will want */
+void ra_read(struct fhandle *fh, off_t offset, size_t size);
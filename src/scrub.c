@@ -0,0 +1,192 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fuse/fuse.h>
+
+#include <mysql/mysql.h>
+
+#include "mysqlfs.h"
+#include "scrub.h"
+#include "query.h"
+#include "pool.h"
+#include "log.h"
+
+/*
+ * Online scrubbing: while mounted, a background thread goes round the
+ * inodes a range at a time with query_scrub_range(), and checks the
+ * statistics at the end of every round.  It takes a single connection
+ * for a range at a time, and keeps to the configured rate of inodes a
+ * second; a range that took long, a sign of a busy server, is followed
+ * by a pause of SCRUB_BACKOFF times as long.  Where it is in the round
+ * is recorded in SW_DETAILS, so rounds carry on across mounts.
+ */
+
+#define SCRUB_MAX_CHUNK	10000	/**< most inodes scrubbed in one go */
+#define SCRUB_BACKOFF	4	/**< pause after a range, in times the range took */
+#define SCRUB_SAVE_SECS	60	/**< how often the position is recorded */
+
+static unsigned int scrub_rate = 0;
+static unsigned long scrub_chunk;
+
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t scrub_thread;
+static int scrub_running = 0;
+
+static long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/** Wait for ms milliseconds, or until scrub_stop(); false once stopped */
+static int scrub_sleep(long ms)
+{
+    struct timespec ts;
+    int running;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+	ts.tv_sec++;
+	ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&scrub_lock);
+    if (scrub_running)
+	pthread_cond_timedwait(&scrub_cond, &scrub_lock, &ts);
+    running = scrub_running;
+    pthread_mutex_unlock(&scrub_lock);
+
+    return running;
+}
+
+static void *scrub_worker(void *arg)
+{
+    struct timespec start, saved;
+    MYSQL *mysql;
+    long next = 0, end = 0, took;
+    unsigned long repaired = 0;
+    int ret;
+
+    (void) arg;
+    mysql_thread_init();
+    pool_thread_unbound();
+    clock_gettime(CLOCK_MONOTONIC, &saved);
+
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	took = 0;
+	if (!(mysql = pool_get()))
+	    continue;
+
+	if (!next)
+	    next = query_scrub_get_position(mysql);
+	if (next > end)
+	    end = query_fsck_span(mysql);
+
+	if (end < 0) {
+	    ret = end;
+	    end = 0;
+	} else if (next > end) {
+	    /* End of a round */
+	    ret = query_scrub_totals(mysql);
+	    if (ret > 0)
+		repaired++;
+	    log_printf(LOG_INFO, "scrub: checked inodes 1 to %ld, %lu problems repaired\n",
+		       end, repaired);
+	    repaired = 0;
+	    next = 1;
+	    end = query_fsck_span(mysql);
+	} else {
+	    ret = query_scrub_range(mysql, next, next + scrub_chunk - 1);
+	    if (ret >= 0) {
+		repaired += ret;
+		next += scrub_chunk;
+	    }
+	}
+
+	if (ret < 0)
+	    log_printf(LOG_ERROR, "scrub: error %d at inode %ld, trying again later\n", ret, next);
+	if (elapsed_ms(&saved) >= SCRUB_SAVE_SECS * 1000) {
+	    query_scrub_set_position(mysql, next);
+	    clock_gettime(CLOCK_MONOTONIC, &saved);
+	}
+	pool_put(mysql);
+
+	took = elapsed_ms(&start);
+    } while (scrub_sleep(MAX((long)(scrub_chunk * 1000 / scrub_rate), SCRUB_BACKOFF * took)));
+
+    if (next && (mysql = pool_get()) != NULL) {
+	query_scrub_set_position(mysql, next);
+	pool_put(mysql);
+    }
+
+    mysql_thread_end();
+
+    return NULL;
+}
+
+int scrub_init(unsigned int rate)
+{
+    scrub_rate = rate;
+    if (!scrub_rate) {
+	log_printf(LOG_INFO, "scrubber disabled\n");
+	return 0;
+    }
+
+    scrub_chunk = MIN(scrub_rate, SCRUB_MAX_CHUNK);
+    log_printf(LOG_INFO, "scrubber: %u inodes a second, %lu at a time\n", scrub_rate, scrub_chunk);
+
+    return 0;
+}
+
+int scrub_start()
+{
+    int ret;
+
+    if (!scrub_rate)
+	return 0;
+
+    scrub_running = 1;
+    ret = pthread_create(&scrub_thread, NULL, scrub_worker, NULL);
+    if (ret) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ret));
+	scrub_running = 0;
+	return -ret;
+    }
+
+    return 0;
+}
+
+void scrub_stop()
+{
+    if (!scrub_running)
+	return;
+
+    pthread_mutex_lock(&scrub_lock);
+    scrub_running = 0;
+    pthread_cond_broadcast(&scrub_cond);
+    pthread_mutex_unlock(&scrub_lock);
+
+    pthread_join(scrub_thread, NULL);
+}
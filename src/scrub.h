@@ -0,0 +1,18 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Set how many inodes a second the scrubber checks; 0 disables it */
+int scrub_init(unsigned int rate);
+
+/** Start the scrubber thread (to be called once FUSE is running) */
+int scrub_start();
+
+/** Stop the scrubber thread, recording where it is to go on */
+void scrub_stop();
@@ -0,0 +1,15 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Length of a SHA-256 digest, in bytes */
+#define SHA256_LEN	32
+
+/** SHA-256 digest of len bytes of data */
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_LEN]);
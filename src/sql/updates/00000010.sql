@@ -0,0 +1,9 @@
+-- Bogus BEGIN since TABLE definitions are not transaction-safe.
+BEGIN;
+
+-- How the data of each block is compressed, 0 for not at all.
+-- datalength keeps holding the uncompressed length.
+ALTER TABLE `data_blocks` ADD COLUMN `codec` TINYINT(3) UNSIGNED NOT NULL DEFAULT '0';
+
+-- Commit everything
+COMMIT;
@@ -0,0 +1,43 @@
+-- Bogus BEGIN since TABLE definitions are not transaction-safe.
+BEGIN;
+
+-- Payloads of deduplicated data blocks, named by the SHA-256 of their
+-- uncompressed contents.  refs counts the data_blocks rows using them.
+CREATE TABLE IF NOT EXISTS `data_blobs` (
+  `hash` binary(32) NOT NULL,
+  `data` longblob,
+  `datalength` int(8) unsigned NOT NULL DEFAULT '0',
+  `codec` tinyint(3) unsigned NOT NULL DEFAULT '0',
+  `refs` int(10) unsigned NOT NULL DEFAULT '0',
+  PRIMARY KEY (`hash`)
+) ENGINE=InnoDB DEFAULT CHARSET=binary;
+
+-- A deduplicated block has a hash and no data of its own.
+ALTER TABLE `data_blocks` ADD COLUMN `hash` binary(32) NULL DEFAULT NULL;
+
+-- Commit everything
+COMMIT;
+
+-- mysqlfs takes a reference before it points a block at a payload; the
+-- references go away with the blocks, whatever removes or replaces them.
+-- Foreign key cascades don't fire triggers: data blocks are deleted
+-- explicitly before their inode, and fsck recounts the references.
+/*!40101 SET @OLD_SQL_MODE=@@SQL_MODE */;
+
+DELIMITER ;;
+/*!50003 SET SESSION SQL_MODE="STRICT_TRANS_TABLES,NO_ENGINE_SUBSTITUTION" */;;
+/*!50003 CREATE TRIGGER `after_data_blocks_update` AFTER UPDATE ON `data_blocks` FOR EACH ROW BEGIN
+    IF OLD.hash IS NOT NULL THEN
+        UPDATE data_blobs SET refs = refs - 1 WHERE hash = OLD.hash AND refs > 0;
+        DELETE FROM data_blobs WHERE hash = OLD.hash AND refs = 0;
+    END IF;
+END */;;
+/*!50003 SET SESSION SQL_MODE="STRICT_TRANS_TABLES,NO_ENGINE_SUBSTITUTION" */;;
+/*!50003 CREATE TRIGGER `after_data_blocks_delete` AFTER DELETE ON `data_blocks` FOR EACH ROW BEGIN
+    IF OLD.hash IS NOT NULL THEN
+        UPDATE data_blobs SET refs = refs - 1 WHERE hash = OLD.hash AND refs > 0;
+        DELETE FROM data_blobs WHERE hash = OLD.hash AND refs = 0;
+    END IF;
+END */;;
+DELIMITER ;
+/*!50003 SET SESSION SQL_MODE=@OLD_SQL_MODE */;
@@ -0,0 +1,9 @@
+-- Bogus BEGIN since TABLE definitions are not transaction-safe.
+BEGIN;
+
+-- Block 0 of a small file or symlink, kept with its inode instead of in
+-- data_blocks; NULL when the file's data is in data_blocks.
+ALTER TABLE `inodes` ADD COLUMN `inline_data` blob NULL DEFAULT NULL;
+
+-- Commit everything
+COMMIT;
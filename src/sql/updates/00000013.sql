@@ -0,0 +1,11 @@
+-- Bogus BEGIN since TABLE definitions are not transaction-safe.
+BEGIN;
+
+-- Number of directory entries of each inode, kept up to date by mysqlfs
+-- instead of being counted in the tree table on every getattr.
+ALTER TABLE `inodes` ADD COLUMN `nlink` int(10) unsigned NOT NULL DEFAULT '0';
+
+UPDATE `inodes` i SET `nlink` = (SELECT COUNT(*) FROM `tree` t WHERE t.inode = i.inode);
+
+-- Commit everything
+COMMIT;
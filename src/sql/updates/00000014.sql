@@ -0,0 +1,9 @@
+-- Bogus BEGIN since TABLE definitions are not transaction-safe.
+BEGIN;
+
+-- fsck recounts the references to deduplicated payloads a range of
+-- hashes at a time.
+ALTER TABLE `data_blocks` ADD KEY `hash` (`hash`);
+
+-- Commit everything
+COMMIT;
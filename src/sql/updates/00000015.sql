@@ -0,0 +1,21 @@
+-- Bogus BEGIN since TABLE definitions are not transaction-safe.
+BEGIN;
+
+-- Removing the last directory entry of an inode no longer deletes the
+-- inode, and all of its data blocks, in the same transaction: mysqlfs
+-- marks it deleted, and its garbage collector removes the data blocks a
+-- few at a time before the inode.
+ALTER TABLE `inodes` DROP FOREIGN KEY `inodes_ibfk_1`;
+
+-- The garbage collector looks for the inodes marked deleted.
+ALTER TABLE `inodes` ADD KEY `deleted` (`deleted`, `inuse`);
+
+-- The statistics follow the inodes rows: an inode counts until it is
+-- removed, which before_inodes_delete accounts for.
+DROP TRIGGER IF EXISTS `before_tree_delete`;
+
+UPDATE statistics SET statistics.value = (select COUNT(*) from inodes) WHERE statistics.key = 'total_inodes_count';
+UPDATE statistics SET statistics.value = (select IFNULL(SUM(size), 0) from inodes) WHERE statistics.key = 'total_inodes_size';
+
+-- Commit everything
+COMMIT;
@@ -0,0 +1,57 @@
+-- The statistics are striped over 16 slots, the slot of an inode being
+-- its number modulo 16, so that concurrent writers don't all wait for the
+-- lock of a single row.  The totals are the sums of the slots.
+ALTER TABLE `statistics`
+  ADD COLUMN `slot` tinyint(3) unsigned NOT NULL DEFAULT '0',
+  DROP PRIMARY KEY,
+  ADD PRIMARY KEY (`key`, `slot`);
+
+INSERT INTO `statistics` (`key`, `slot`, `value`)
+SELECT s.`key`, n.slot, '0'
+FROM `statistics` s,
+     (SELECT 1 AS slot UNION ALL SELECT 2 UNION ALL SELECT 3 UNION ALL SELECT 4
+      UNION ALL SELECT 5 UNION ALL SELECT 6 UNION ALL SELECT 7 UNION ALL SELECT 8
+      UNION ALL SELECT 9 UNION ALL SELECT 10 UNION ALL SELECT 11 UNION ALL SELECT 12
+      UNION ALL SELECT 13 UNION ALL SELECT 14 UNION ALL SELECT 15) n
+WHERE s.slot = 0;
+
+DROP TRIGGER IF EXISTS `before_inodes_insert`;
+DROP TRIGGER IF EXISTS `before_inodes_update`;
+DROP TRIGGER IF EXISTS `before_inodes_delete`;
+
+/*!40101 SET @OLD_SQL_MODE=@@SQL_MODE, SQL_MODE='NO_AUTO_VALUE_ON_ZERO' */;
+
+DELIMITER ;;
+/*!50003 SET SESSION SQL_MODE="STRICT_TRANS_TABLES,NO_ENGINE_SUBSTITUTION" */;;
+/*!50003 CREATE TRIGGER `before_inodes_insert` BEFORE INSERT ON `inodes` FOR EACH ROW BEGIN
+    UPDATE statistics
+    SET statistics.value = statistics.value + NEW.size
+    WHERE statistics.key = 'total_inodes_size' AND statistics.slot = NEW.inode % 16;
+
+    UPDATE statistics
+    SET statistics.value = statistics.value + 1
+    WHERE statistics.key = 'total_inodes_count' AND statistics.slot = NEW.inode % 16;
+
+END */;;
+/*!50003 SET SESSION SQL_MODE="STRICT_TRANS_TABLES,NO_ENGINE_SUBSTITUTION" */;;
+/*!50003 CREATE TRIGGER `before_inodes_update` BEFORE UPDATE ON `inodes` FOR EACH ROW BEGIN
+    IF NEW.size <> OLD.size THEN
+        UPDATE statistics
+        SET statistics.value = statistics.value - OLD.size + NEW.size
+        WHERE statistics.key = 'total_inodes_size' AND statistics.slot = NEW.inode % 16;
+    END IF;
+END */;;
+/*!50003 SET SESSION SQL_MODE="STRICT_TRANS_TABLES,NO_ENGINE_SUBSTITUTION" */;;
+/*!50003 CREATE TRIGGER `before_inodes_delete` BEFORE DELETE ON `inodes` FOR EACH ROW BEGIN
+
+    UPDATE statistics
+    SET statistics.value = statistics.value - OLD.size
+    WHERE statistics.key = 'total_inodes_size' AND statistics.slot = OLD.inode % 16;
+
+    UPDATE statistics
+    SET statistics.value = statistics.value - 1
+    WHERE statistics.key = 'total_inodes_count' AND statistics.slot = OLD.inode % 16;
+
+END */;;
+DELIMITER ;
+/*!50003 SET SESSION SQL_MODE=@OLD_SQL_MODE */;